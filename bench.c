@@ -0,0 +1,1201 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "pami-lisp.c"
+
+/* deterministic, so runs are comparable */
+uint32_t rng_state = 2463534242u;
+
+uint32_t rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* the time stamp counter where there's one, it ticks at a fixed
+ * rate close to the nominal clock of the cpu
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES "cycles"
+uint64_t now_cycles() {
+  return __rdtsc();
+}
+#else
+#define CYCLES "ns"
+uint64_t now_cycles() {
+  return now_ns();
+}
+#endif
+
+int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+/* sorts the samples in place */
+void report_in(const char* name, uint64_t* samples, size_t n, const char* unit) {
+  if (n == 0) {
+    printf("%-40s no samples\n", name);
+    return;
+  }
+  qsort(samples, n, sizeof(uint64_t), cmp_u64);
+  printf("%-40s min %6lu  median %6lu  p99 %6lu  max %8lu (%s)\n", name,
+         (unsigned long)samples[0],
+         (unsigned long)samples[n/2],
+         (unsigned long)samples[n - n/100 - 1],
+         (unsigned long)samples[n-1], unit);
+}
+
+void report(const char* name, uint64_t* samples, size_t n) {
+  report_in(name, samples, n, "ns");
+}
+
+/*
+ * allocation traces replayed against each allocator
+ */
+
+#define TRACE_HEAP (1 << 20)
+#define TRACE_SLOTS 8192
+#define TRACE_OPS 200000
+#define TRACE_SAMPLES 16
+
+typedef struct {
+  uint32_t slot;
+  uint32_t size;  /* 0 frees the slot */
+} trace_op;
+
+trace_op trace[TRACE_OPS];
+bool trace_live[TRACE_SLOTS];
+void* trace_slots[TRACE_SLOTS];
+uint64_t trace_alloc_cycles[TRACE_OPS];
+uint64_t trace_free_cycles[TRACE_OPS];
+uint8_t trace_heap[TRACE_HEAP];
+
+size_t trace_push(size_t n, size_t slot, size_t size) {
+  trace[n].slot = (uint32_t)slot;
+  trace[n].size = (uint32_t)size;
+  trace_live[slot] = size != 0;
+  return n + 1;
+}
+
+size_t trace_string_size() {
+  /* mostly small strings, sometimes a big one */
+  if (rng()%16 == 0) {
+    return 64 + rng()%1024;
+  }
+  return 1 + rng()%48;
+}
+
+/* fills the slots, frees every other one, then churns at random */
+size_t trace_random() {
+  size_t n = 0, slot;
+  for (slot = 0; slot < TRACE_SLOTS; slot++) {
+    n = trace_push(n, slot, trace_string_size());
+  }
+  for (slot = 0; slot < TRACE_SLOTS; slot += 2) {
+    n = trace_push(n, slot, 0);
+  }
+  while (n < TRACE_OPS) {
+    slot = rng()%TRACE_SLOTS;
+    n = trace_push(n, slot, trace_live[slot] ? 0 : trace_string_size());
+  }
+  return n;
+}
+
+/* objects die in the reverse order they were made */
+size_t trace_lifo() {
+  size_t n = 0, depth = 0, k;
+  while (n < TRACE_OPS) {
+    for (k = 1 + rng()%64; k > 0 && depth < TRACE_SLOTS && n < TRACE_OPS; k--) {
+      n = trace_push(n, depth++, trace_string_size());
+    }
+    for (k = rng()%(depth + 1); k > 0 && n < TRACE_OPS; k--) {
+      n = trace_push(n, --depth, 0);
+    }
+  }
+  return n;
+}
+
+/* objects die in the order they were made, a queue of varying length */
+size_t trace_fifo() {
+  size_t n = 0, head = 0, tail = 0, length = 1000;
+  while (n < TRACE_OPS) {
+    if (tail - head < length) {
+      n = trace_push(n, tail++ % TRACE_SLOTS, trace_string_size());
+    } else {
+      n = trace_push(n, head++ % TRACE_SLOTS, 0);
+      if (rng()%1000 == 0) {
+        length = 500 + rng()%4000;
+      }
+    }
+  }
+  return n;
+}
+
+/* bursts of cells with a string now and then, each followed by a
+ * sweep in address order that frees most of what's live
+ */
+size_t trace_lisp() {
+  size_t n = 0, slot = 0, k;
+  while (n < TRACE_OPS) {
+    for (k = 200 + rng()%1800; k > 0 && n < TRACE_OPS; k--) {
+      while (trace_live[slot]) {
+        slot = (slot + 1) % TRACE_SLOTS;
+      }
+      n = trace_push(n, slot, rng()%8 == 0 ? 1 + rng()%64 : sizeof(datum));
+    }
+    for (slot = 0; slot < TRACE_SLOTS && n < TRACE_OPS; slot++) {
+      if (trace_live[slot] && rng()%8 != 0) {
+        n = trace_push(n, slot, 0);
+      }
+    }
+    slot = 0;
+  }
+  return n;
+}
+
+typedef struct {
+  const char* name;
+  size_t (*generate)();
+  bool lifo;
+} trace_kind;
+
+trace_kind trace_kinds[] = {
+  { "random", trace_random, false },
+  { "lifo", trace_lifo, true },
+  { "fifo", trace_fifo, false },
+  { "lisp", trace_lisp, false },
+};
+
+/* the stack only replays lifo traces, and the pool ignores sizes */
+enum trace_allocator {
+  ta_pool,
+  ta_fl,
+  ta_fl_classes,
+  ta_sf
+};
+
+pool* trace_pool;
+freelist* trace_fl;
+stack_f* trace_sf;
+
+/* a fresh allocator over the whole heap */
+void trace_create(enum trace_allocator a) {
+  enum pool_RES pres;
+  enum fl_RES flres;
+  enum sf_RES sfres;
+  switch (a) {
+    case ta_pool:
+      trace_pool = pool_create(trace_heap, TRACE_HEAP, sizeof(datum), &pres);
+      break;
+    case ta_fl:
+    case ta_fl_classes:
+      trace_fl = fl_create(trace_heap, TRACE_HEAP, &flres);
+      trace_fl->nclasses = a == ta_fl ? 0 : FL_CLASSES;
+      break;
+    case ta_sf:
+      trace_sf = sf_create(trace_heap, TRACE_HEAP, 64, &sfres);
+      break;
+  }
+}
+
+/* back to empty, the way an embedder reuses a region */
+void trace_reset(enum trace_allocator a) {
+  switch (a) {
+    case ta_pool:
+      pool_free_all(trace_pool);
+      break;
+    case ta_fl:
+    case ta_fl_classes:
+      fl_free_all(trace_fl);
+      break;
+    case ta_sf:
+      sf_free_all(trace_sf);
+      break;
+  }
+}
+
+void* trace_alloc(enum trace_allocator a, size_t size) {
+  switch (a) {
+    case ta_pool:
+      return pool_alloc(trace_pool);
+    case ta_sf:
+      return sf_alloc(trace_sf);
+    default:
+      return fl_alloc(trace_fl, size);
+  }
+}
+
+void trace_free(enum trace_allocator a, void* ptr) {
+  switch (a) {
+    case ta_pool:
+      pool_free(trace_pool, ptr);
+      break;
+    case ta_sf:
+      sf_free(trace_sf);
+      break;
+    default:
+      fl_free(trace_fl, ptr);
+      break;
+  }
+}
+
+/* 0 when all the free memory is in one block, close to 1 when it's
+ * split in pieces too small for anything
+ */
+double trace_fragmentation() {
+  size_t available = fl_available(trace_fl);
+  if (available == 0) {
+    return 0;
+  }
+  return 1.0 - (double)fl_largest(trace_fl) / (double)available;
+}
+
+void trace_bench(enum trace_allocator a, const trace_kind* kind) {
+  const char* names[] = { "pool", "fl (no classes)", "fl (size classes)", "stack" };
+  size_t n, i, nalloc = 0, nfree = 0, failed = 0;
+  double frag[TRACE_SAMPLES], peak = 0;
+  uint64_t t, total;
+  void* ptr;
+  char name[64];
+
+  rng_state = 2463534242u;
+  memset(trace_live, 0, sizeof(trace_live));
+  n = kind->generate();
+  trace_create(a);
+
+  /* timed op by op, sampling fragmentation along the way */
+  for (i = 0; i < n; i++) {
+    if (trace[i].size != 0) {
+      t = now_cycles();
+      ptr = trace_alloc(a, trace[i].size);
+      trace_alloc_cycles[nalloc++] = now_cycles() - t;
+      failed += ptr == NULL;
+      trace_slots[trace[i].slot] = ptr;
+    } else if (trace_slots[trace[i].slot] != NULL) {
+      t = now_cycles();
+      trace_free(a, trace_slots[trace[i].slot]);
+      trace_free_cycles[nfree++] = now_cycles() - t;
+    }
+    if ((a == ta_fl || a == ta_fl_classes) && (i + 1) % (n / TRACE_SAMPLES) == 0 &&
+        (i + 1) / (n / TRACE_SAMPLES) <= TRACE_SAMPLES) {
+      frag[(i + 1) / (n / TRACE_SAMPLES) - 1] = trace_fragmentation();
+      if (frag[(i + 1) / (n / TRACE_SAMPLES) - 1] > peak) {
+        peak = frag[(i + 1) / (n / TRACE_SAMPLES) - 1];
+      }
+    }
+  }
+
+  /* and as a whole for throughput */
+  trace_reset(a);
+  t = now_ns();
+  for (i = 0; i < n; i++) {
+    if (trace[i].size != 0) {
+      trace_slots[trace[i].slot] = trace_alloc(a, trace[i].size);
+    } else if (trace_slots[trace[i].slot] != NULL) {
+      trace_free(a, trace_slots[trace[i].slot]);
+    }
+  }
+  total = now_ns() - t;
+
+  sprintf(name, "%s, %s: alloc", names[a], kind->name);
+  report_in(name, trace_alloc_cycles, nalloc, CYCLES);
+  sprintf(name, "%s, %s: free", names[a], kind->name);
+  report_in(name, trace_free_cycles, nfree, CYCLES);
+  printf("%40s %.1f M ops/s, %lu failed allocations\n", "",
+         (double)n / ((double)total / 1e9) / 1e6, (unsigned long)failed);
+  if (a == ta_fl || a == ta_fl_classes) {
+    printf("%40s fragmentation peak %.1f%%, over time:", "", peak * 100);
+    for (i = 0; i < TRACE_SAMPLES - 1; i += 3) {
+      printf(" %.0f%%", frag[i] * 100);
+    }
+    printf(" %.0f%%\n", frag[TRACE_SAMPLES - 1] * 100);
+  }
+}
+
+void trace_bench_all() {
+  size_t k;
+  enum trace_allocator a;
+  for (k = 0; k < sizeof(trace_kinds)/sizeof(trace_kinds[0]); k++) {
+    for (a = ta_pool; a <= ta_sf; a++) {
+      if (a != ta_sf || trace_kinds[k].lifo) {
+        trace_bench(a, &trace_kinds[k]);
+      }
+    }
+  }
+}
+
+/*
+ * lexer and parser throughput over corpora of different shapes
+ */
+
+#define CORPUS_SIZE (1 << 20)
+#define CORPUS_PARSE_SIZE (1 << 18)
+#define CORPUS_FORM 4096
+#define CORPUS_RUNS 20
+#define CORPUS_NAMES 64
+
+char corpus_text[CORPUS_SIZE + 1];  /* always NUL terminated */
+char corpus_names[CORPUS_NAMES][64];
+uint64_t corpus_cycles[CORPUS_RUNS];
+uint64_t corpus_ns[CORPUS_RUNS];
+uint8_t corpus_env_buff[1 << 24];
+
+/* writes one top level form (at most CORPUS_FORM bytes) to 'out',
+ * returns its size
+ */
+typedef size_t (*corpus_form)(char* out);
+
+typedef struct {
+  const char* name;
+  corpus_form form;
+} corpus;
+
+size_t corpus_put(char* out, size_t size, const char* s) {
+  size_t len = strlen(s);
+  memcpy(out + size, s, len);
+  return size + len;
+}
+
+#define CORPUS_PICK(words) (words[rng()%(sizeof(words)/sizeof(words[0]))])
+
+const char* corpus_code_pieces[] = {
+  "(if (> (car event) 0x1F) (+ 1.25 count_3) nil) ",
+  "\"a string literal with \\\"escapes\\\" and ünïcödé\" ",
+  "# a comment explaining the next few lines of the script\n  ",
+  "'(alpha beta gamma 123 0b1010 true false) ",
+  "(set! total (+ total (* 3 x))) ",
+};
+
+/* a bit of everything */
+size_t corpus_code(char* out) {
+  size_t size = corpus_put(out, 0, "(define (handler-name event)\n  ");
+  int n = 1 + rng()%8;
+  while (n-- > 0) {
+    size = corpus_put(out, size, CORPUS_PICK(corpus_code_pieces));
+  }
+  return corpus_put(out, size, ")\n");
+}
+
+/* lists inside lists, up to 64 deep */
+size_t corpus_nested(char* out) {
+  size_t size = 0;
+  int depth = 1 + rng()%64, i;
+  for (i = 0; i < depth; i++) {
+    size = corpus_put(out, size, i%3 == 0 ? "(node 1 " : "(f ");
+  }
+  size = corpus_put(out, size, "leaf");
+  for (i = 0; i < depth; i++) {
+    out[size++] = ')';
+  }
+  out[size++] = '\n';
+  return size;
+}
+
+/* a vocabulary of names between 16 and 63 runes */
+void corpus_init_names() {
+  const char alphabet[] = "abcdefghijklmnopqrstuvwxyz-_0123456789";
+  size_t i, j, len;
+  rng_state = 2463534242u;
+  for (i = 0; i < CORPUS_NAMES; i++) {
+    len = 16 + rng()%48;
+    corpus_names[i][0] = alphabet[rng()%26];
+    for (j = 1; j < len; j++) {
+      corpus_names[i][j] = alphabet[rng()%(sizeof(alphabet) - 1)];
+    }
+    corpus_names[i][len] = 0;
+  }
+}
+
+size_t corpus_identifiers(char* out) {
+  size_t size = corpus_put(out, 0, "(");
+  int n = 2 + rng()%8;
+  while (n-- > 0) {
+    size = corpus_put(out, size, corpus_names[rng()%CORPUS_NAMES]);
+    out[size++] = n > 0 ? ' ' : ')';
+  }
+  out[size++] = '\n';
+  return size;
+}
+
+/* rows of a sensor table */
+size_t corpus_numbers(char* out) {
+  size_t size = corpus_put(out, 0, "'(");
+  int n = 8;
+  while (n-- > 0) {
+    switch (rng()%4) {
+      case 0:
+        size += (size_t)sprintf(out + size, "%u", (unsigned)(rng()%100000));
+        break;
+      case 1:
+        size += (size_t)sprintf(out + size, "%u.%02u", (unsigned)(rng()%1000), (unsigned)(rng()%100));
+        break;
+      case 2:
+        size += (size_t)sprintf(out + size, "0.%09u", (unsigned)(rng()%1000000000));
+        break;
+      default:
+        size += (size_t)sprintf(out + size, "0x%X", (unsigned)(rng()%65536));
+        break;
+    }
+    out[size++] = n > 0 ? ' ' : ')';
+  }
+  out[size++] = '\n';
+  return size;
+}
+
+const char* corpus_words[] = {
+  "the", "sensor", "reads", "twice", "before", "settling,", "see", "the",
+  "datasheet", "for", "timing", "(section", "4.2)", "and", "errata",
+};
+
+/* long comments with a little code in between */
+size_t corpus_comments(char* out) {
+  size_t size = 0;
+  int lines = 1 + rng()%4, n;
+  while (lines-- > 0) {
+    size = corpus_put(out, size, "# ");
+    for (n = 4 + rng()%20; n > 0; n--) {
+      size = corpus_put(out, size, CORPUS_PICK(corpus_words));
+      out[size++] = ' ';
+    }
+    out[size++] = '\n';
+  }
+  return corpus_put(out, size, "(poll sensor)\n");
+}
+
+const char* corpus_utf8_words[] = {
+  "ünïcödé", "Γειά", "σου", "κόσμε", "こんにちは", "世界", "日本語",
+  "𐇺𐇻", "🙂", "température", "naïve", "ascii",
+};
+
+/* strings and comments in several scripts */
+size_t corpus_utf8(char* out) {
+  size_t size = corpus_put(out, 0, "(say \"");
+  int n;
+  for (n = 2 + rng()%10; n > 0; n--) {
+    size = corpus_put(out, size, CORPUS_PICK(corpus_utf8_words));
+    out[size++] = ' ';
+  }
+  size = corpus_put(out, size, "\") # ");
+  for (n = 2 + rng()%10; n > 0; n--) {
+    size = corpus_put(out, size, CORPUS_PICK(corpus_utf8_words));
+    out[size++] = ' ';
+  }
+  out[size++] = '\n';
+  return size;
+}
+
+corpus corpora[] = {
+  { "code", corpus_code },
+  { "nested", corpus_nested },
+  { "identifiers", corpus_identifiers },
+  { "numbers", corpus_numbers },
+  { "comments", corpus_comments },
+  { "utf8", corpus_utf8 },
+};
+
+/* fills corpus_text with forms up to 'cap' bytes, returns its size.
+ * the same corpus always gets the same text
+ */
+size_t corpus_fill(const corpus* c, size_t cap) {
+  char form[CORPUS_FORM];
+  size_t size = 0, len;
+  rng_state = 2463534242u;
+  while (true) {
+    len = c->form(form);
+    if (size + len > cap) {
+      break;
+    }
+    memcpy(corpus_text + size, form, len);
+    size += len;
+  }
+  corpus_text[size] = 0;
+  return size;
+}
+
+/* sorts the samples, throughput is from the median run */
+void corpus_report(const char* name, size_t bytes, size_t lexemes) {
+  double seconds;
+  report_in(name, corpus_cycles, CORPUS_RUNS, CYCLES);
+  qsort(corpus_ns, CORPUS_RUNS, sizeof(uint64_t), cmp_u64);
+  seconds = (double)corpus_ns[CORPUS_RUNS/2] / 1e9;
+  printf("%40s %lu bytes, %lu lexemes: %.1f MB/s, %.2f M lexemes/s\n", "",
+         (unsigned long)bytes, (unsigned long)lexemes,
+         (double)bytes / seconds / 1e6, (double)lexemes / seconds / 1e6);
+}
+
+/* returns the number of lexemes, 0 if there was an error */
+size_t corpus_lex_once(size_t size) {
+  lexer l = lex_new_lexer(corpus_text, size);
+  size_t lexemes = 0;
+  while (lex_next(&l) && l.lexeme.kind != lk_eof) {
+    lexemes++;
+  }
+  if (l.lexeme.kind != lk_eof) {
+    printf("corpus: lexer error %d at %d\n", l.err.code, l.err.range.begin);
+    return 0;
+  }
+  return lexemes;
+}
+
+void corpus_lex(const corpus* c) {
+  size_t size = corpus_fill(c, CORPUS_SIZE);
+  size_t i, lexemes = 0;
+  uint64_t t, cycles;
+  char name[64];
+
+  for (i = 0; i < CORPUS_RUNS; i++) {
+    t = now_ns();
+    cycles = now_cycles();
+    lexemes = corpus_lex_once(size);
+    corpus_cycles[i] = now_cycles() - cycles;
+    corpus_ns[i] = now_ns() - t;
+    if (lexemes == 0) {
+      return;
+    }
+  }
+  sprintf(name, "lex_next (%s)", c->name);
+  corpus_report(name, size, lexemes);
+}
+
+/* every run parses into a fresh environment */
+void corpus_parse(const corpus* c) {
+  size_t size = corpus_fill(c, CORPUS_PARSE_SIZE);
+  size_t lexemes = corpus_lex_once(size);
+  env_config cfg = {0};
+  environment* env;
+  enum env_RES res;
+  datum* out;
+  uint64_t t, cycles;
+  size_t i;
+  char name[64];
+
+  cfg.cells = 1 << 18;
+  cfg.strings = 1 << 20;
+  cfg.parse_depth = 1024;
+  cfg.eval_depth = 64;
+  cfg.values = 64;
+  cfg.symbols = 1024;
+  cfg.gc_depth = 256;
+  cfg.gc_reserve = 64;
+  cfg.gc_string_reserve = 256;
+  cfg.code = 64;
+  cfg.constants = 64;
+  for (i = 0; i < CORPUS_RUNS; i++) {
+    env = env_create(corpus_env_buff, sizeof(corpus_env_buff), &cfg, &res);
+    if (env == NULL) {
+      printf("corpus: %s\n", env_str_res(res));
+      return;
+    }
+    t = now_ns();
+    cycles = now_cycles();
+    if (parse(env, corpus_text, size, &out) == false) {
+      printf("corpus: parse error %d at %d\n", env->err.code, env->err.range.begin);
+      return;
+    }
+    corpus_cycles[i] = now_cycles() - cycles;
+    corpus_ns[i] = now_ns() - t;
+  }
+  sprintf(name, "parse (%s)", c->name);
+  corpus_report(name, size, lexemes);
+}
+
+void corpus_bench() {
+  size_t i;
+  corpus_init_names();
+  for (i = 0; i < sizeof(corpora)/sizeof(corpora[0]); i++) {
+    corpus_lex(&corpora[i]);
+  }
+  for (i = 0; i < sizeof(corpora)/sizeof(corpora[0]); i++) {
+    corpus_parse(&corpora[i]);
+  }
+}
+
+void utf8_bench_report(const char* name, size_t size) {
+  report(name, corpus_ns, CORPUS_RUNS);
+  printf("%40s %.1f MB/s (median)\n", "",
+         (double)size / ((double)corpus_ns[CORPUS_RUNS/2] / 1e9) / 1e6);
+}
+
+/* validation of the utf8 corpus, all at once or one rune at a time
+ * the way the lexer used to
+ */
+void utf8_bench() {
+  corpus c = { "utf8", corpus_utf8 };
+  size_t size = corpus_fill(&c, CORPUS_SIZE);
+  size_t i, at = 0, len;
+  rune r;
+  uint64_t t;
+
+  for (i = 0; i < CORPUS_RUNS; i++) {
+    t = now_ns();
+    at = utf8_valid(corpus_text, size);
+    corpus_ns[i] = now_ns() - t;
+  }
+  if (at != size) {
+    printf("utf8_bench: bad rune at %lu\n", (unsigned long)at);
+    return;
+  }
+  utf8_bench_report("utf8_valid (bulk)", size);
+
+  for (i = 0; i < CORPUS_RUNS; i++) {
+    t = now_ns();
+    for (at = 0; at < size; at += len) {
+      len = utf8_decode(corpus_text + at, size - at, &r);
+      if (len == 0) {
+        break;
+      }
+    }
+    corpus_ns[i] = now_ns() - t;
+  }
+  utf8_bench_report("utf8_decode (per rune)", size);
+}
+
+/*
+ * evaluation of arithmetic heavy code, cells of each layout
+ */
+
+#define EVAL_BENCH_RUNS 200
+
+uint8_t eval_bench_buff[1 << 20];
+uint64_t eval_bench_ns[EVAL_BENCH_RUNS];
+
+const char eval_bench_code[] =
+  "(define (poly x) (+ (* 3 x x) (* 2 x) 1))"
+  "(define (run n acc) (if (= n 0) acc (run (- n 1) (+ acc (poly n)))))";
+
+/* the same code interpreted from the tree or compiled to bytecode */
+bool eval_bench_run(environment* env, bool compiled, const char* text, datum* code, datum** out) {
+  if (compiled) {
+    return vm_run(env, code, out);
+  }
+  return eval_string(env, text, strlen(text), out);
+}
+
+void eval_bench(bool compiled) {
+  env_config cfg = {0};
+  environment* env;
+  enum env_RES res;
+  pool_stats before, after;
+  datum* code = NULL;
+  datum* out;
+  uint64_t t;
+  size_t i;
+
+  cfg.cells = 1 << 14;
+  cfg.strings = 1 << 14;
+  cfg.parse_depth = 256;
+  cfg.eval_depth = 64;
+  cfg.values = 64;
+  cfg.symbols = 256;
+  cfg.gc_depth = 256;
+  cfg.gc_reserve = 256;
+  cfg.gc_string_reserve = 256;
+  cfg.code = 4096;
+  cfg.constants = 256;
+  env = env_create(eval_bench_buff, sizeof(eval_bench_buff), &cfg, &res);
+  if (env == NULL ||
+      (compiled && compile_string(env, eval_bench_code, strlen(eval_bench_code), &code) == false) ||
+      eval_bench_run(env, compiled, eval_bench_code, code, &out) == false ||
+      (compiled && compile_string(env, "(run 1000 0)", 12, &code) == false)) {
+    printf("eval_bench: could not set up the environment\n");
+    return;
+  }
+
+  before = pool_get_stats(env->pool);
+  for (i = 0; i < EVAL_BENCH_RUNS; i++) {
+    t = now_ns();
+    if (eval_bench_run(env, compiled, "(run 1000 0)", code, &out) == false) {
+      printf("eval_bench: evaluation failed\n");
+      return;
+    }
+    eval_bench_ns[i] = now_ns() - t;
+  }
+  after = pool_get_stats(env->pool);
+
+  printf("cells of %d bytes, %lu pool allocations per run\n", (int)sizeof(datum),
+         (unsigned long)((after.allocs - before.allocs)/EVAL_BENCH_RUNS));
+  report(compiled ? "vm (run 1000 0)" : "eval (run 1000 0)", eval_bench_ns, EVAL_BENCH_RUNS);
+}
+
+/*
+ * startup: evaluating a prelude against restoring its snapshot
+ */
+
+#define SNAPSHOT_BENCH_RUNS 50
+#define SNAPSHOT_BENCH_DEFS 200
+
+uint8_t snapshot_bench_image[1 << 20];
+uint64_t snapshot_bench_ns[SNAPSHOT_BENCH_RUNS];
+
+/* many small definitions, like the library a program starts with */
+size_t snapshot_bench_prelude(char* out) {
+  char def[128];
+  size_t at = 0;
+  size_t i;
+
+  for (i = 0; i < SNAPSHOT_BENCH_DEFS; i++) {
+    snprintf(def, sizeof(def),
+             "(define (f%lu x y) (if (< x y) (+ x %lu) (cons y \"s%lu\")))",
+             (unsigned long)i, (unsigned long)i, (unsigned long)i);
+    at = corpus_put(out, at, def);
+  }
+  out[at] = '\0';
+  return at;
+}
+
+env_config snapshot_bench_config() {
+  env_config cfg = {0};
+  cfg.cells = 1 << 14;
+  cfg.strings = 1 << 17;
+  cfg.parse_depth = 256;
+  cfg.eval_depth = 64;
+  cfg.values = 64;
+  cfg.symbols = 1024;
+  cfg.gc_depth = 256;
+  cfg.gc_reserve = 256;
+  cfg.gc_string_reserve = 256;
+  cfg.code = 4096;
+  cfg.constants = 256;
+  return cfg;
+}
+
+void snapshot_bench() {
+  env_config cfg = snapshot_bench_config();
+  environment* env;
+  enum env_RES res;
+  datum* out;
+  size_t prelude;
+  size_t image = 0;
+  uint64_t t;
+  size_t i;
+
+  prelude = snapshot_bench_prelude(corpus_text);
+
+  for (i = 0; i < SNAPSHOT_BENCH_RUNS; i++) {
+    t = now_ns();
+    env = env_create(eval_bench_buff, sizeof(eval_bench_buff), &cfg, &res);
+    if (env == NULL || eval_string(env, corpus_text, prelude, &out) == false) {
+      printf("snapshot_bench: could not evaluate the prelude\n");
+      return;
+    }
+    snapshot_bench_ns[i] = now_ns() - t;
+  }
+  report("create + eval prelude", snapshot_bench_ns, SNAPSHOT_BENCH_RUNS);
+
+  for (i = 0; i < SNAPSHOT_BENCH_RUNS; i++) {
+    t = now_ns();
+    image = env_snapshot(env, snapshot_bench_image, sizeof(snapshot_bench_image));
+    snapshot_bench_ns[i] = now_ns() - t;
+  }
+  if (image == 0) {
+    printf("snapshot_bench: could not take a snapshot\n");
+    return;
+  }
+  report("env_snapshot", snapshot_bench_ns, SNAPSHOT_BENCH_RUNS);
+
+  for (i = 0; i < SNAPSHOT_BENCH_RUNS; i++) {
+    t = now_ns();
+    env = env_restore(eval_bench_buff, sizeof(eval_bench_buff), snapshot_bench_image, image, NULL, 0, &res);
+    snapshot_bench_ns[i] = now_ns() - t;
+    if (env == NULL) {
+      printf("snapshot_bench: could not restore\n");
+      return;
+    }
+  }
+  report("env_restore", snapshot_bench_ns, SNAPSHOT_BENCH_RUNS);
+  printf("image of %lu bytes, %lu for the buffer\n",
+         (unsigned long)image, (unsigned long)env->size);
+  if (eval_string(env, "(f10 1 2)", 9, &out) == false || dt_exact(out) != 11) {
+    printf("snapshot_bench: restored environment is broken\n");
+  }
+}
+
+/* the prelude evaluated in place from a rom instead */
+uint8_t rom_bench_image[1 << 20];
+
+void rom_bench() {
+  env_config cfg = snapshot_bench_config();
+  environment* env;
+  enum env_RES res;
+  datum* out;
+  size_t prelude, size, cells;
+  uint64_t t;
+  size_t i;
+
+  prelude = snapshot_bench_prelude(corpus_text);
+  env = env_create(eval_bench_buff, sizeof(eval_bench_buff), &cfg, &res);
+  if (env == NULL || eval_string(env, corpus_text, prelude, &out) == false) {
+    printf("rom_bench: could not evaluate the prelude\n");
+    return;
+  }
+  gc_collect(env);
+  cells = pool_used(env->pool)/sizeof(datum);
+
+  size = rom_build(env, corpus_text, prelude, rom_bench_image, sizeof(rom_bench_image),
+                   (uintptr_t)rom_bench_image);
+  if (size == 0) {
+    printf("rom_bench: could not build the rom\n");
+    return;
+  }
+  cfg.rom = rom_bench_image;
+  cfg.rom_size = size;
+  for (i = 0; i < SNAPSHOT_BENCH_RUNS; i++) {
+    t = now_ns();
+    env = env_create(eval_bench_buff, sizeof(eval_bench_buff), &cfg, &res);
+    if (env == NULL || eval_program(env, rom_program(env), &out) == false) {
+      printf("rom_bench: could not evaluate the rom\n");
+      return;
+    }
+    snapshot_bench_ns[i] = now_ns() - t;
+  }
+  report("create + eval rom", snapshot_bench_ns, SNAPSHOT_BENCH_RUNS);
+  gc_collect(env);
+  printf("rom of %lu bytes, %lu cells in the pool after the prelude, %lu parsed\n",
+         (unsigned long)size, (unsigned long)(pool_used(env->pool)/sizeof(datum)),
+         (unsigned long)cells);
+}
+
+/*
+ * latency of evaluating in slices with pami_step
+ */
+
+#define STEP_BENCH_SLICES 4096
+
+uint64_t step_bench_ns[STEP_BENCH_SLICES];
+
+void step_bench(size_t budget) {
+  env_config cfg = snapshot_bench_config();
+  pami_instance* p;
+  enum env_RES res;
+  enum pami_RES r = pami_SUSPENDED;
+  char name[64];
+  uint64_t t;
+  size_t n = 0;
+
+  p = pami_create(eval_bench_buff, sizeof(eval_bench_buff), &cfg, &res);
+  if (p == NULL || pami_eval(p, eval_bench_code, strlen(eval_bench_code)) == false ||
+      pami_start(p, "(run 1000 0)", 12) == false) {
+    printf("step_bench: could not set up the instance\n");
+    return;
+  }
+  while (r == pami_SUSPENDED && n < STEP_BENCH_SLICES) {
+    t = now_ns();
+    r = pami_step(p, budget);
+    step_bench_ns[n++] = now_ns() - t;
+  }
+  if (r != pami_OK) {
+    printf("step_bench: evaluation did not finish\n");
+    return;
+  }
+  snprintf(name, sizeof(name), "pami_step(%lu), %lu slices", (unsigned long)budget, (unsigned long)n);
+  report(name, step_bench_ns, n);
+}
+
+/*
+ * green tasks: cost of a turn and of a message
+ */
+
+#define TASK_BENCH_TASKS 32
+#define TASK_BENCH_RUNS 50
+
+uint64_t task_bench_ns[TASK_BENCH_RUNS];
+
+const char task_bench_code[] =
+  "(define (poll n) (yield) (poll (+ n 1)))"
+  "(define (reply msg) (send (car msg) (cdr msg)))"
+  "(define (echo) (reply (receive)) (echo))"
+  "(define (ask to k) (send to (cons (self) k)) (receive))"
+  "(define (ping to n) (ask to n) (ping to (+ n 1)))";
+
+/* 'spawn' is evaluated until every task is taken */
+void task_bench_one(const char* name, const char* spawn, size_t per, size_t turns) {
+  env_config cfg = snapshot_bench_config();
+  environment* env;
+  enum env_RES res;
+  datum* out;
+  uint64_t t;
+  size_t i;
+
+  cfg.tasks = TASK_BENCH_TASKS;
+  cfg.task_depth = 32;
+  cfg.task_values = 32;
+  env = env_create(eval_bench_buff, sizeof(eval_bench_buff), &cfg, &res);
+  if (env == NULL || eval_string(env, task_bench_code, strlen(task_bench_code), &out) == false) {
+    printf("task_bench: could not set up the environment\n");
+    return;
+  }
+  for (i = 0; i < TASK_BENCH_TASKS; i += per) {
+    if (eval_string(env, spawn, strlen(spawn), &out) == false) {
+      printf("task_bench: could not spawn\n");
+      return;
+    }
+  }
+  for (i = 0; i < TASK_BENCH_RUNS; i++) {
+    t = now_ns();
+    sched_run(env, 1000, turns);
+    task_bench_ns[i] = (now_ns() - t)/turns;
+  }
+  report(name, task_bench_ns, TASK_BENCH_RUNS);
+}
+
+void task_bench() {
+  task_bench_one("turn of 32 yielding tasks", "(spawn (lambda () (poll 0)))", 1, 10000);
+  /* half echo, half ask the one spawned right before them */
+  task_bench_one("turn of 16 ping/echo pairs",
+                 "(define last (spawn echo)) (spawn (lambda () (ping last 0)))", 2, 10000);
+}
+
+/*
+ * batches of scripts: setting up an instance for each one, and
+ * throughput as workers are added
+ */
+
+#define BATCH_BENCH_JOBS 10000
+#define BATCH_BENCH_RUNS 200
+#define BATCH_BENCH_WORKERS 16
+
+uint8_t batch_bench_buff[1 << 23];
+uint8_t batch_bench_rom[1 << 16];
+pami_job batch_bench_jobs[BATCH_BENCH_JOBS];
+char batch_bench_texts[8][32];
+uint64_t batch_bench_ns[BATCH_BENCH_RUNS];
+
+env_config batch_bench_config() {
+  env_config cfg = {0};
+  cfg.cells = 4096;
+  cfg.strings = 4096;
+  cfg.parse_depth = 256;
+  cfg.eval_depth = 256;
+  cfg.values = 256;
+  cfg.symbols = 256;
+  cfg.gc_depth = 64;
+  cfg.gc_reserve = 64;
+  cfg.gc_string_reserve = 256;
+  cfg.code = 1024;
+  cfg.constants = 64;
+  return cfg;
+}
+
+void batch_bench() {
+  env_config cfg = batch_bench_config();
+  pami_batch_config bc = {0};
+  environment* env;
+  pami_instance* p;
+  enum env_RES res;
+  size_t size, i, n;
+  size_t cpus = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t t, single = 0;
+
+  env = env_create(batch_bench_buff, sizeof(batch_bench_buff), &cfg, &res);
+  size = env == NULL ? 0 : rom_build(env, eval_bench_code, strlen(eval_bench_code),
+                                     batch_bench_rom, sizeof(batch_bench_rom),
+                                     (uintptr_t)batch_bench_rom);
+  if (size == 0) {
+    printf("batch_bench: could not build the rom\n");
+    return;
+  }
+  cfg.rom = batch_bench_rom;
+  cfg.rom_size = size;
+
+  for (i = 0; i < BATCH_BENCH_RUNS; i++) {
+    t = now_ns();
+    p = pami_create(batch_bench_buff, sizeof(batch_bench_buff), &cfg, &res);
+    batch_bench_ns[i] = now_ns() - t;
+  }
+  report("pami_create", batch_bench_ns, BATCH_BENCH_RUNS);
+  for (i = 0; i < BATCH_BENCH_RUNS; i++) {
+    pami_eval(p, "(run 50 0)", 10);
+    t = now_ns();
+    pami_reset(p);
+    batch_bench_ns[i] = now_ns() - t;
+  }
+  report("pami_reset", batch_bench_ns, BATCH_BENCH_RUNS);
+
+  /* scripts of eight lengths, so the runs of the workers are uneven */
+  for (i = 0; i < 8; i++) {
+    snprintf(batch_bench_texts[i], sizeof(batch_bench_texts[i]), "(run %lu 0)", (unsigned long)(i + 1)*40);
+  }
+  for (i = 0; i < BATCH_BENCH_JOBS; i++) {
+    batch_bench_jobs[i].text = batch_bench_texts[(i*i)%8];
+    batch_bench_jobs[i].size = strlen(batch_bench_jobs[i].text);
+  }
+  printf("batch of %d scripts, %lu cores online\n", BATCH_BENCH_JOBS, (unsigned long)cpus);
+  for (n = 1; n <= BATCH_BENCH_WORKERS && n <= 2*cpus; n *= 2) {
+    if (pami_batch_size(&cfg, n) > sizeof(batch_bench_buff)) {
+      break;
+    }
+    bc.workers = n;
+    t = now_ns();
+    res = pami_batch(batch_bench_buff, sizeof(batch_bench_buff), &cfg, &bc,
+                     batch_bench_jobs, BATCH_BENCH_JOBS);
+    t = now_ns() - t;
+    if (res != env_OK) {
+      printf("batch_bench: %s\n", env_str_res(res));
+      return;
+    }
+    for (i = 0; i < BATCH_BENCH_JOBS; i++) {
+      if (batch_bench_jobs[i].ok == false) {
+        printf("batch_bench: script %lu failed\n", (unsigned long)i);
+        return;
+      }
+    }
+    if (n == 1) {
+      single = t;
+    }
+    printf("%2lu workers: %8.0f scripts/s, %.2fx\n", (unsigned long)n,
+           BATCH_BENCH_JOBS/(t/1e9), (double)single/(double)t);
+  }
+}
+
+/*
+ * concurrent pool: cost of an operation, and throughput as threads
+ * are added, against the plain pool behind a mutex
+ */
+
+#define CPOOL_BENCH_OPS 2000000
+#define CPOOL_BENCH_BURST 64
+#define CPOOL_BENCH_THREADS 16
+
+uint8_t cpool_bench_buff[1 << 22];
+
+typedef struct {
+  cpool* cp;
+  pool* p;
+#ifdef PAMI_THREADS
+  pthread_mutex_t* lock;
+#endif
+} cpool_bench_arg;
+
+/* allocates a burst of chunks and frees them, until 'ops' are done */
+void* cpool_bench_run(void* arg) {
+  cpool_bench_arg* a = (cpool_bench_arg*)arg;
+  void* held[CPOOL_BENCH_BURST];
+  cpool_cache cache;
+  size_t i, j;
+
+  cpool_cache_init(&cache);
+  for (i = 0; i < CPOOL_BENCH_OPS; i += 2*CPOOL_BENCH_BURST) {
+    for (j = 0; j < CPOOL_BENCH_BURST; j++) {
+      if (a->cp != NULL) {
+        held[j] = cpool_alloc(a->cp, &cache);
+      } else {
+#ifdef PAMI_THREADS
+        pthread_mutex_lock(a->lock);
+#endif
+        held[j] = pool_alloc(a->p);
+#ifdef PAMI_THREADS
+        pthread_mutex_unlock(a->lock);
+#endif
+      }
+    }
+    for (j = 0; j < CPOOL_BENCH_BURST; j++) {
+      if (held[j] == NULL) {
+        continue;
+      }
+      if (a->cp != NULL) {
+        cpool_free(a->cp, &cache, held[j]);
+      } else {
+#ifdef PAMI_THREADS
+        pthread_mutex_lock(a->lock);
+#endif
+        pool_free(a->p, held[j]);
+#ifdef PAMI_THREADS
+        pthread_mutex_unlock(a->lock);
+#endif
+      }
+    }
+  }
+  if (a->cp != NULL) {
+    cpool_flush(a->cp, &cache);
+  }
+  return NULL;
+}
+
+/* returns the nanoseconds taken by 'threads' threads */
+uint64_t cpool_bench_one(bool concurrent, size_t threads) {
+  cpool_bench_arg arg;
+  enum pool_RES res;
+  uint64_t t;
+#ifdef PAMI_THREADS
+  pthread_t ids[CPOOL_BENCH_THREADS];
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  size_t i;
+
+  arg.lock = &lock;
+#else
+  (void)threads;
+#endif
+  arg.cp = concurrent ? cpool_create(cpool_bench_buff, sizeof(cpool_bench_buff), 32, &res) : NULL;
+  arg.p = concurrent ? NULL : pool_create(cpool_bench_buff, sizeof(cpool_bench_buff), 32, &res);
+  t = now_ns();
+#ifdef PAMI_THREADS
+  for (i = 0; i < threads; i++) {
+    pthread_create(&ids[i], NULL, cpool_bench_run, &arg);
+  }
+  for (i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+  }
+#else
+  cpool_bench_run(&arg);
+#endif
+  return now_ns() - t;
+}
+
+void cpool_bench() {
+  size_t cpus = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+  size_t most = 1, n;
+  uint64_t locked, shared;
+
+#ifdef PAMI_THREADS
+  most = 2*cpus < CPOOL_BENCH_THREADS ? 2*cpus : CPOOL_BENCH_THREADS;
+#endif
+  printf("%d alloc/free per thread, %lu cores online\n", CPOOL_BENCH_OPS, (unsigned long)cpus);
+  for (n = 1; n <= most; n *= 2) {
+    locked = cpool_bench_one(false, n);
+    shared = cpool_bench_one(true, n);
+    printf("%2lu threads: pool %6.1f Mops/s, cpool %6.1f Mops/s\n", (unsigned long)n,
+           n*CPOOL_BENCH_OPS/(locked/1e3), n*CPOOL_BENCH_OPS/(shared/1e3));
+  }
+}
+
+#ifdef FL_BOUNDARY_TAGS
+#define FL_MODE "boundary tags"
+#else
+#define FL_MODE "address ordered"
+#endif
+
+#ifdef PAMI_COMPACT
+#define DT_MODE "compact"
+#else
+#define DT_MODE "boxed"
+#endif
+
+int main() {
+  printf("freelist mode: %s, datum layout: %s\n", FL_MODE, DT_MODE);
+  trace_bench_all();
+  corpus_bench();
+  utf8_bench();
+  eval_bench(false);
+  eval_bench(true);
+  snapshot_bench();
+  rom_bench();
+  step_bench(256);
+  step_bench(4096);
+  task_bench();
+  batch_bench();
+  cpool_bench();
+  return 0;
+}
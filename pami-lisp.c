@@ -1,9 +1,30 @@
 #include "pami-lisp.h"
 #include <strings.h> /*TODO: reimplement bzero and remove this dependency*/
+#include <string.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#ifdef PAMI_THREADS
+#include <pthread.h>
+#endif
+
+/* the lexer scans in bulk with these when available,
+ * define LEX_NO_SIMD to use plain words instead
+ */
+#if defined(__SSE2__) && !defined(LEX_NO_SIMD)
+#include <emmintrin.h>
+#define LEX_SSE2
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define LEX_SSSE3
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__) && !defined(LEX_NO_SIMD)
+#include <arm_neon.h>
+#define LEX_NEON
+#endif
 
 /*
  * -------------------------------------
@@ -13,6 +34,19 @@
 
 #define WORD sizeof(void*)
 
+/* buffers and the cells of the pool are aligned to this, PAMI_COMPACT
+ * keeps three tag bits in the address of a cell so it needs 8 on
+ * 32-bit targets too
+ */
+#ifdef PAMI_COMPACT
+#define CELL_ALIGN 8
+#else
+#define CELL_ALIGN WORD
+#endif
+
+/* words written by different threads are kept this far apart */
+#define CACHE_LINE 64
+
 size_t distance(const uint8_t* a, const uint8_t* b) {
   if (a > b) {
     return a-b;
@@ -21,6 +55,40 @@ size_t distance(const uint8_t* a, const uint8_t* b) {
   }
 }
 
+/* words shared between threads go through these. loads acquire
+ * and stores release, so what was written before a store is seen
+ * after the load that reads it. without PAMI_THREADS they are
+ * plain accesses.
+ */
+uint64_t word_load(uint64_t* w) {
+#ifdef PAMI_THREADS
+  return __atomic_load_n(w, __ATOMIC_ACQUIRE);
+#else
+  return *w;
+#endif
+}
+
+void word_store(uint64_t* w, uint64_t value) {
+#ifdef PAMI_THREADS
+  __atomic_store_n(w, value, __ATOMIC_RELEASE);
+#else
+  *w = value;
+#endif
+}
+
+/* replaces 'old' with 'value', unless 'w' changed since it was read */
+bool word_cas(uint64_t* w, uint64_t old, uint64_t value) {
+#ifdef PAMI_THREADS
+  return __atomic_compare_exchange_n(w, &old, value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#else
+  if (*w != old) {
+    return false;
+  }
+  *w = value;
+  return true;
+#endif
+}
+
 /*
  * -------------------------------------
  * |            ###UTF8###             |
@@ -34,54 +102,302 @@ typedef int32_t rune;
 
 #define EoF (rune)0
 
-size_t utf8_decode(const char* buffer, rune* r) {
-  if ((buffer[0] & TOP_BITS(1)) == 0) { /* ASCII */
-    *r = (rune)buffer[0];
-    return 1;
-  }
+/* plain words (swar) stand in for simd where it's missing,
+ * or to go 8 bytes at a time after it
+ */
+#define SWAR_ONES ((uint64_t)0x0101010101010101)
+#define SWAR_LOW7 ((uint64_t)0x7f7f7f7f7f7f7f7f)
+#define SWAR_HIGH ((uint64_t)0x8080808080808080)
+
+/* 0x80 in every byte of 'w' that is zero, and nowhere else */
+uint64_t swar_zero(uint64_t w) {
+  return ~(((w & SWAR_LOW7) + SWAR_LOW7) | w | SWAR_LOW7);
+}
+
+uint64_t swar_eq(uint64_t w, uint8_t c) {
+  return swar_zero(w ^ (SWAR_ONES * c));
+}
 
-  /* TWO BYTE SEQUENCE */
-  if ((buffer[0] & TOP_BITS(3)) == TOP_BITS(2)) {
-    if ((buffer[1] & TOP_BITS(2)) != TOP_BITS(1)) {
-      *r = -1;
-      return 0;
+/* returns the index of the first byte from 'i' that is not ascii */
+size_t utf8_skip_ascii(const uint8_t* p, size_t i, size_t n) {
+  uint64_t w;
+#if defined(LEX_SSE2)
+  int mask;
+  for (; i + 16 <= n; i += 16) {
+    mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p + i)));
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+  }
+#elif defined(LEX_NEON)
+  for (; i + 16 <= n; i += 16) {
+    if (vmaxvq_u8(vld1q_u8(p + i)) >= 0x80) {
+      break;
     }
-    *r = (rune)(buffer[0] & LOW_BITS(5)) << 6 |
-         (rune)(buffer[1] & LOW_BITS(6));
+  }
+#endif
+  for (; i + 8 <= n; i += 8) {
+    memcpy(&w, p + i, 8);
+    if ((w & SWAR_HIGH) != 0) {
+      break;
+    }
+  }
+  while (i < n && p[i] < 0x80) {
+    i++;
+  }
+  return i;
+}
+
+/* the position within a sequence, kept between calls to
+ * utf8_scan so the input can arrive in pieces
+ */
+typedef struct {
+  uint8_t need;  /* continuation bytes still missing */
+  uint8_t seen;  /* bytes of the sequence already read */
+  uint8_t lo;    /* range of the next continuation byte */
+  uint8_t hi;
+} utf8_state;
+
+/* bytes in the sequence started by 'c', 0 if it can't start one.
+ * C0 and C1 could only start overlong encodings, above F4 are
+ * code points past U+10FFFF
+ */
+size_t utf8_length(uint8_t c) {
+  if (c < 0x80) {
+    return 1;
+  }
+  if (c < 0xc2) {
+    return 0;
+  }
+  if (c < 0xe0) {
     return 2;
   }
+  if (c < 0xf0) {
+    return 3;
+  }
+  if (c < 0xf5) {
+    return 4;
+  }
+  return 0;
+}
+
+#if defined(LEX_SSSE3) || defined(LEX_NEON)
+/* sequences are checked 16 bytes at a time with the lookup tables of
+ * Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction
+ * Per Byte". the high and low nibble of a byte and the high nibble of
+ * the one after it each give the errors the pair could be part of,
+ * only those in all three are. the missing third and fourth bytes
+ * show up as a difference between where a continuation is and where
+ * it has to be.
+ */
+#define U8_TOO_SHORT 0x01   /* a lead or ascii where a continuation goes */
+#define U8_TOO_LONG 0x02    /* a continuation after ascii */
+#define U8_OVERLONG_3 0x04
+#define U8_TOO_LARGE 0x08
+#define U8_SURROGATE 0x10
+#define U8_OVERLONG_2 0x20
+#define U8_TOO_LARGE_1000 0x40
+#define U8_OVERLONG_4 0x40
+#define U8_TWO_CONTS 0x80   /* not an error if it's a third or fourth byte */
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+const uint8_t utf8_nibbles[3][16] = {
+  /* high nibble of the first byte */
+  { U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+    U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+    U8_TOO_SHORT | U8_OVERLONG_2,
+    U8_TOO_SHORT,
+    U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+    U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4 },
+  /* low nibble of the first byte */
+  { U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+    U8_CARRY | U8_OVERLONG_2,
+    U8_CARRY,
+    U8_CARRY,
+    U8_CARRY | U8_TOO_LARGE,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 },
+  /* high nibble of the second byte */
+  { U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT }
+};
+#endif
 
-  /* THREE BYTE SEQUENCE */
-  if ((buffer[0] & TOP_BITS(4)) == TOP_BITS(3)) {
-    if ((buffer[1] & TOP_BITS(2)) != TOP_BITS(1) ||
-        (buffer[2] & TOP_BITS(2)) != TOP_BITS(1)) {
-      *r = -1;
-      return 0;
+/* returns an index from 'i', which starts a sequence, up to which the
+ * input is made of whole, well formed sequences. it stops at the first
+ * block with an error or at the end, and backs off to the start of the
+ * sequence that crosses into that block, so utf8_scan goes on from
+ * there one byte at a time
+ */
+size_t utf8_skip_valid(const uint8_t* p, size_t i, size_t n) {
+  size_t q = i, t;
+#if defined(LEX_SSSE3)
+  const __m128i high1 = _mm_loadu_si128((const __m128i*)utf8_nibbles[0]);
+  const __m128i low1 = _mm_loadu_si128((const __m128i*)utf8_nibbles[1]);
+  const __m128i high2 = _mm_loadu_si128((const __m128i*)utf8_nibbles[2]);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i prev = _mm_setzero_si128();
+  __m128i in, prev1, special, must;
+
+  for (; q + 16 <= n; q += 16) {
+    in = _mm_loadu_si128((const __m128i*)(p + q));
+    prev1 = _mm_alignr_epi8(in, prev, 15);
+    special = _mm_and_si128(
+        _mm_and_si128(_mm_shuffle_epi8(high1, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                      _mm_shuffle_epi8(low1, _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(high2, _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+    /* 0x80 where the byte two before starts 3 or 4, or three before starts 4 */
+    must = _mm_or_si128(_mm_subs_epu8(_mm_alignr_epi8(in, prev, 14), _mm_set1_epi8(0x60)),
+                        _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13), _mm_set1_epi8(0x70)));
+    must = _mm_and_si128(must, _mm_set1_epi8((char)0x80));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_xor_si128(must, special), _mm_setzero_si128())) != 0xffff) {
+      break;
     }
-    *r = (rune)(buffer[0] & LOW_BITS(4)) << 12 |
-         (rune)(buffer[1] & LOW_BITS(6)) << 6 |
-         (rune)(buffer[2] & LOW_BITS(6));
-    return 3;
+    prev = in;
+  }
+#elif defined(LEX_NEON)
+  const uint8x16_t high1 = vld1q_u8(utf8_nibbles[0]);
+  const uint8x16_t low1 = vld1q_u8(utf8_nibbles[1]);
+  const uint8x16_t high2 = vld1q_u8(utf8_nibbles[2]);
+  uint8x16_t prev = vdupq_n_u8(0);
+  uint8x16_t in, prev1, special, must;
+
+  for (; q + 16 <= n; q += 16) {
+    in = vld1q_u8(p + q);
+    prev1 = vextq_u8(prev, in, 15);
+    special = vandq_u8(vandq_u8(vqtbl1q_u8(high1, vshrq_n_u8(prev1, 4)),
+                                vqtbl1q_u8(low1, vandq_u8(prev1, vdupq_n_u8(0x0f)))),
+                       vqtbl1q_u8(high2, vshrq_n_u8(in, 4)));
+    must = vorrq_u8(vqsubq_u8(vextq_u8(prev, in, 14), vdupq_n_u8(0x60)),
+                    vqsubq_u8(vextq_u8(prev, in, 13), vdupq_n_u8(0x70)));
+    must = vandq_u8(must, vdupq_n_u8(0x80));
+    if (vmaxvq_u8(veorq_u8(must, special)) != 0) {
+      break;
+    }
+    prev = in;
   }
+#else
+  (void)n;
+#endif
+  /* a lead in the last three bytes may start a sequence that isn't whole */
+  for (t = q; t > i && q - t < 3; t--) {
+    if (p[t-1] >= 0xc0) {
+      return t - 1;
+    }
+  }
+  return q;
+}
 
-  /* FOUR BYTE SEQUENCE */
-  if ((buffer[0] & TOP_BITS(5)) == TOP_BITS(4)) {
-    if ((buffer[1] & TOP_BITS(2)) != TOP_BITS(1) ||
-        (buffer[2] & TOP_BITS(2)) != TOP_BITS(1) ||
-        (buffer[3] & TOP_BITS(2)) != TOP_BITS(1)) {
-      *r = -1;
-      return 0;
+/* checks 'n' more bytes of the input, returns the index of the
+ * first byte that is not well formed utf8 or 'n' if there's none.
+ * the ranges are the ones of table 3-7 in the unicode standard,
+ * so overlong encodings and surrogates are rejected
+ */
+size_t utf8_scan(utf8_state* s, const uint8_t* p, size_t n) {
+  size_t i = 0;
+  uint8_t c;
+
+  while (i < n) {
+    if (s->need == 0) {
+      i = utf8_skip_valid(p, utf8_skip_ascii(p, i, n), n);
+      if (i == n) {
+        break;
+      }
+      c = p[i];
+      s->need = (uint8_t)utf8_length(c);
+      if (s->need == 0) {
+        return i;
+      }
+      s->need--;
+      s->seen = 1;
+      s->lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+      s->hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+      i++;
+      continue;
+    }
+    c = p[i];
+    if (c < s->lo || c > s->hi) {
+      return i;
     }
-    *r = (rune)(buffer[0] & LOW_BITS(3)) << 18 |
-         (rune)(buffer[1] & LOW_BITS(6)) << 12 |
-         (rune)(buffer[2] & LOW_BITS(6)) << 6 |
-         (rune)(buffer[3] & LOW_BITS(6));
+    s->need--;
+    s->seen++;
+    s->lo = 0x80;
+    s->hi = 0xbf;
+    i++;
+  }
+  return n;
+}
+
+/* returns the size of the longest prefix of 'buffer' that is
+ * made of whole, well formed sequences
+ */
+size_t utf8_valid(const char* buffer, size_t size) {
+  utf8_state s = {0};
+  size_t i = utf8_scan(&s, (const uint8_t*)buffer, size);
+  if (s.need != 0) {
+    return i - s.seen;
+  }
+  return i;
+}
+
+/* decodes a sequence already known to be well formed */
+size_t utf8_decode_valid(const char* buffer, rune* r) {
+  const uint8_t* p = (const uint8_t*)buffer;
+  switch (utf8_length(p[0])) {
+  case 2:
+    *r = (rune)(p[0] & LOW_BITS(5)) << 6 |
+         (rune)(p[1] & LOW_BITS(6));
+    return 2;
+  case 3:
+    *r = (rune)(p[0] & LOW_BITS(4)) << 12 |
+         (rune)(p[1] & LOW_BITS(6)) << 6 |
+         (rune)(p[2] & LOW_BITS(6));
+    return 3;
+  case 4:
+    *r = (rune)(p[0] & LOW_BITS(3)) << 18 |
+         (rune)(p[1] & LOW_BITS(6)) << 12 |
+         (rune)(p[2] & LOW_BITS(6)) << 6 |
+         (rune)(p[3] & LOW_BITS(6));
     return 4;
+  default:
+    *r = (rune)p[0];
+    return 1;
   }
+}
 
-  /* INVALID ENCODING */
-  *r = -1;
-  return 0;
+/* decodes the sequence at the start of 'buffer', reading no more
+ * than 'size' bytes. returns 0 and sets 'r' to -1 if it's invalid
+ */
+size_t utf8_decode(const char* buffer, size_t size, rune* r) {
+  utf8_state s = {0};
+  size_t len;
+
+  if (size == 0) {
+    *r = -1;
+    return 0;
+  }
+  len = utf8_length((uint8_t)buffer[0]);
+  if (len == 0 || len > size ||
+      utf8_scan(&s, (const uint8_t*)buffer, len) != len || s.need != 0) {
+    *r = -1;
+    return 0;
+  }
+  return utf8_decode_valid(buffer, r);
 }
 
 /*
@@ -117,8 +433,25 @@ typedef struct {
   uint8_t* end;
   size_t chunksize;
   size_t size;
+
+  /* kept up to date by every operation, so queries are O(1) */
+  size_t nchunks;    /* chunks in the pool */
+  size_t nfree;      /* chunks in the free list */
+  size_t high_water; /* most chunks ever in use at once */
+  size_t allocs;     /* successful allocations */
+  size_t frees;      /* successful frees */
 } pool;
 
+typedef struct {
+  size_t chunksize;
+  size_t chunks;
+  size_t free;
+  size_t used;
+  size_t high_water;
+  size_t allocs;
+  size_t frees;
+} pool_stats;
+
 /* returns a pool allocated at the beginning of the buffer
  * if the pool is NULL, then error contains the reason.
  */
@@ -150,6 +483,10 @@ size_t pool_used(const pool* p);
  */
 bool pool_empty(const pool* p);
 
+/* returns a snapshot of the pool counters
+ */
+pool_stats pool_get_stats(const pool* p);
+
 #define POOL_OFFSETNODE(a, x) (pool_node*)((uint8_t*)a + x)
 
 char* pool_str_res(enum pool_RES r) {
@@ -194,11 +531,16 @@ void pool_set_list(pool* p) {
 
   curr->next = NULL;
   p->tail = curr;
+
+  p->nchunks = p->size / p->chunksize;
+  p->nfree = p->nchunks;
 }
 
 const size_t pool_min_chunk_size = sizeof(pool_node);
 
 pool* pool_create(uint8_t* buff, size_t buffsize, size_t chunksize, enum pool_RES* out) {
+  /* the first cell of an aligned buffer is aligned too */
+  size_t header = (sizeof(pool) + CELL_ALIGN - 1)/CELL_ALIGN*CELL_ALIGN;
   pool* p;
 
   if (buff == NULL) {
@@ -211,16 +553,19 @@ pool* pool_create(uint8_t* buff, size_t buffsize, size_t chunksize, enum pool_RE
     return NULL;
   }
 
-  if (buffsize < sizeof(pool) + chunksize) {
+  if (buffsize < header + chunksize) {
     *out = pool_ERR_SMALL_BUFF;
     return NULL;
   }
 
   p = (pool*)buff;
-  p->begin = buff + sizeof(pool);
+  p->begin = buff + header;
   p->end = buff + buffsize;
   p->chunksize = chunksize;
   p->size = distance(p->begin, p->end);
+  p->high_water = 0;
+  p->allocs = 0;
+  p->frees = 0;
 
   bzero(p->begin, p->size);
   pool_set_list(p);
@@ -239,6 +584,12 @@ void* pool_alloc(pool* p) {
   if (p->head == NULL) {
     p->tail = NULL;
   }
+
+  p->nfree--;
+  p->allocs++;
+  if (p->nchunks - p->nfree > p->high_water) {
+    p->high_water = p->nchunks - p->nfree;
+  }
   return curr;
 }
 
@@ -255,6 +606,8 @@ enum pool_RES pool_free(pool* p, void* ptr) {
 
   new = (pool_node*)ptr;
   new->next = NULL;
+  p->nfree++;
+  p->frees++;
 
   if (p->head == NULL) {
     p->head = new;
@@ -272,27 +625,283 @@ void pool_free_all(pool* p) {
 }
 
 size_t pool_available(const pool* p) {
-  size_t total = 0;
-  pool_node* curr = p->head;
-  while (curr != NULL) {
-    total += p->chunksize;
-    curr = curr->next;
-  }
-  return total;
+  return p->nfree * p->chunksize;
 }
 
 size_t pool_used(const pool* p) {
-  return p->size - pool_available(p);
+  return (p->nchunks - p->nfree) * p->chunksize;
 }
 
 bool pool_empty(const pool* p) {
-  size_t total = pool_available(p);
-  if (total < p->size) {
-    return false;
-  }
+  return p->nfree == p->nchunks;
+}
+
+pool_stats pool_get_stats(const pool* p) {
+  pool_stats st;
+  st.chunksize = p->chunksize;
+  st.chunks = p->nchunks;
+  st.free = p->nfree;
+  st.used = p->nchunks - p->nfree;
+  st.high_water = p->high_water;
+  st.allocs = p->allocs;
+  st.frees = p->frees;
+  return st;
+}
+
+/*
+ * -------------------------------------
+ * |        ###CONCURRENT POOL###      |
+ * -------------------------------------
+ */
+
+/* a pool of fixed size chunks shared by many threads. each thread
+ * keeps a cache of two magazines (lists of up to CPOOL_BATCH free
+ * chunks), most allocations and frees only touch the cache. full
+ * magazines go to a shared stack, and empty ones are refilled from
+ * it, with one compare and swap of the top each time.
+ *
+ * the links live in arrays beside the chunks, indexed by chunk,
+ * so the pool never writes to memory it handed out. the top of the
+ * stack is the index of the first magazine with a tag that changes
+ * on every push and pop, so it can not be fooled by a magazine that
+ * was popped and pushed again (ABA).
+ */
+
+#define CPOOL_BATCH 32
+
+typedef struct {
+  uint64_t top;       /* tag in the high half, first chunk of the top magazine + 1 in the low */
+  uint8_t pad[CACHE_LINE - sizeof(uint64_t)];  /* the rest is read only */
+  uint32_t* next;     /* chunk after each one in its magazine, + 1 */
+  uint64_t* below;    /* for the first chunk of a magazine in the stack:
+                       * its length in the high half, the magazine under
+                       * it in the low */
+  uint8_t* begin;
+  size_t chunksize;
+  size_t nchunks;
+} cpool;
+
+typedef struct {
+  uint32_t head;      /* first chunk + 1, 0 if empty */
+  size_t count;
+} cpool_magazine;
+
+/* owned by a single thread */
+typedef struct {
+  cpool_magazine loaded;
+  cpool_magazine spare;  /* empty or full */
+  size_t allocs;
+  size_t frees;
+} cpool_cache;
+
+/* returns a pool allocated at the first cache line of the buffer,
+ * if the pool is NULL, then error contains the reason.
+ */
+cpool* cpool_create(uint8_t* buff, size_t buff_size, size_t chunksize, enum pool_RES* error);
+
+/* prepares the cache of a thread, it starts empty */
+void cpool_cache_init(cpool_cache* c);
+
+/* tries to allocate a object of size 'chunksize', returns NULL if
+ * the stack is empty, even if the caches of other threads are not
+ */
+void* cpool_alloc(cpool* p, cpool_cache* c);
+
+/* frees an object allocated in the pool by any thread,
+ * returns error if the pointer is incorrectly aligned
+ */
+enum pool_RES cpool_free(cpool* p, cpool_cache* c, void* obj);
+
+/* gives the chunks in the cache back to every thread */
+void cpool_flush(cpool* p, cpool_cache* c);
+
+/* frees all objects in the pool, no thread may be using it
+ * and every cache must be initialized again
+ */
+void cpool_free_all(cpool* p);
+
+/* returns the memory in the stack, it is only exact while
+ * no thread is using the pool
+ */
+size_t cpool_available(cpool* p);
+
+uint64_t cpool_word(uint64_t high, uint64_t low) {
+  return high << 32 | low;
+}
+
+void cpool_push(cpool* p, cpool_magazine* m) {
+  uint64_t top;
+
+  do {
+    top = word_load(&p->top);
+    word_store(&p->below[m->head - 1], cpool_word(m->count, top & 0xffffffff));
+  } while (word_cas(&p->top, top, cpool_word((top >> 32) + 1, m->head)) == false);
+  m->head = 0;
+  m->count = 0;
+}
+
+bool cpool_pop(cpool* p, cpool_magazine* m) {
+  uint64_t top, below;
+  uint32_t head;
+
+  do {
+    top = word_load(&p->top);
+    head = (uint32_t)(top & 0xffffffff);
+    if (head == 0) {
+      return false;
+    }
+    /* may be stale if another thread popped it first, then the tag
+     * of the top has changed and the swap fails
+     */
+    below = word_load(&p->below[head - 1]);
+  } while (word_cas(&p->top, top, cpool_word((top >> 32) + 1, below & 0xffffffff)) == false);
+  m->head = head;
+  m->count = (size_t)(below >> 32);
   return true;
 }
 
+void cpool_free_all(cpool* p) {
+  cpool_magazine m;
+  size_t i, first;
+
+  p->top = 0;
+  /* the first chunks end up on top */
+  for (first = p->nchunks - p->nchunks%CPOOL_BATCH; ; first -= CPOOL_BATCH) {
+    m.head = 0;
+    m.count = 0;
+    for (i = p->nchunks < first + CPOOL_BATCH ? p->nchunks : first + CPOOL_BATCH; i > first; i--) {
+      p->next[i - 1] = m.head;
+      m.head = (uint32_t)i;
+      m.count++;
+    }
+    if (m.count > 0) {
+      cpool_push(p, &m);
+    }
+    if (first == 0) {
+      break;
+    }
+  }
+}
+
+cpool* cpool_create(uint8_t* buff, size_t buffsize, size_t chunksize, enum pool_RES* out) {
+  cpool* p;
+  uint8_t* start;
+  size_t header = (sizeof(cpool) + CACHE_LINE - 1)/CACHE_LINE*CACHE_LINE;
+  size_t skip, n, links;
+
+  if (buff == NULL) {
+    *out = pool_ERR_NULL_BUFF;
+    return NULL;
+  }
+  if (chunksize == 0) {
+    *out = pool_ERR_CHUNK_SIZE;
+    return NULL;
+  }
+  /* the pool starts at a cache line, so 'top' has one of its own and
+   * the 64-bit words are aligned for atomics on 32-bit targets too
+   */
+  skip = (CACHE_LINE - (uintptr_t)buff%CACHE_LINE)%CACHE_LINE;
+  /* each chunk has a link in 'next' and in 'below' */
+  n = buffsize < skip + header + WORD ? 0 :
+      (buffsize - skip - header - WORD)/(chunksize + sizeof(uint32_t) + sizeof(uint64_t));
+  if (n == 0) {
+    *out = pool_ERR_SMALL_BUFF;
+    return NULL;
+  }
+  if (n >= UINT32_MAX) {
+    n = UINT32_MAX - 1;
+  }
+
+  start = buff + skip;
+  p = (cpool*)start;
+  p->below = (uint64_t*)(start + header);
+  p->next = (uint32_t*)(p->below + n);
+  links = header + n*(sizeof(uint64_t) + sizeof(uint32_t));
+  p->begin = start + (links + WORD - 1)/WORD*WORD;
+  p->chunksize = chunksize;
+  p->nchunks = n;
+  cpool_free_all(p);
+  *out = pool_OK;
+  return p;
+}
+
+void cpool_cache_init(cpool_cache* c) {
+  c->loaded.head = 0;
+  c->loaded.count = 0;
+  c->spare.head = 0;
+  c->spare.count = 0;
+  c->allocs = 0;
+  c->frees = 0;
+}
+
+void* cpool_alloc(cpool* p, cpool_cache* c) {
+  cpool_magazine m;
+  uint32_t i;
+
+  if (c->loaded.count == 0) {
+    if (c->spare.count > 0) {
+      m = c->loaded;
+      c->loaded = c->spare;
+      c->spare = m;
+    } else if (cpool_pop(p, &c->loaded) == false) {
+      return NULL;
+    }
+  }
+  i = c->loaded.head;
+  c->loaded.head = p->next[i - 1];
+  c->loaded.count--;
+  c->allocs++;
+  return p->begin + (size_t)(i - 1)*p->chunksize;
+}
+
+enum pool_RES cpool_free(cpool* p, cpool_cache* c, void* obj) {
+  size_t offset;
+
+  if (!(p->begin <= (uint8_t*)obj && (uint8_t*)obj < p->begin + p->nchunks*p->chunksize)) {
+    return pool_ERR_BOUNDS;
+  }
+  offset = distance(obj, p->begin);
+  if (offset % p->chunksize != 0) {
+    return pool_ERR_ALIGN;
+  }
+
+  if (c->loaded.count == CPOOL_BATCH) {
+    if (c->spare.count > 0) {
+      cpool_push(p, &c->spare);
+    }
+    c->spare = c->loaded;
+    c->loaded.head = 0;
+    c->loaded.count = 0;
+  }
+  p->next[offset/p->chunksize] = c->loaded.head;
+  c->loaded.head = (uint32_t)(offset/p->chunksize + 1);
+  c->loaded.count++;
+  c->frees++;
+  return pool_OK;
+}
+
+void cpool_flush(cpool* p, cpool_cache* c) {
+  if (c->loaded.count > 0) {
+    cpool_push(p, &c->loaded);
+  }
+  if (c->spare.count > 0) {
+    cpool_push(p, &c->spare);
+  }
+}
+
+size_t cpool_available(cpool* p) {
+  uint64_t below;
+  uint32_t head = (uint32_t)(word_load(&p->top) & 0xffffffff);
+  size_t total = 0;
+
+  while (head != 0) {
+    below = word_load(&p->below[head - 1]);
+    total += (size_t)(below >> 32);
+    head = (uint32_t)(below & 0xffffffff);
+  }
+  return total*p->chunksize;
+}
+
 /*
  * -------------------------------------
  * |          ###FREELIST###           |
@@ -313,16 +922,55 @@ typedef struct {
   size_t size;
 } fl_obj_header;
 
+#ifdef FL_BOUNDARY_TAGS
+/* boundary tag mode: blocks are not kept sorted, instead each header
+ * says if the block is in use and if the block right before it is in
+ * use. free blocks repeat their size in their last word (the footer),
+ * so both physical neighbours of a freed block are found in O(1).
+ * the main list is doubly linked for O(1) removal.
+ */
+#define FL_INUSE ((size_t)1)
+#define FL_PREV_INUSE ((size_t)2)
+#define FL_FLAGS (FL_INUSE | FL_PREV_INUSE)
+
+typedef struct _fl_node {
+  size_t size;
+  struct _fl_node *next;
+  struct _fl_node *prev;
+} fl_node;
+
+#define FL_MIN_BLOCK (sizeof(fl_node) + sizeof(size_t))
+#else
+#define FL_FLAGS ((size_t)0)
+
 typedef struct _fl_node {
   size_t size;
   struct _fl_node *next;
 } fl_node;
 
+#define FL_MIN_BLOCK sizeof(fl_node)
+#endif
+
+#define FL_SIZE(node) ((node)->size & ~FL_FLAGS)
+
+/* small blocks are kept in segregated lists, one per size class,
+ * so allocating and freeing them is O(1). class 'i' holds blocks of
+ * exactly FL_MIN_BLOCK + i*WORD bytes. these blocks are not coalesced
+ * until an allocation fails and the classes are flushed back into the
+ * main (coalescing) list.
+ */
+#define FL_CLASSES 16
+#define FL_MAX_CLASS_BLOCK (FL_MIN_BLOCK + (FL_CLASSES-1)*WORD)
+
 typedef struct {
   fl_node* head;
   uint8_t* begin;
   uint8_t* end;
   size_t   size;
+
+  fl_node* classes[FL_CLASSES];
+  size_t   nclasses; /* classes in use, 0 disables the segregated lists */
+  size_t   cached;   /* bytes sitting in the segregated lists */
 } freelist;
 
 size_t fl_pad(size_t size);
@@ -345,9 +993,17 @@ enum fl_RES fl_free(freelist* fl, void* obj);
 /* frees all objects in the free list */
 void fl_free_all(freelist* fl);
 
+/* gives every block in the segregated lists back to the main list */
+void fl_flush_classes(freelist* fl);
+
 /* returns the amount of memory available */
 size_t fl_available(const freelist* fl);
 
+/* returns the size of the largest free block, the biggest
+ * allocation that can succeed is a header smaller than it
+ */
+size_t fl_largest(const freelist* fl);
+
 /* returns the amount of memory used */
 size_t fl_used(const freelist* fl);
 
@@ -359,11 +1015,11 @@ bool fl_empty(const freelist* fl);
 size_t fl_pad(size_t size) {
   size = size + sizeof(fl_obj_header);
   if (size%WORD != 0) {
-    return size + (WORD-size%WORD);
+    size = size + (WORD-size%WORD);
   }
   /* objects need space for a Node when deallocated */
-  if (size < sizeof(fl_node)) {
-    size = sizeof(fl_node);
+  if (size < FL_MIN_BLOCK) {
+    size = FL_MIN_BLOCK;
   }
   return size;
 }
@@ -380,25 +1036,108 @@ char* fl_str_res(enum fl_RES res) {
   return "??";
 }
 
+void fl_reset_classes(freelist* fl) {
+  size_t i;
+  for (i = 0; i < FL_CLASSES; i++) {
+    fl->classes[i] = NULL;
+  }
+  fl->cached = 0;
+}
+
+#ifdef FL_BOUNDARY_TAGS
+void fl_set_footer(fl_node* node, size_t size) {
+  *(size_t*)((uint8_t*)node + size - sizeof(size_t)) = size;
+}
+
+void fl_unlink(freelist* fl, fl_node* node) {
+  if (node->prev != NULL) {
+    node->prev->next = node->next;
+  } else {
+    fl->head = node->next;
+  }
+  if (node->next != NULL) {
+    node->next->prev = node->prev;
+  }
+}
+
+void fl_push(freelist* fl, fl_node* node) {
+  node->prev = NULL;
+  node->next = fl->head;
+  if (fl->head != NULL) {
+    fl->head->prev = node;
+  }
+  fl->head = node;
+}
+#endif
+
+/* the main list becomes a single block spanning the whole buffer */
+void fl_reset_main(freelist* fl) {
+  fl->head = (fl_node*)fl->begin;
+  fl->head->size = fl->size;
+  fl->head->next = NULL;
+#ifdef FL_BOUNDARY_TAGS
+  /* nothing before the first block can be coalesced */
+  fl->head->size |= FL_PREV_INUSE;
+  fl->head->prev = NULL;
+  fl_set_footer(fl->head, fl->size);
+#endif
+}
+
 freelist* fl_create(uint8_t* buffer, size_t size, enum fl_RES *res) {
   freelist* fl;
-  if (size < sizeof(freelist) + sizeof(fl_node)) {
+  if (size < sizeof(freelist) + FL_MIN_BLOCK) {
     *res = fl_ERR_SMALLBUFF;
     return NULL;
   }
 
   fl = (freelist*)buffer;
-  fl->head = (fl_node*)(buffer + sizeof(freelist));
-  fl->head->size = size - sizeof(freelist);
-  fl->head->next = NULL;
-
-  fl->begin = (uint8_t*)fl->head;
-  fl->end = buffer+size;
-
-  fl->size = distance(fl->begin, fl->end);
+  fl->begin = buffer + sizeof(freelist);
+  /* blocks are multiples of WORD, the tail that doesn't fit is left out */
+  fl->size = (size - sizeof(freelist)) - (size - sizeof(freelist))%WORD;
+  fl->end = fl->begin + fl->size;
+
+  fl_reset_main(fl);
+  fl->nclasses = FL_CLASSES;
+  fl_reset_classes(fl);
+  *res = fl_OK;
   return fl;
 }
 
+#ifdef FL_BOUNDARY_TAGS
+/* first fit, the remainder of a split goes back to the list */
+void fl_getnode(freelist* fl, size_t size, uint8_t** outptr, size_t* allocsize) {
+  fl_node* curr = fl->head;
+  fl_node* rest;
+  size_t csize;
+
+  while (curr != NULL) {
+    csize = FL_SIZE(curr);
+    if (csize >= size) {
+      fl_unlink(fl, curr);
+      if (csize - size >= FL_MIN_BLOCK) {
+        rest = FL_OFFSETNODE(curr, size);
+        rest->size = (csize - size) | FL_PREV_INUSE;
+        fl_set_footer(rest, csize - size);
+        fl_push(fl, rest);
+        csize = size;
+      } else {
+        rest = FL_OFFSETNODE(curr, csize);
+        if ((uint8_t*)rest < fl->end) {
+          rest->size |= FL_PREV_INUSE;
+        }
+      }
+      curr->size = csize | FL_INUSE | (curr->size & FL_PREV_INUSE);
+      *outptr = (uint8_t*)curr;
+      *allocsize = csize;
+      return;
+    }
+    curr = curr->next;
+  }
+
+  *outptr = NULL;
+  *allocsize = 0;
+}
+#else
 uint8_t* fl_pop(freelist* fl, fl_node* prev, fl_node* curr) {
   if (prev != NULL) {
     prev->next = curr->next;
@@ -464,6 +1203,48 @@ void fl_getnode(freelist* fl, size_t size, uint8_t** outptr, size_t* allocsize)
   *allocsize = 0;
   return;
 }
+#endif
+
+/* returns the index of the class of blocks of the given size,
+ * or -1 if the block is too big for the segregated lists
+ */
+int fl_class(const freelist* fl, size_t size) {
+  size_t i;
+  if (size > FL_MAX_CLASS_BLOCK) {
+    return -1;
+  }
+  i = (size - FL_MIN_BLOCK)/WORD;
+  if (i >= fl->nclasses) {
+    return -1;
+  }
+  return (int)i;
+}
+
+uint8_t* fl_class_pop(freelist* fl, size_t size) {
+  int i = fl_class(fl, size);
+  fl_node* node;
+  if (i < 0 || fl->classes[i] == NULL) {
+    return NULL;
+  }
+  node = fl->classes[i];
+  fl->classes[i] = node->next;
+  fl->cached -= size;
+  return (uint8_t*)node;
+}
+
+/* blocks in the segregated lists keep their header untouched,
+ * for the boundary tags they are still in use
+ */
+bool fl_class_push(freelist* fl, fl_node* node) {
+  int i = fl_class(fl, FL_SIZE(node));
+  if (i < 0) {
+    return false;
+  }
+  node->next = fl->classes[i];
+  fl->classes[i] = node;
+  fl->cached += FL_SIZE(node);
+  return true;
+}
 
 void* fl_alloc(freelist* fl, size_t size) {
   uint8_t* p;
@@ -471,15 +1252,63 @@ void* fl_alloc(freelist* fl, size_t size) {
 
   size = fl_pad(size);
 
-  fl_getnode(fl, size, &p, &allocsize);
+  p = fl_class_pop(fl, size);
+  allocsize = size;
+  if (p == NULL) {
+    fl_getnode(fl, size, &p, &allocsize);
+  }
+  if (p == NULL && fl->cached > 0) {
+    fl_flush_classes(fl);
+    fl_getnode(fl, size, &p, &allocsize);
+  }
   if (p == NULL) {
     return NULL;
   }
+#ifndef FL_BOUNDARY_TAGS
   ((fl_obj_header*) p)->size = allocsize;
+#endif
   p += sizeof(fl_obj_header);
   return p;
 }
 
+size_t fl_objsize(const void* ptr) {
+  fl_obj_header* obj = (fl_obj_header*)((uint8_t*)ptr - sizeof(fl_obj_header));
+  return obj->size & ~FL_FLAGS;
+}
+
+#ifdef FL_BOUNDARY_TAGS
+/* gives a block in use back to the main list, merging it
+ * with whichever of its physical neighbours are free
+ */
+void fl_insert(freelist* fl, fl_node* new) {
+  size_t size = FL_SIZE(new);
+  size_t prev_inuse = new->size & FL_PREV_INUSE;
+  fl_node* next = FL_OFFSETNODE(new, size);
+  fl_node* prev;
+
+  if ((uint8_t*)next < fl->end && (next->size & FL_INUSE) == 0) {
+    fl_unlink(fl, next);
+    size += FL_SIZE(next);
+  }
+
+  if (prev_inuse == 0) {
+    /* the footer of the previous block says where it starts */
+    prev = (fl_node*)((uint8_t*)new - *(size_t*)((uint8_t*)new - sizeof(size_t)));
+    fl_unlink(fl, prev);
+    size += FL_SIZE(prev);
+    prev_inuse = prev->size & FL_PREV_INUSE;
+    new = prev;
+  }
+
+  new->size = size | prev_inuse;
+  fl_set_footer(new, size);
+  next = FL_OFFSETNODE(new, size);
+  if ((uint8_t*)next < fl->end) {
+    next->size &= ~FL_PREV_INUSE;
+  }
+  fl_push(fl, new);
+}
+#else
 void fl_append(fl_node* prev, fl_node* new) {
   if (FL_OFFSETNODE(prev, prev->size) == new) {
     /* coalescing: append */
@@ -536,34 +1365,22 @@ void fl_join(fl_node* prev, fl_node* new, fl_node* curr) {
   return;
 }
 
-size_t fl_objsize(const void* ptr) {
-  fl_obj_header* obj = (fl_obj_header*)((uint8_t*)ptr - sizeof(fl_obj_header));
-  return obj->size;
-}
-
-enum fl_RES fl_free(freelist* fl, void* p) {
-  size_t size;
-  fl_node* new; fl_node* prev; fl_node* curr;
-  uint8_t* obj = (uint8_t*)p;
-
-  if (obj < fl->begin || fl->end < obj) {
-    return fl_ERR_BOUNDS;
-  }
-
-  size = fl_objsize(obj);
-  new = (fl_node*)(obj-sizeof(fl_obj_header));
+/* inserts the node in the main list, keeping it sorted by address
+ * and coalescing it with its neighbours
+ */
+void fl_insert(freelist* fl, fl_node* new) {
+  fl_node* prev; fl_node* curr;
 
-  new->size = size;
   new->next = NULL;
 
   if (fl->head == NULL) {
     fl->head = new;
-    return fl_OK;
+    return;
   }
 
   if (new < fl->head) {
     fl_prepend(fl, new);
-    return fl_OK;
+    return;
   }
 
   prev = NULL;
@@ -574,7 +1391,7 @@ enum fl_RES fl_free(freelist* fl, void* p) {
       if (prev < new && new < curr) {
         /* in this case, 'new' is a middle node */
         fl_join(prev, new, curr);
-        return fl_OK;
+        return;
       }
     }
     
@@ -584,26 +1401,68 @@ enum fl_RES fl_free(freelist* fl, void* p) {
 
   /* in this case, 'new' is the last node */
   fl_append(prev, new);
+}
+#endif
+
+enum fl_RES fl_free(freelist* fl, void* p) {
+  fl_node* new;
+  uint8_t* obj = (uint8_t*)p;
+
+  if (obj < fl->begin || fl->end < obj) {
+    return fl_ERR_BOUNDS;
+  }
+
+  new = (fl_node*)(obj-sizeof(fl_obj_header));
+
+  if (fl_class_push(fl, new)) {
+    return fl_OK;
+  }
+  fl_insert(fl, new);
   return fl_OK;
 }
 
+void fl_flush_classes(freelist* fl) {
+  fl_node* node;
+  size_t i;
+  for (i = 0; i < FL_CLASSES; i++) {
+    while (fl->classes[i] != NULL) {
+      node = fl->classes[i];
+      fl->classes[i] = node->next;
+      fl_insert(fl, node);
+    }
+  }
+  fl->cached = 0;
+}
+
 void fl_free_all(freelist* fl) {
-  fl->head = (fl_node*)fl->begin;
-  fl->head->size = fl->size;
-  fl->head->next = NULL;
+  fl_reset_main(fl);
+  fl_reset_classes(fl);
 }
 
 size_t fl_available(const freelist* fl) {
   fl_node* curr = fl->head;
-  size_t total = 0;
+  size_t total = fl->cached;
 
   while (curr != NULL) {
-    total += curr->size;
+    total += FL_SIZE(curr);
     curr = curr->next;
   }
   return total;
 }
 
+size_t fl_largest(const freelist* fl) {
+  fl_node* curr = fl->head;
+  size_t largest = 0;
+
+  while (curr != NULL) {
+    if (FL_SIZE(curr) > largest) {
+      largest = FL_SIZE(curr);
+    }
+    curr = curr->next;
+  }
+  return largest;
+}
+
 size_t fl_used(const freelist* fl) {
   return fl->size - fl_available(fl);
 }
@@ -631,10 +1490,21 @@ typedef struct {
 
 stack_f* sf_create(uint8_t* buff, size_t buffsize, size_t chunksize, enum sf_RES* res);
 
+/* pushes a chunk on the stack,
+ * returns NULL if the stack is full
+ */
 uint8_t* sf_alloc(stack_f* sf);
 
 enum sf_RES sf_free(stack_f* sf);
 
+/* returns the chunk at the top of the stack,
+ * or NULL if the stack is empty
+ */
+uint8_t* sf_top(const stack_f* sf);
+
+/* pops chunks until only 'used' bytes remain allocated */
+void sf_free_to(stack_f* sf, size_t used);
+
 void sf_free_all(stack_f* sf);
 
 size_t sf_available(const stack_f* sf);
@@ -666,13 +1536,18 @@ stack_f* sf_create(uint8_t* buff, size_t buffsize, size_t chunksize, enum sf_RES
   sf->buff = buff+sizeof(stack_f);
   sf->chunksize = chunksize;
   sf->buffsize = buffsize-sizeof(stack_f);
+  sf->allocated = 0;
 
   *res = sf_OK;
   return sf;
 }
 
 uint8_t* sf_alloc(stack_f* sf) {
-  uint8_t* out = sf->buff + sf->allocated;
+  uint8_t* out;
+  if (sf->buffsize - sf->allocated < sf->chunksize) {
+    return NULL;
+  }
+  out = sf->buff + sf->allocated;
   sf->allocated += sf->chunksize;
   return out;
 }
@@ -685,6 +1560,19 @@ enum sf_RES sf_free(stack_f* sf) {
   return sf_OK;
 }
 
+uint8_t* sf_top(const stack_f* sf) {
+  if (sf->allocated == 0) {
+    return NULL;
+  }
+  return sf->buff + sf->allocated - sf->chunksize;
+}
+
+void sf_free_to(stack_f* sf, size_t used) {
+  if (used < sf->allocated) {
+    sf->allocated = used;
+  }
+}
+
 void sf_free_all(stack_f* sf) {
   sf->allocated = 0;
 }
@@ -707,7 +1595,167 @@ bool sf_empty(const stack_f* sf) {
  * -------------------------------------
  */
 
-/* we need a str->ptr hashmap for the symbol table */
+/* str->ptr hashmap used for the symbol table.
+ * it uses open addressing with robin hood insertion: entries that are
+ * far from their home slot steal the place of entries that are closer
+ * to theirs, this keeps probe sequences short and lets lookups stop
+ * as soon as they reach an entry closer to home than the key would be.
+ * keys are not copied, they must outlive the map.
+ */
+
+enum hm_RES {
+  hm_OK,
+  /* Buffer is too small */
+  hm_ERR_SMALLBUFF,
+  /* The map reached its maximum load */
+  hm_ERR_FULL
+};
+
+char* hm_str_res(enum hm_RES res);
+
+typedef struct {
+  uint32_t hash;  /* 0 means the slot is empty */
+  uint32_t dist;  /* distance from the home slot */
+  const char* key;
+  size_t len;
+  void* value;
+} hm_entry;
+
+typedef struct {
+  hm_entry* entries;
+  size_t capacity;  /* always a power of two */
+  size_t count;
+} hashmap;
+
+/* returns a hashmap allocated at the beginning of the buffer,
+ * the capacity is the largest power of two that fits.
+ */
+hashmap* hm_create(uint8_t* buff, size_t size, enum hm_RES* res);
+
+/* returns the value associated with the key, or NULL */
+void* hm_get(const hashmap* hm, const char* key, size_t len);
+
+/* associates the value with the key, replacing the previous one */
+enum hm_RES hm_put(hashmap* hm, const char* key, size_t len, void* value);
+
+/* removes every entry */
+void hm_clear(hashmap* hm);
+
+char* hm_str_res(enum hm_RES res) {
+  switch (res) {
+    case hm_OK:
+      return "OK";
+    case hm_ERR_SMALLBUFF:
+      return "Provided buffer is too small";
+    case hm_ERR_FULL:
+      return "Hashmap is full";
+  }
+  return "??";
+}
+
+/* FNV-1a */
+uint32_t hm_hash(const char* key, size_t len) {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (uint8_t)key[i];
+    h *= 16777619u;
+  }
+  return h == 0 ? 1 : h;
+}
+
+hashmap* hm_create(uint8_t* buff, size_t size, enum hm_RES* res) {
+  hashmap* hm;
+  size_t capacity = 1;
+
+  if (size < sizeof(hashmap) + 2*sizeof(hm_entry)) {
+    *res = hm_ERR_SMALLBUFF;
+    return NULL;
+  }
+  while (capacity*2*sizeof(hm_entry) <= size - sizeof(hashmap)) {
+    capacity *= 2;
+  }
+
+  hm = (hashmap*)buff;
+  hm->entries = (hm_entry*)(buff + sizeof(hashmap));
+  hm->capacity = capacity;
+  hm_clear(hm);
+  *res = hm_OK;
+  return hm;
+}
+
+void hm_clear(hashmap* hm) {
+  size_t i;
+  for (i = 0; i < hm->capacity; i++) {
+    hm->entries[i].hash = 0;
+  }
+  hm->count = 0;
+}
+
+hm_entry* hm_find(const hashmap* hm, const char* key, size_t len, uint32_t hash) {
+  size_t mask = hm->capacity - 1;
+  size_t i = hash & mask;
+  uint32_t dist = 0;
+  hm_entry* e;
+
+  while (true) {
+    e = &hm->entries[i];
+    if (e->hash == 0 || e->dist < dist) {
+      return NULL;
+    }
+    if (e->hash == hash && e->len == len && memcmp(e->key, key, len) == 0) {
+      return e;
+    }
+    i = (i+1) & mask;
+    dist++;
+  }
+}
+
+void* hm_get(const hashmap* hm, const char* key, size_t len) {
+  hm_entry* e = hm_find(hm, key, len, hm_hash(key, len));
+  if (e == NULL) {
+    return NULL;
+  }
+  return e->value;
+}
+
+enum hm_RES hm_put(hashmap* hm, const char* key, size_t len, void* value) {
+  size_t mask = hm->capacity - 1;
+  hm_entry new, tmp;
+  hm_entry* e;
+  size_t i;
+
+  new.hash = hm_hash(key, len);
+  new.dist = 0;
+  new.key = key;
+  new.len = len;
+  new.value = value;
+
+  e = hm_find(hm, key, len, new.hash);
+  if (e != NULL) {
+    e->value = value;
+    return hm_OK;
+  }
+
+  /* we keep the load under 7/8 so probes stay short */
+  if (hm->count+1 > hm->capacity - hm->capacity/8) {
+    return hm_ERR_FULL;
+  }
+
+  i = new.hash & mask;
+  while (hm->entries[i].hash != 0) {
+    if (hm->entries[i].dist < new.dist) {
+      tmp = hm->entries[i];
+      hm->entries[i] = new;
+      new = tmp;
+    }
+    i = (i+1) & mask;
+    new.dist++;
+  }
+  hm->entries[i] = new;
+  hm->count++;
+  return hm_OK;
+}
 
 /*
  * -------------------------------------
@@ -755,6 +1803,7 @@ typedef struct {
 typedef struct {
   const char* input;
   size_t input_size;
+  size_t valid;  /* the input up to here is well formed utf8 */
   lexeme lexeme;
   error err;
 } lexer;
@@ -763,6 +1812,7 @@ lexer lex_new_lexer(const char* input, size_t size) {
   lexer l;
   l.input = input;
   l.input_size = size;
+  l.valid = utf8_valid(input, size);
   l.lexeme.begin = 0;
   l.lexeme.end = 0;
   l.lexeme.vkind = vk_none;
@@ -794,36 +1844,55 @@ error lex_err_unrecognized(lexer* l) {
   return err;
 }
 
+error lex_err_unexpected_eof(lexer* l) {
+  error err;
+  err.code = error_unexpected_eof;
+  err.range.begin = l->lexeme.begin;
+  err.range.end = l->lexeme.end;
+  return err;
+}
+
+/* ascii is by far the most common input, only bytes outside of
+ * it need decoding. the input was validated by lex_new_lexer, so
+ * that's done without checks up to the first bad sequence
+ */
 rune lex_next_rune(lexer* l) {
   rune r;
-  size_t size;
+  uint8_t c;
 
   if (l->lexeme.end >= l->input_size) {
     return EoF;
   }
-  
-  size = utf8_decode(l->input + l->lexeme.end, &r);
-  if (size == 0 || r == -1) {
+  c = (uint8_t)l->input[l->lexeme.end];
+  if (c < 0x80) {
+    l->lexeme.end++;
+    return (rune)c;
+  }
+
+  if (l->lexeme.end >= l->valid) {
     l->err = lex_err_bad_rune(l);
     return -1;
   }
-  l->lexeme.end += size;
+  l->lexeme.end += utf8_decode_valid(l->input + l->lexeme.end, &r);
   return r;
 }
 
 rune lex_peek_rune(lexer* l) {
   rune r;
-  size_t size;
+  uint8_t c;
   if (l->lexeme.end >= l->input_size) {
     return EoF;
   }
+  c = (uint8_t)l->input[l->lexeme.end];
+  if (c < 0x80) {
+    return (rune)c;
+  }
 
-  size = utf8_decode(l->input + l->lexeme.end, &r);
-  
-  if (size == 0 || r == -1) {
+  if (l->lexeme.end >= l->valid) {
     l->err = lex_err_bad_rune(l);
     return -1;
   }
+  utf8_decode_valid(l->input + l->lexeme.end, &r);
   return r;
 }
 
@@ -832,88 +1901,184 @@ void lex_ignore(lexer* l) {
   l->lexeme.kind = lk_bad;
 }
 
-typedef bool (*validator)(rune);
+/* classes of ascii characters, every other byte has no class */
+#define LC_DEC   0x01  /* decimal digit                   */
+#define LC_HEX   0x02  /* hexadecimal digit               */
+#define LC_BIN   0x04  /* binary digit                    */
+#define LC_ID    0x08  /* starts an identifier            */
+#define LC_IDNUM 0x10  /* continues an identifier         */
+#define LC_SPACE 0x20  /* whitespace                      */
+
+#define LC_DIGIT (LC_DEC | LC_HEX | LC_IDNUM)
+#define LC_ALPHA (LC_ID | LC_IDNUM)
+#define LC_XALPHA (LC_ALPHA | LC_HEX)
+
+/* '_' is allowed anywhere in numbers and identifiers */
+const uint8_t lex_class[256] = {
+  ['0'] = LC_DIGIT | LC_BIN, ['1'] = LC_DIGIT | LC_BIN,
+  ['2'] = LC_DIGIT, ['3'] = LC_DIGIT, ['4'] = LC_DIGIT, ['5'] = LC_DIGIT,
+  ['6'] = LC_DIGIT, ['7'] = LC_DIGIT, ['8'] = LC_DIGIT, ['9'] = LC_DIGIT,
+
+  ['a'] = LC_XALPHA, ['b'] = LC_XALPHA, ['c'] = LC_XALPHA, ['d'] = LC_XALPHA,
+  ['e'] = LC_XALPHA, ['f'] = LC_XALPHA, ['g'] = LC_ALPHA, ['h'] = LC_ALPHA,
+  ['i'] = LC_ALPHA, ['j'] = LC_ALPHA, ['k'] = LC_ALPHA, ['l'] = LC_ALPHA,
+  ['m'] = LC_ALPHA, ['n'] = LC_ALPHA, ['o'] = LC_ALPHA, ['p'] = LC_ALPHA,
+  ['q'] = LC_ALPHA, ['r'] = LC_ALPHA, ['s'] = LC_ALPHA, ['t'] = LC_ALPHA,
+  ['u'] = LC_ALPHA, ['v'] = LC_ALPHA, ['w'] = LC_ALPHA, ['x'] = LC_ALPHA,
+  ['y'] = LC_ALPHA, ['z'] = LC_ALPHA,
+
+  ['A'] = LC_XALPHA, ['B'] = LC_XALPHA, ['C'] = LC_XALPHA, ['D'] = LC_XALPHA,
+  ['E'] = LC_XALPHA, ['F'] = LC_XALPHA, ['G'] = LC_ALPHA, ['H'] = LC_ALPHA,
+  ['I'] = LC_ALPHA, ['J'] = LC_ALPHA, ['K'] = LC_ALPHA, ['L'] = LC_ALPHA,
+  ['M'] = LC_ALPHA, ['N'] = LC_ALPHA, ['O'] = LC_ALPHA, ['P'] = LC_ALPHA,
+  ['Q'] = LC_ALPHA, ['R'] = LC_ALPHA, ['S'] = LC_ALPHA, ['T'] = LC_ALPHA,
+  ['U'] = LC_ALPHA, ['V'] = LC_ALPHA, ['W'] = LC_ALPHA, ['X'] = LC_ALPHA,
+  ['Y'] = LC_ALPHA, ['Z'] = LC_ALPHA,
+
+  ['_'] = LC_DEC | LC_HEX | LC_BIN | LC_ALPHA,
+  ['~'] = LC_ALPHA, ['+'] = LC_ALPHA, ['-'] = LC_ALPHA, ['*'] = LC_ALPHA,
+  ['/'] = LC_ALPHA, ['?'] = LC_ALPHA, ['='] = LC_ALPHA, ['&'] = LC_ALPHA,
+  ['$'] = LC_ALPHA, ['%'] = LC_ALPHA, ['<'] = LC_ALPHA, ['>'] = LC_ALPHA,
+  ['!'] = LC_ALPHA,
+
+  [' '] = LC_SPACE, ['\r'] = LC_SPACE, ['\t'] = LC_SPACE, ['\n'] = LC_SPACE
+};
+
+bool lex_is_class(rune r, uint8_t cls) {
+  return r >= 0 && r < 0x80 && (lex_class[r] & cls) != 0;
+}
 
 bool lex_is_decdigit(rune r) {
-  return (r >= '0' && r <= '9') ||
-         (r == '_');
+  return lex_is_class(r, LC_DEC);
 }
 
 bool lex_is_hexdigit(rune r) {
-  return (r >= '0' && r <= '9') ||
-         (r >= 'a' && r <= 'f') ||
-         (r >= 'A' && r <= 'F') ||
-         (r == '_');
+  return lex_is_class(r, LC_HEX);
 }
 
 bool lex_is_bindigit(rune r) {
-  return (r == '0') ||
-         (r == '1') ||
-         (r == '_');
+  return lex_is_class(r, LC_BIN);
 }
 
 bool lex_is_idchar(rune r) {
-  return (r >= 'a' && r <= 'z') ||
-         (r >= 'A' && r <= 'Z') ||
-         (r == '~') || (r == '+') ||
-         (r == '-') || (r == '_') ||
-         (r == '*') || (r == '/') ||
-         (r == '?') || (r == '=') ||
-         (r == '&') || (r == '$') ||
-         (r == '%') || (r == '<') ||
-         (r == '>') || (r == '!');
+  return lex_is_class(r, LC_ID);
 }
 
 bool lex_is_idcharnum(rune r) {
-  return (r >= '0' && r <= '9') ||
-         (r >= 'a' && r <= 'z') ||
-         (r >= 'A' && r <= 'Z') ||
-         (r == '~') || (r == '+') ||
-         (r == '-') || (r == '_') ||
-         (r == '*') || (r == '/') ||
-         (r == '?') || (r == '=') ||
-         (r == '&') || (r == '$') ||
-         (r == '%') || (r == '<') ||
-         (r == '>') || (r == '!');
+  return lex_is_class(r, LC_IDNUM);
 }
 
 bool lex_is_whitespace(rune r) {
-  return (r == ' ') || (r == '\n') || (r == '\r') || (r == '\t');
+  return lex_is_class(r, LC_SPACE);
 }
 
-bool lex_is_special_str_char(rune r) {
-  return (r == '\\') || (r == '"');
+/* skips the bytes of class 'cls'. only ascii has classes, so the run
+ * ends at the first byte that is not, and nothing needs decoding
+ */
+void lex_accept_run(lexer* l, uint8_t cls) {
+  const uint8_t* input = (const uint8_t*)l->input;
+  size_t i = l->lexeme.end;
+  while (i < l->input_size && (lex_class[input[i]] & cls) != 0) {
+    i++;
+  }
+  l->lexeme.end = i;
 }
 
-bool lex_accept_run(lexer* l, validator v) {
-  rune r = lex_peek_rune(l);
-  if (r < 0) {
-    return false;
+/* bulk scanning, 16 bytes at a time with simd or 8 with plain words.
+ * the input is validated up front so these may skip over any byte
+ * that's not ascii, none of them can be part of a delimiter
+ */
+/* returns the index of the first byte from 'i' that is 'a', 'b'
+ * or NUL, or 'n' if there's none
+ */
+size_t lex_scan_until(const uint8_t* p, size_t i, size_t n, uint8_t a, uint8_t b) {
+  uint64_t w;
+#if defined(LEX_SSE2)
+  __m128i va = _mm_set1_epi8((char)a);
+  __m128i vb = _mm_set1_epi8((char)b);
+  __m128i zero = _mm_setzero_si128();
+  __m128i v;
+  int mask;
+  for (; i + 16 <= n; i += 16) {
+    v = _mm_loadu_si128((const __m128i*)(p + i));
+    mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+        _mm_cmpeq_epi8(v, zero)));
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
   }
-  while (v(r)) {
-    lex_next_rune(l);
-    r = lex_peek_rune(l);
-    if (r < 0) {
-      return false;
+#elif defined(LEX_NEON)
+  uint8x16_t va = vdupq_n_u8(a);
+  uint8x16_t vb = vdupq_n_u8(b);
+  uint8x16_t v;
+  for (; i + 16 <= n; i += 16) {
+    v = vld1q_u8(p + i);
+    if (vmaxvq_u8(vorrq_u8(vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb)),
+                           vceqzq_u8(v))) != 0) {
+      break;
     }
   }
-
-  return true;
+#endif
+  for (; i + 8 <= n; i += 8) {
+    memcpy(&w, p + i, 8);
+    if ((swar_eq(w, a) | swar_eq(w, b) | swar_zero(w)) != 0) {
+      break;
+    }
+  }
+  while (i < n && p[i] != a && p[i] != b && p[i] != 0) {
+    i++;
+  }
+  return i;
 }
 
-bool lex_accept_until(lexer* l, validator v) {
-  rune r = lex_peek_rune(l);
-  if (r < 0) {
-    return false;
+/* returns the index of the first byte from 'i' that is not whitespace */
+size_t lex_scan_space(const uint8_t* p, size_t i, size_t n) {
+  uint64_t w;
+#if defined(LEX_SSE2)
+  __m128i v;
+  int mask;
+  for (; i + 16 <= n; i += 16) {
+    v = _mm_loadu_si128((const __m128i*)(p + i));
+    mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')))));
+    if (mask != 0xffff) {
+      return i + (size_t)__builtin_ctz((unsigned)mask ^ 0xffff);
+    }
   }
-  while (!v(r)) {
-    lex_next_rune(l);
-    r = lex_peek_rune(l);
-    if (r < 0) {
-      return false;
+#elif defined(LEX_NEON)
+  uint8x16_t v;
+  for (; i + 16 <= n; i += 16) {
+    v = vld1q_u8(p + i);
+    if (vminvq_u8(vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\n'))),
+                           vorrq_u8(vceqq_u8(v, vdupq_n_u8('\r')), vceqq_u8(v, vdupq_n_u8('\t'))))) == 0) {
+      break;
     }
   }
+#endif
+  for (; i + 8 <= n; i += 8) {
+    memcpy(&w, p + i, 8);
+    if ((swar_eq(w, ' ') | swar_eq(w, '\n') | swar_eq(w, '\r') | swar_eq(w, '\t')) != SWAR_HIGH) {
+      break;
+    }
+  }
+  while (i < n && (lex_class[p[i]] & LC_SPACE) != 0) {
+    i++;
+  }
+  return i;
+}
 
+/* skips runes until 'a', 'b' or the end of the input (NUL counts as
+ * the end). returns false if there's a bad rune in between
+ */
+bool lex_accept_until(lexer* l, uint8_t a, uint8_t b) {
+  size_t i = lex_scan_until((const uint8_t*)l->input, l->lexeme.end, l->valid, a, b);
+  l->lexeme.end = i;
+  if (i == l->valid && i < l->input_size) {
+    l->err = lex_err_bad_rune(l);
+    return false;
+  }
   return true;
 }
 
@@ -927,141 +2092,641 @@ bool lex_read_strlit(lexer* l) {
   lex_next_rune(l);
 
   while (true) {
-    ok = lex_accept_until(l, lex_is_special_str_char);
+    ok = lex_accept_until(l, '"', '\\');
     if (ok == false) {
       return false;
     }
 
+    r = lex_peek_rune(l);
     if (r == '"') {
       lex_next_rune(l);
+      l->lexeme.kind = lk_str;
       return true;
     }
 
-    if (r == '\\') {
-      lex_next_rune(l);
-      ok = lex_next_rune(l);
-      if (ok == false) {
-        return false;
-      }
+    if (r == EoF) {
+      l->err = lex_err_unexpected_eof(l);
+      return false;
     }
-  }
-}
 
-bool lex_conv_hex(lexer* l, uint64_t* value) {
-  /* jump the '0x' */
-  char* begin = (char*)l->input + l->lexeme.begin + 2;
-  char* end = (char*)l->input + l->lexeme.end;
-  char c;
-  uint64_t output = 0;
-  while (begin < end) {
-    c = *begin;
-    if (c == '_') {
-      begin++;
-      continue;
+    /* r == '\\', we skip whatever is escaped */
+    lex_next_rune(l);
+    r = lex_next_rune(l);
+    if (r < 0) {
+      return false;
     }
-    output *= 16;
-    if (c >= '0' && c <= '9') {
-      output += (c - '0');
-    } else if (c >= 'a' && c <= 'z') {
-      output += (c - 'a') + 10;
-    } else if (c >= 'A' && c <= 'Z') {
-      output += (c - 'A') + 10;
-    } else {
-      l->err = lex_err_internal(l);
+    if (r == EoF) {
+      l->err = lex_err_unexpected_eof(l);
       return false;
     }
-    begin++;
   }
-  *value = output;
-  return true;
 }
 
-bool lex_conv_bin(lexer* l, uint64_t* value) {
-  /* jump the '0b' */
-  char* begin = (char*)l->input + l->lexeme.begin + 2;
-  char* end = (char*)l->input + l->lexeme.end;
-  char c;
+error lex_err_overflow(lexer* l) {
+  error err;
+  err.code = error_number_overflow;
+  err.range.begin = l->lexeme.begin;
+  err.range.end = l->lexeme.end;
+  return err;
+}
+
+/* reads the digits after '0x' or '0b' as they're scanned, each one
+ * worth 'shift' bits. literals up to 64 bits are accepted, the ones
+ * above INT64_MAX become negative numbers.
+ */
+bool lex_read_pow2(lexer* l, int shift, uint8_t cls, uint64_t* value) {
+  const uint8_t* p = (const uint8_t*)l->input;
+  size_t i = l->lexeme.end;
   uint64_t output = 0;
-  while (begin < end) {
-    c = *begin;
+  bool overflow = false;
+  uint8_t c;
+
+  while (i < l->input_size && (lex_class[p[i]] & cls) != 0) {
+    c = p[i++];
     if (c == '_') {
-      begin++;
       continue;
     }
-    output *= 2;
-    if (c == '0' || c == '1') {
-      output += (c - '0');
-    } else {
-      l->err = lex_err_internal(l);
-      return false;
-    }
-    begin++;
+    overflow |= (output >> (64 - shift)) != 0;
+    output <<= shift;
+    output |= c <= '9' ? (uint64_t)(c - '0') : (uint64_t)((c | 0x20) - 'a' + 10);
+  }
+  l->lexeme.end = i;
+  if (overflow) {
+    l->err = lex_err_overflow(l);
+    return false;
   }
   *value = output;
   return true;
 }
 
-bool lex_conv_dec(lexer* l, uint64_t* value) {
-  char* begin = (char*)l->input + l->lexeme.begin;
-  char* end = (char*)l->input + l->lexeme.end;
-  char c;
-  uint64_t output = 0;
-  while (begin < end) {
-    c = *begin;
+/* any 19 decimal digits fit in 64 bits */
+#define LEX_MAX_DIGITS 19
+
+/* a decimal literal as mantissa * 10^exponent. only the first
+ * digits that aren't leading zeros are kept in the mantissa.
+ */
+typedef struct {
+  uint64_t mantissa;
+  int digits;
+  int64_t exponent;
+  bool truncated;  /* a digit dropped from the mantissa was not zero */
+} lex_decimal;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LEX_SWAR_DIGITS
+
+/* true if all 8 bytes of 'w' are ascii digits */
+bool swar_is_digits(uint64_t w) {
+  return ((w & 0xf0f0f0f0f0f0f0f0) |
+          (((w + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) >> 4)) == 0x3333333333333333;
+}
+
+/* the value of 8 ascii digits, the first one in the lowest byte */
+uint64_t swar_parse8(uint64_t w) {
+  w -= 0x3030303030303030;
+  w = w * 10 + (w >> 8);
+  return (((w & 0x000000ff000000ff) * (100 + ((uint64_t)1000000 << 32))) +
+          (((w >> 16) & 0x000000ff000000ff) * (1 + ((uint64_t)10000 << 32)))) >> 32;
+}
+#endif
+
+/* reads decimal digits (and '_') into 'd' as they're scanned, 8 at a
+ * time while they fit. digits after the '.' lower the exponent, the
+ * ones that don't fit in the mantissa before it raise it.
+ */
+void lex_read_digits(lexer* l, lex_decimal* d, bool fraction) {
+  const uint8_t* p = (const uint8_t*)l->input;
+  size_t i = l->lexeme.end;
+  size_t n = l->input_size;
+  uint8_t c;
+#ifdef LEX_SWAR_DIGITS
+  uint64_t w;
+#endif
+
+  while (i < n) {
+#ifdef LEX_SWAR_DIGITS
+    if (d->mantissa != 0 && d->digits + 8 <= LEX_MAX_DIGITS && i + 8 <= n) {
+      memcpy(&w, p + i, 8);
+      if (swar_is_digits(w)) {
+        d->mantissa = d->mantissa * 100000000 + swar_parse8(w);
+        d->digits += 8;
+        d->exponent -= fraction ? 8 : 0;
+        i += 8;
+        continue;
+      }
+    }
+#endif
+    c = p[i];
     if (c == '_') {
-      begin++;
+      i++;
       continue;
     }
-    output *= 10;
-    if (c >= '0' && c <= '9') {
-      output += (c - '0');
+    if (c < '0' || c > '9') {
+      break;
+    }
+    if (d->digits < LEX_MAX_DIGITS) {
+      d->mantissa = d->mantissa * 10 + (uint64_t)(c - '0');
+      d->digits += d->mantissa != 0;
+      d->exponent -= fraction;
     } else {
-      l->err = lex_err_internal(l);
-      return false;
+      d->truncated |= c != '0';
+      d->exponent += !fraction;
     }
-    begin++;
+    i++;
   }
-  *value = output;
-  return true;
+  l->lexeme.end = i;
 }
 
-bool lex_conv_inexact(lexer* l, double* value) {
-  char* begin = (char*)l->input + l->lexeme.begin;
-  char* end = (char*)l->input + l->lexeme.end;
-  char c;
-  int fractional = 0;
-  double output = 0;
-  while (begin < end) {
-    c = *begin;
-    if (c == '_') {
-      begin++;
-      continue;
-    }
-    if (c == '.') {
-      fractional += 1;
-      begin++;
-      continue;
-    }
+/* powers of ten a double holds exactly */
+const double lex_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-    if (c >= '0' && c <= '9' && fractional == 0) {
-      output *= 10;
-      output += (c - '0');
-    } else if (c >= '0' && c <= '9' && fractional > 0) {
-      output += (double)(c - '0') / (10.0*fractional);
-      fractional += 1;
-    } else {
-      l->err = lex_err_internal(l);
-      return false;
-    }
-    begin++;
+#define LEX_MIN_POW5 (-342)
+#define LEX_MAX_POW5 308
+
+/* 5^q for q in [LEX_MIN_POW5, LEX_MAX_POW5], normalized to 128 bits
+ * ({high, low}), truncated for q >= 0 and rounded up below.
+ */
+const uint64_t lex_pow5[][2] = {
+  {0xeef453d6923bd65a, 0x113faa2906a13b3f}, {0x9558b4661b6565f8, 0x4ac7ca59a424c507},
+  {0xbaaee17fa23ebf76, 0x5d79bcf00d2df649}, {0xe95a99df8ace6f53, 0xf4d82c2c107973dc},
+  {0x91d8a02bb6c10594, 0x79071b9b8a4be869}, {0xb64ec836a47146f9, 0x9748e2826cdee284},
+  {0xe3e27a444d8d98b7, 0xfd1b1b2308169b25}, {0x8e6d8c6ab0787f72, 0xfe30f0f5e50e20f7},
+  {0xb208ef855c969f4f, 0xbdbd2d335e51a935}, {0xde8b2b66b3bc4723, 0xad2c788035e61382},
+  {0x8b16fb203055ac76, 0x4c3bcb5021afcc31}, {0xaddcb9e83c6b1793, 0xdf4abe242a1bbf3d},
+  {0xd953e8624b85dd78, 0xd71d6dad34a2af0d}, {0x87d4713d6f33aa6b, 0x8672648c40e5ad68},
+  {0xa9c98d8ccb009506, 0x680efdaf511f18c2}, {0xd43bf0effdc0ba48, 0x0212bd1b2566def2},
+  {0x84a57695fe98746d, 0x014bb630f7604b57}, {0xa5ced43b7e3e9188, 0x419ea3bd35385e2d},
+  {0xcf42894a5dce35ea, 0x52064cac828675b9}, {0x818995ce7aa0e1b2, 0x7343efebd1940993},
+  {0xa1ebfb4219491a1f, 0x1014ebe6c5f90bf8}, {0xca66fa129f9b60a6, 0xd41a26e077774ef6},
+  {0xfd00b897478238d0, 0x8920b098955522b4}, {0x9e20735e8cb16382, 0x55b46e5f5d5535b0},
+  {0xc5a890362fddbc62, 0xeb2189f734aa831d}, {0xf712b443bbd52b7b, 0xa5e9ec7501d523e4},
+  {0x9a6bb0aa55653b2d, 0x47b233c92125366e}, {0xc1069cd4eabe89f8, 0x999ec0bb696e840a},
+  {0xf148440a256e2c76, 0xc00670ea43ca250d}, {0x96cd2a865764dbca, 0x380406926a5e5728},
+  {0xbc807527ed3e12bc, 0xc605083704f5ecf2}, {0xeba09271e88d976b, 0xf7864a44c633682e},
+  {0x93445b8731587ea3, 0x7ab3ee6afbe0211d}, {0xb8157268fdae9e4c, 0x5960ea05bad82964},
+  {0xe61acf033d1a45df, 0x6fb92487298e33bd}, {0x8fd0c16206306bab, 0xa5d3b6d479f8e056},
+  {0xb3c4f1ba87bc8696, 0x8f48a4899877186c}, {0xe0b62e2929aba83c, 0x331acdabfe94de87},
+  {0x8c71dcd9ba0b4925, 0x9ff0c08b7f1d0b14}, {0xaf8e5410288e1b6f, 0x07ecf0ae5ee44dd9},
+  {0xdb71e91432b1a24a, 0xc9e82cd9f69d6150}, {0x892731ac9faf056e, 0xbe311c083a225cd2},
+  {0xab70fe17c79ac6ca, 0x6dbd630a48aaf406}, {0xd64d3d9db981787d, 0x092cbbccdad5b108},
+  {0x85f0468293f0eb4e, 0x25bbf56008c58ea5}, {0xa76c582338ed2621, 0xaf2af2b80af6f24e},
+  {0xd1476e2c07286faa, 0x1af5af660db4aee1}, {0x82cca4db847945ca, 0x50d98d9fc890ed4d},
+  {0xa37fce126597973c, 0xe50ff107bab528a0}, {0xcc5fc196fefd7d0c, 0x1e53ed49a96272c8},
+  {0xff77b1fcbebcdc4f, 0x25e8e89c13bb0f7a}, {0x9faacf3df73609b1, 0x77b191618c54e9ac},
+  {0xc795830d75038c1d, 0xd59df5b9ef6a2417}, {0xf97ae3d0d2446f25, 0x4b0573286b44ad1d},
+  {0x9becce62836ac577, 0x4ee367f9430aec32}, {0xc2e801fb244576d5, 0x229c41f793cda73f},
+  {0xf3a20279ed56d48a, 0x6b43527578c1110f}, {0x9845418c345644d6, 0x830a13896b78aaa9},
+  {0xbe5691ef416bd60c, 0x23cc986bc656d553}, {0xedec366b11c6cb8f, 0x2cbfbe86b7ec8aa8},
+  {0x94b3a202eb1c3f39, 0x7bf7d71432f3d6a9}, {0xb9e08a83a5e34f07, 0xdaf5ccd93fb0cc53},
+  {0xe858ad248f5c22c9, 0xd1b3400f8f9cff68}, {0x91376c36d99995be, 0x23100809b9c21fa1},
+  {0xb58547448ffffb2d, 0xabd40a0c2832a78a}, {0xe2e69915b3fff9f9, 0x16c90c8f323f516c},
+  {0x8dd01fad907ffc3b, 0xae3da7d97f6792e3}, {0xb1442798f49ffb4a, 0x99cd11cfdf41779c},
+  {0xdd95317f31c7fa1d, 0x40405643d711d583}, {0x8a7d3eef7f1cfc52, 0x482835ea666b2572},
+  {0xad1c8eab5ee43b66, 0xda3243650005eecf}, {0xd863b256369d4a40, 0x90bed43e40076a82},
+  {0x873e4f75e2224e68, 0x5a7744a6e804a291}, {0xa90de3535aaae202, 0x711515d0a205cb36},
+  {0xd3515c2831559a83, 0x0d5a5b44ca873e03}, {0x8412d9991ed58091, 0xe858790afe9486c2},
+  {0xa5178fff668ae0b6, 0x626e974dbe39a872}, {0xce5d73ff402d98e3, 0xfb0a3d212dc8128f},
+  {0x80fa687f881c7f8e, 0x7ce66634bc9d0b99}, {0xa139029f6a239f72, 0x1c1fffc1ebc44e80},
+  {0xc987434744ac874e, 0xa327ffb266b56220}, {0xfbe9141915d7a922, 0x4bf1ff9f0062baa8},
+  {0x9d71ac8fada6c9b5, 0x6f773fc3603db4a9}, {0xc4ce17b399107c22, 0xcb550fb4384d21d3},
+  {0xf6019da07f549b2b, 0x7e2a53a146606a48}, {0x99c102844f94e0fb, 0x2eda7444cbfc426d},
+  {0xc0314325637a1939, 0xfa911155fefb5308}, {0xf03d93eebc589f88, 0x793555ab7eba27ca},
+  {0x96267c7535b763b5, 0x4bc1558b2f3458de}, {0xbbb01b9283253ca2, 0x9eb1aaedfb016f16},
+  {0xea9c227723ee8bcb, 0x465e15a979c1cadc}, {0x92a1958a7675175f, 0x0bfacd89ec191ec9},
+  {0xb749faed14125d36, 0xcef980ec671f667b}, {0xe51c79a85916f484, 0x82b7e12780e7401a},
+  {0x8f31cc0937ae58d2, 0xd1b2ecb8b0908810}, {0xb2fe3f0b8599ef07, 0x861fa7e6dcb4aa15},
+  {0xdfbdcece67006ac9, 0x67a791e093e1d49a}, {0x8bd6a141006042bd, 0xe0c8bb2c5c6d24e0},
+  {0xaecc49914078536d, 0x58fae9f773886e18}, {0xda7f5bf590966848, 0xaf39a475506a899e},
+  {0x888f99797a5e012d, 0x6d8406c952429603}, {0xaab37fd7d8f58178, 0xc8e5087ba6d33b83},
+  {0xd5605fcdcf32e1d6, 0xfb1e4a9a90880a64}, {0x855c3be0a17fcd26, 0x5cf2eea09a55067f},
+  {0xa6b34ad8c9dfc06f, 0xf42faa48c0ea481e}, {0xd0601d8efc57b08b, 0xf13b94daf124da26},
+  {0x823c12795db6ce57, 0x76c53d08d6b70858}, {0xa2cb1717b52481ed, 0x54768c4b0c64ca6e},
+  {0xcb7ddcdda26da268, 0xa9942f5dcf7dfd09}, {0xfe5d54150b090b02, 0xd3f93b35435d7c4c},
+  {0x9efa548d26e5a6e1, 0xc47bc5014a1a6daf}, {0xc6b8e9b0709f109a, 0x359ab6419ca1091b},
+  {0xf867241c8cc6d4c0, 0xc30163d203c94b62}, {0x9b407691d7fc44f8, 0x79e0de63425dcf1d},
+  {0xc21094364dfb5636, 0x985915fc12f542e4}, {0xf294b943e17a2bc4, 0x3e6f5b7b17b2939d},
+  {0x979cf3ca6cec5b5a, 0xa705992ceecf9c42}, {0xbd8430bd08277231, 0x50c6ff782a838353},
+  {0xece53cec4a314ebd, 0xa4f8bf5635246428}, {0x940f4613ae5ed136, 0x871b7795e136be99},
+  {0xb913179899f68584, 0x28e2557b59846e3f}, {0xe757dd7ec07426e5, 0x331aeada2fe589cf},
+  {0x9096ea6f3848984f, 0x3ff0d2c85def7621}, {0xb4bca50b065abe63, 0x0fed077a756b53a9},
+  {0xe1ebce4dc7f16dfb, 0xd3e8495912c62894}, {0x8d3360f09cf6e4bd, 0x64712dd7abbbd95c},
+  {0xb080392cc4349dec, 0xbd8d794d96aacfb3}, {0xdca04777f541c567, 0xecf0d7a0fc5583a0},
+  {0x89e42caaf9491b60, 0xf41686c49db57244}, {0xac5d37d5b79b6239, 0x311c2875c522ced5},
+  {0xd77485cb25823ac7, 0x7d633293366b828b}, {0x86a8d39ef77164bc, 0xae5dff9c02033197},
+  {0xa8530886b54dbdeb, 0xd9f57f830283fdfc}, {0xd267caa862a12d66, 0xd072df63c324fd7b},
+  {0x8380dea93da4bc60, 0x4247cb9e59f71e6d}, {0xa46116538d0deb78, 0x52d9be85f074e608},
+  {0xcd795be870516656, 0x67902e276c921f8b}, {0x806bd9714632dff6, 0x00ba1cd8a3db53b6},
+  {0xa086cfcd97bf97f3, 0x80e8a40eccd228a4}, {0xc8a883c0fdaf7df0, 0x6122cd128006b2cd},
+  {0xfad2a4b13d1b5d6c, 0x796b805720085f81}, {0x9cc3a6eec6311a63, 0xcbe3303674053bb0},
+  {0xc3f490aa77bd60fc, 0xbedbfc4411068a9c}, {0xf4f1b4d515acb93b, 0xee92fb5515482d44},
+  {0x991711052d8bf3c5, 0x751bdd152d4d1c4a}, {0xbf5cd54678eef0b6, 0xd262d45a78a0635d},
+  {0xef340a98172aace4, 0x86fb897116c87c34}, {0x9580869f0e7aac0e, 0xd45d35e6ae3d4da0},
+  {0xbae0a846d2195712, 0x8974836059cca109}, {0xe998d258869facd7, 0x2bd1a438703fc94b},
+  {0x91ff83775423cc06, 0x7b6306a34627ddcf}, {0xb67f6455292cbf08, 0x1a3bc84c17b1d542},
+  {0xe41f3d6a7377eeca, 0x20caba5f1d9e4a93}, {0x8e938662882af53e, 0x547eb47b7282ee9c},
+  {0xb23867fb2a35b28d, 0xe99e619a4f23aa43}, {0xdec681f9f4c31f31, 0x6405fa00e2ec94d4},
+  {0x8b3c113c38f9f37e, 0xde83bc408dd3dd04}, {0xae0b158b4738705e, 0x9624ab50b148d445},
+  {0xd98ddaee19068c76, 0x3badd624dd9b0957}, {0x87f8a8d4cfa417c9, 0xe54ca5d70a80e5d6},
+  {0xa9f6d30a038d1dbc, 0x5e9fcf4ccd211f4c}, {0xd47487cc8470652b, 0x7647c3200069671f},
+  {0x84c8d4dfd2c63f3b, 0x29ecd9f40041e073}, {0xa5fb0a17c777cf09, 0xf468107100525890},
+  {0xcf79cc9db955c2cc, 0x7182148d4066eeb4}, {0x81ac1fe293d599bf, 0xc6f14cd848405530},
+  {0xa21727db38cb002f, 0xb8ada00e5a506a7c}, {0xca9cf1d206fdc03b, 0xa6d90811f0e4851c},
+  {0xfd442e4688bd304a, 0x908f4a166d1da663}, {0x9e4a9cec15763e2e, 0x9a598e4e043287fe},
+  {0xc5dd44271ad3cdba, 0x40eff1e1853f29fd}, {0xf7549530e188c128, 0xd12bee59e68ef47c},
+  {0x9a94dd3e8cf578b9, 0x82bb74f8301958ce}, {0xc13a148e3032d6e7, 0xe36a52363c1faf01},
+  {0xf18899b1bc3f8ca1, 0xdc44e6c3cb279ac1}, {0x96f5600f15a7b7e5, 0x29ab103a5ef8c0b9},
+  {0xbcb2b812db11a5de, 0x7415d448f6b6f0e7}, {0xebdf661791d60f56, 0x111b495b3464ad21},
+  {0x936b9fcebb25c995, 0xcab10dd900beec34}, {0xb84687c269ef3bfb, 0x3d5d514f40eea742},
+  {0xe65829b3046b0afa, 0x0cb4a5a3112a5112}, {0x8ff71a0fe2c2e6dc, 0x47f0e785eaba72ab},
+  {0xb3f4e093db73a093, 0x59ed216765690f56}, {0xe0f218b8d25088b8, 0x306869c13ec3532c},
+  {0x8c974f7383725573, 0x1e414218c73a13fb}, {0xafbd2350644eeacf, 0xe5d1929ef90898fa},
+  {0xdbac6c247d62a583, 0xdf45f746b74abf39}, {0x894bc396ce5da772, 0x6b8bba8c328eb783},
+  {0xab9eb47c81f5114f, 0x066ea92f3f326564}, {0xd686619ba27255a2, 0xc80a537b0efefebd},
+  {0x8613fd0145877585, 0xbd06742ce95f5f36}, {0xa798fc4196e952e7, 0x2c48113823b73704},
+  {0xd17f3b51fca3a7a0, 0xf75a15862ca504c5}, {0x82ef85133de648c4, 0x9a984d73dbe722fb},
+  {0xa3ab66580d5fdaf5, 0xc13e60d0d2e0ebba}, {0xcc963fee10b7d1b3, 0x318df905079926a8},
+  {0xffbbcfe994e5c61f, 0xfdf17746497f7052}, {0x9fd561f1fd0f9bd3, 0xfeb6ea8bedefa633},
+  {0xc7caba6e7c5382c8, 0xfe64a52ee96b8fc0}, {0xf9bd690a1b68637b, 0x3dfdce7aa3c673b0},
+  {0x9c1661a651213e2d, 0x06bea10ca65c084e}, {0xc31bfa0fe5698db8, 0x486e494fcff30a62},
+  {0xf3e2f893dec3f126, 0x5a89dba3c3efccfa}, {0x986ddb5c6b3a76b7, 0xf89629465a75e01c},
+  {0xbe89523386091465, 0xf6bbb397f1135823}, {0xee2ba6c0678b597f, 0x746aa07ded582e2c},
+  {0x94db483840b717ef, 0xa8c2a44eb4571cdc}, {0xba121a4650e4ddeb, 0x92f34d62616ce413},
+  {0xe896a0d7e51e1566, 0x77b020baf9c81d17}, {0x915e2486ef32cd60, 0x0ace1474dc1d122e},
+  {0xb5b5ada8aaff80b8, 0x0d819992132456ba}, {0xe3231912d5bf60e6, 0x10e1fff697ed6c69},
+  {0x8df5efabc5979c8f, 0xca8d3ffa1ef463c1}, {0xb1736b96b6fd83b3, 0xbd308ff8a6b17cb2},
+  {0xddd0467c64bce4a0, 0xac7cb3f6d05ddbde}, {0x8aa22c0dbef60ee4, 0x6bcdf07a423aa96b},
+  {0xad4ab7112eb3929d, 0x86c16c98d2c953c6}, {0xd89d64d57a607744, 0xe871c7bf077ba8b7},
+  {0x87625f056c7c4a8b, 0x11471cd764ad4972}, {0xa93af6c6c79b5d2d, 0xd598e40d3dd89bcf},
+  {0xd389b47879823479, 0x4aff1d108d4ec2c3}, {0x843610cb4bf160cb, 0xcedf722a585139ba},
+  {0xa54394fe1eedb8fe, 0xc2974eb4ee658828}, {0xce947a3da6a9273e, 0x733d226229feea32},
+  {0x811ccc668829b887, 0x0806357d5a3f525f}, {0xa163ff802a3426a8, 0xca07c2dcb0cf26f7},
+  {0xc9bcff6034c13052, 0xfc89b393dd02f0b5}, {0xfc2c3f3841f17c67, 0xbbac2078d443ace2},
+  {0x9d9ba7832936edc0, 0xd54b944b84aa4c0d}, {0xc5029163f384a931, 0x0a9e795e65d4df11},
+  {0xf64335bcf065d37d, 0x4d4617b5ff4a16d5}, {0x99ea0196163fa42e, 0x504bced1bf8e4e45},
+  {0xc06481fb9bcf8d39, 0xe45ec2862f71e1d6}, {0xf07da27a82c37088, 0x5d767327bb4e5a4c},
+  {0x964e858c91ba2655, 0x3a6a07f8d510f86f}, {0xbbe226efb628afea, 0x890489f70a55368b},
+  {0xeadab0aba3b2dbe5, 0x2b45ac74ccea842e}, {0x92c8ae6b464fc96f, 0x3b0b8bc90012929d},
+  {0xb77ada0617e3bbcb, 0x09ce6ebb40173744}, {0xe55990879ddcaabd, 0xcc420a6a101d0515},
+  {0x8f57fa54c2a9eab6, 0x9fa946824a12232d}, {0xb32df8e9f3546564, 0x47939822dc96abf9},
+  {0xdff9772470297ebd, 0x59787e2b93bc56f7}, {0x8bfbea76c619ef36, 0x57eb4edb3c55b65a},
+  {0xaefae51477a06b03, 0xede622920b6b23f1}, {0xdab99e59958885c4, 0xe95fab368e45eced},
+  {0x88b402f7fd75539b, 0x11dbcb0218ebb414}, {0xaae103b5fcd2a881, 0xd652bdc29f26a119},
+  {0xd59944a37c0752a2, 0x4be76d3346f0495f}, {0x857fcae62d8493a5, 0x6f70a4400c562ddb},
+  {0xa6dfbd9fb8e5b88e, 0xcb4ccd500f6bb952}, {0xd097ad07a71f26b2, 0x7e2000a41346a7a7},
+  {0x825ecc24c873782f, 0x8ed400668c0c28c8}, {0xa2f67f2dfa90563b, 0x728900802f0f32fa},
+  {0xcbb41ef979346bca, 0x4f2b40a03ad2ffb9}, {0xfea126b7d78186bc, 0xe2f610c84987bfa8},
+  {0x9f24b832e6b0f436, 0x0dd9ca7d2df4d7c9}, {0xc6ede63fa05d3143, 0x91503d1c79720dbb},
+  {0xf8a95fcf88747d94, 0x75a44c6397ce912a}, {0x9b69dbe1b548ce7c, 0xc986afbe3ee11aba},
+  {0xc24452da229b021b, 0xfbe85badce996168}, {0xf2d56790ab41c2a2, 0xfae27299423fb9c3},
+  {0x97c560ba6b0919a5, 0xdccd879fc967d41a}, {0xbdb6b8e905cb600f, 0x5400e987bbc1c920},
+  {0xed246723473e3813, 0x290123e9aab23b68}, {0x9436c0760c86e30b, 0xf9a0b6720aaf6521},
+  {0xb94470938fa89bce, 0xf808e40e8d5b3e69}, {0xe7958cb87392c2c2, 0xb60b1d1230b20e04},
+  {0x90bd77f3483bb9b9, 0xb1c6f22b5e6f48c2}, {0xb4ecd5f01a4aa828, 0x1e38aeb6360b1af3},
+  {0xe2280b6c20dd5232, 0x25c6da63c38de1b0}, {0x8d590723948a535f, 0x579c487e5a38ad0e},
+  {0xb0af48ec79ace837, 0x2d835a9df0c6d851}, {0xdcdb1b2798182244, 0xf8e431456cf88e65},
+  {0x8a08f0f8bf0f156b, 0x1b8e9ecb641b58ff}, {0xac8b2d36eed2dac5, 0xe272467e3d222f3f},
+  {0xd7adf884aa879177, 0x5b0ed81dcc6abb0f}, {0x86ccbb52ea94baea, 0x98e947129fc2b4e9},
+  {0xa87fea27a539e9a5, 0x3f2398d747b36224}, {0xd29fe4b18e88640e, 0x8eec7f0d19a03aad},
+  {0x83a3eeeef9153e89, 0x1953cf68300424ac}, {0xa48ceaaab75a8e2b, 0x5fa8c3423c052dd7},
+  {0xcdb02555653131b6, 0x3792f412cb06794d}, {0x808e17555f3ebf11, 0xe2bbd88bbee40bd0},
+  {0xa0b19d2ab70e6ed6, 0x5b6aceaeae9d0ec4}, {0xc8de047564d20a8b, 0xf245825a5a445275},
+  {0xfb158592be068d2e, 0xeed6e2f0f0d56712}, {0x9ced737bb6c4183d, 0x55464dd69685606b},
+  {0xc428d05aa4751e4c, 0xaa97e14c3c26b886}, {0xf53304714d9265df, 0xd53dd99f4b3066a8},
+  {0x993fe2c6d07b7fab, 0xe546a8038efe4029}, {0xbf8fdb78849a5f96, 0xde98520472bdd033},
+  {0xef73d256a5c0f77c, 0x963e66858f6d4440}, {0x95a8637627989aad, 0xdde7001379a44aa8},
+  {0xbb127c53b17ec159, 0x5560c018580d5d52}, {0xe9d71b689dde71af, 0xaab8f01e6e10b4a6},
+  {0x9226712162ab070d, 0xcab3961304ca70e8}, {0xb6b00d69bb55c8d1, 0x3d607b97c5fd0d22},
+  {0xe45c10c42a2b3b05, 0x8cb89a7db77c506a}, {0x8eb98a7a9a5b04e3, 0x77f3608e92adb242},
+  {0xb267ed1940f1c61c, 0x55f038b237591ed3}, {0xdf01e85f912e37a3, 0x6b6c46dec52f6688},
+  {0x8b61313bbabce2c6, 0x2323ac4b3b3da015}, {0xae397d8aa96c1b77, 0xabec975e0a0d081a},
+  {0xd9c7dced53c72255, 0x96e7bd358c904a21}, {0x881cea14545c7575, 0x7e50d64177da2e54},
+  {0xaa242499697392d2, 0xdde50bd1d5d0b9e9}, {0xd4ad2dbfc3d07787, 0x955e4ec64b44e864},
+  {0x84ec3c97da624ab4, 0xbd5af13bef0b113e}, {0xa6274bbdd0fadd61, 0xecb1ad8aeacdd58e},
+  {0xcfb11ead453994ba, 0x67de18eda5814af2}, {0x81ceb32c4b43fcf4, 0x80eacf948770ced7},
+  {0xa2425ff75e14fc31, 0xa1258379a94d028d}, {0xcad2f7f5359a3b3e, 0x096ee45813a04330},
+  {0xfd87b5f28300ca0d, 0x8bca9d6e188853fc}, {0x9e74d1b791e07e48, 0x775ea264cf55347e},
+  {0xc612062576589dda, 0x95364afe032a819e}, {0xf79687aed3eec551, 0x3a83ddbd83f52205},
+  {0x9abe14cd44753b52, 0xc4926a9672793543}, {0xc16d9a0095928a27, 0x75b7053c0f178294},
+  {0xf1c90080baf72cb1, 0x5324c68b12dd6339}, {0x971da05074da7bee, 0xd3f6fc16ebca5e04},
+  {0xbce5086492111aea, 0x88f4bb1ca6bcf585}, {0xec1e4a7db69561a5, 0x2b31e9e3d06c32e6},
+  {0x9392ee8e921d5d07, 0x3aff322e62439fd0}, {0xb877aa3236a4b449, 0x09befeb9fad487c3},
+  {0xe69594bec44de15b, 0x4c2ebe687989a9b4}, {0x901d7cf73ab0acd9, 0x0f9d37014bf60a11},
+  {0xb424dc35095cd80f, 0x538484c19ef38c95}, {0xe12e13424bb40e13, 0x2865a5f206b06fba},
+  {0x8cbccc096f5088cb, 0xf93f87b7442e45d4}, {0xafebff0bcb24aafe, 0xf78f69a51539d749},
+  {0xdbe6fecebdedd5be, 0xb573440e5a884d1c}, {0x89705f4136b4a597, 0x31680a88f8953031},
+  {0xabcc77118461cefc, 0xfdc20d2b36ba7c3e}, {0xd6bf94d5e57a42bc, 0x3d32907604691b4d},
+  {0x8637bd05af6c69b5, 0xa63f9a49c2c1b110}, {0xa7c5ac471b478423, 0x0fcf80dc33721d54},
+  {0xd1b71758e219652b, 0xd3c36113404ea4a9}, {0x83126e978d4fdf3b, 0x645a1cac083126ea},
+  {0xa3d70a3d70a3d70a, 0x3d70a3d70a3d70a4}, {0xcccccccccccccccc, 0xcccccccccccccccd},
+  {0x8000000000000000, 0x0000000000000000}, {0xa000000000000000, 0x0000000000000000},
+  {0xc800000000000000, 0x0000000000000000}, {0xfa00000000000000, 0x0000000000000000},
+  {0x9c40000000000000, 0x0000000000000000}, {0xc350000000000000, 0x0000000000000000},
+  {0xf424000000000000, 0x0000000000000000}, {0x9896800000000000, 0x0000000000000000},
+  {0xbebc200000000000, 0x0000000000000000}, {0xee6b280000000000, 0x0000000000000000},
+  {0x9502f90000000000, 0x0000000000000000}, {0xba43b74000000000, 0x0000000000000000},
+  {0xe8d4a51000000000, 0x0000000000000000}, {0x9184e72a00000000, 0x0000000000000000},
+  {0xb5e620f480000000, 0x0000000000000000}, {0xe35fa931a0000000, 0x0000000000000000},
+  {0x8e1bc9bf04000000, 0x0000000000000000}, {0xb1a2bc2ec5000000, 0x0000000000000000},
+  {0xde0b6b3a76400000, 0x0000000000000000}, {0x8ac7230489e80000, 0x0000000000000000},
+  {0xad78ebc5ac620000, 0x0000000000000000}, {0xd8d726b7177a8000, 0x0000000000000000},
+  {0x878678326eac9000, 0x0000000000000000}, {0xa968163f0a57b400, 0x0000000000000000},
+  {0xd3c21bcecceda100, 0x0000000000000000}, {0x84595161401484a0, 0x0000000000000000},
+  {0xa56fa5b99019a5c8, 0x0000000000000000}, {0xcecb8f27f4200f3a, 0x0000000000000000},
+  {0x813f3978f8940984, 0x4000000000000000}, {0xa18f07d736b90be5, 0x5000000000000000},
+  {0xc9f2c9cd04674ede, 0xa400000000000000}, {0xfc6f7c4045812296, 0x4d00000000000000},
+  {0x9dc5ada82b70b59d, 0xf020000000000000}, {0xc5371912364ce305, 0x6c28000000000000},
+  {0xf684df56c3e01bc6, 0xc732000000000000}, {0x9a130b963a6c115c, 0x3c7f400000000000},
+  {0xc097ce7bc90715b3, 0x4b9f100000000000}, {0xf0bdc21abb48db20, 0x1e86d40000000000},
+  {0x96769950b50d88f4, 0x1314448000000000}, {0xbc143fa4e250eb31, 0x17d955a000000000},
+  {0xeb194f8e1ae525fd, 0x5dcfab0800000000}, {0x92efd1b8d0cf37be, 0x5aa1cae500000000},
+  {0xb7abc627050305ad, 0xf14a3d9e40000000}, {0xe596b7b0c643c719, 0x6d9ccd05d0000000},
+  {0x8f7e32ce7bea5c6f, 0xe4820023a2000000}, {0xb35dbf821ae4f38b, 0xdda2802c8a800000},
+  {0xe0352f62a19e306e, 0xd50b2037ad200000}, {0x8c213d9da502de45, 0x4526f422cc340000},
+  {0xaf298d050e4395d6, 0x9670b12b7f410000}, {0xdaf3f04651d47b4c, 0x3c0cdd765f114000},
+  {0x88d8762bf324cd0f, 0xa5880a69fb6ac800}, {0xab0e93b6efee0053, 0x8eea0d047a457a00},
+  {0xd5d238a4abe98068, 0x72a4904598d6d880}, {0x85a36366eb71f041, 0x47a6da2b7f864750},
+  {0xa70c3c40a64e6c51, 0x999090b65f67d924}, {0xd0cf4b50cfe20765, 0xfff4b4e3f741cf6d},
+  {0x82818f1281ed449f, 0xbff8f10e7a8921a4}, {0xa321f2d7226895c7, 0xaff72d52192b6a0d},
+  {0xcbea6f8ceb02bb39, 0x9bf4f8a69f764490}, {0xfee50b7025c36a08, 0x02f236d04753d5b4},
+  {0x9f4f2726179a2245, 0x01d762422c946590}, {0xc722f0ef9d80aad6, 0x424d3ad2b7b97ef5},
+  {0xf8ebad2b84e0d58b, 0xd2e0898765a7deb2}, {0x9b934c3b330c8577, 0x63cc55f49f88eb2f},
+  {0xc2781f49ffcfa6d5, 0x3cbf6b71c76b25fb}, {0xf316271c7fc3908a, 0x8bef464e3945ef7a},
+  {0x97edd871cfda3a56, 0x97758bf0e3cbb5ac}, {0xbde94e8e43d0c8ec, 0x3d52eeed1cbea317},
+  {0xed63a231d4c4fb27, 0x4ca7aaa863ee4bdd}, {0x945e455f24fb1cf8, 0x8fe8caa93e74ef6a},
+  {0xb975d6b6ee39e436, 0xb3e2fd538e122b44}, {0xe7d34c64a9c85d44, 0x60dbbca87196b616},
+  {0x90e40fbeea1d3a4a, 0xbc8955e946fe31cd}, {0xb51d13aea4a488dd, 0x6babab6398bdbe41},
+  {0xe264589a4dcdab14, 0xc696963c7eed2dd1}, {0x8d7eb76070a08aec, 0xfc1e1de5cf543ca2},
+  {0xb0de65388cc8ada8, 0x3b25a55f43294bcb}, {0xdd15fe86affad912, 0x49ef0eb713f39ebe},
+  {0x8a2dbf142dfcc7ab, 0x6e3569326c784337}, {0xacb92ed9397bf996, 0x49c2c37f07965404},
+  {0xd7e77a8f87daf7fb, 0xdc33745ec97be906}, {0x86f0ac99b4e8dafd, 0x69a028bb3ded71a3},
+  {0xa8acd7c0222311bc, 0xc40832ea0d68ce0c}, {0xd2d80db02aabd62b, 0xf50a3fa490c30190},
+  {0x83c7088e1aab65db, 0x792667c6da79e0fa}, {0xa4b8cab1a1563f52, 0x577001b891185938},
+  {0xcde6fd5e09abcf26, 0xed4c0226b55e6f86}, {0x80b05e5ac60b6178, 0x544f8158315b05b4},
+  {0xa0dc75f1778e39d6, 0x696361ae3db1c721}, {0xc913936dd571c84c, 0x03bc3a19cd1e38e9},
+  {0xfb5878494ace3a5f, 0x04ab48a04065c723}, {0x9d174b2dcec0e47b, 0x62eb0d64283f9c76},
+  {0xc45d1df942711d9a, 0x3ba5d0bd324f8394}, {0xf5746577930d6500, 0xca8f44ec7ee36479},
+  {0x9968bf6abbe85f20, 0x7e998b13cf4e1ecb}, {0xbfc2ef456ae276e8, 0x9e3fedd8c321a67e},
+  {0xefb3ab16c59b14a2, 0xc5cfe94ef3ea101e}, {0x95d04aee3b80ece5, 0xbba1f1d158724a12},
+  {0xbb445da9ca61281f, 0x2a8a6e45ae8edc97}, {0xea1575143cf97226, 0xf52d09d71a3293bd},
+  {0x924d692ca61be758, 0x593c2626705f9c56}, {0xb6e0c377cfa2e12e, 0x6f8b2fb00c77836c},
+  {0xe498f455c38b997a, 0x0b6dfb9c0f956447}, {0x8edf98b59a373fec, 0x4724bd4189bd5eac},
+  {0xb2977ee300c50fe7, 0x58edec91ec2cb657}, {0xdf3d5e9bc0f653e1, 0x2f2967b66737e3ed},
+  {0x8b865b215899f46c, 0xbd79e0d20082ee74}, {0xae67f1e9aec07187, 0xecd8590680a3aa11},
+  {0xda01ee641a708de9, 0xe80e6f4820cc9495}, {0x884134fe908658b2, 0x3109058d147fdcdd},
+  {0xaa51823e34a7eede, 0xbd4b46f0599fd415}, {0xd4e5e2cdc1d1ea96, 0x6c9e18ac7007c91a},
+  {0x850fadc09923329e, 0x03e2cf6bc604ddb0}, {0xa6539930bf6bff45, 0x84db8346b786151c},
+  {0xcfe87f7cef46ff16, 0xe612641865679a63}, {0x81f14fae158c5f6e, 0x4fcb7e8f3f60c07e},
+  {0xa26da3999aef7749, 0xe3be5e330f38f09d}, {0xcb090c8001ab551c, 0x5cadf5bfd3072cc5},
+  {0xfdcb4fa002162a63, 0x73d9732fc7c8f7f6}, {0x9e9f11c4014dda7e, 0x2867e7fddcdd9afa},
+  {0xc646d63501a1511d, 0xb281e1fd541501b8}, {0xf7d88bc24209a565, 0x1f225a7ca91a4226},
+  {0x9ae757596946075f, 0x3375788de9b06958}, {0xc1a12d2fc3978937, 0x0052d6b1641c83ae},
+  {0xf209787bb47d6b84, 0xc0678c5dbd23a49a}, {0x9745eb4d50ce6332, 0xf840b7ba963646e0},
+  {0xbd176620a501fbff, 0xb650e5a93bc3d898}, {0xec5d3fa8ce427aff, 0xa3e51f138ab4cebe},
+  {0x93ba47c980e98cdf, 0xc66f336c36b10137}, {0xb8a8d9bbe123f017, 0xb80b0047445d4184},
+  {0xe6d3102ad96cec1d, 0xa60dc059157491e5}, {0x9043ea1ac7e41392, 0x87c89837ad68db2f},
+  {0xb454e4a179dd1877, 0x29babe4598c311fb}, {0xe16a1dc9d8545e94, 0xf4296dd6fef3d67a},
+  {0x8ce2529e2734bb1d, 0x1899e4a65f58660c}, {0xb01ae745b101e9e4, 0x5ec05dcff72e7f8f},
+  {0xdc21a1171d42645d, 0x76707543f4fa1f73}, {0x899504ae72497eba, 0x6a06494a791c53a8},
+  {0xabfa45da0edbde69, 0x0487db9d17636892}, {0xd6f8d7509292d603, 0x45a9d2845d3c42b6},
+  {0x865b86925b9bc5c2, 0x0b8a2392ba45a9b2}, {0xa7f26836f282b732, 0x8e6cac7768d7141e},
+  {0xd1ef0244af2364ff, 0x3207d795430cd926}, {0x8335616aed761f1f, 0x7f44e6bd49e807b8},
+  {0xa402b9c5a8d3a6e7, 0x5f16206c9c6209a6}, {0xcd036837130890a1, 0x36dba887c37a8c0f},
+  {0x802221226be55a64, 0xc2494954da2c9789}, {0xa02aa96b06deb0fd, 0xf2db9baa10b7bd6c},
+  {0xc83553c5c8965d3d, 0x6f92829494e5acc7}, {0xfa42a8b73abbf48c, 0xcb772339ba1f17f9},
+  {0x9c69a97284b578d7, 0xff2a760414536efb}, {0xc38413cf25e2d70d, 0xfef5138519684aba},
+  {0xf46518c2ef5b8cd1, 0x7eb258665fc25d69}, {0x98bf2f79d5993802, 0xef2f773ffbd97a61},
+  {0xbeeefb584aff8603, 0xaafb550ffacfd8fa}, {0xeeaaba2e5dbf6784, 0x95ba2a53f983cf38},
+  {0x952ab45cfa97a0b2, 0xdd945a747bf26183}, {0xba756174393d88df, 0x94f971119aeef9e4},
+  {0xe912b9d1478ceb17, 0x7a37cd5601aab85d}, {0x91abb422ccb812ee, 0xac62e055c10ab33a},
+  {0xb616a12b7fe617aa, 0x577b986b314d6009}, {0xe39c49765fdf9d94, 0xed5a7e85fda0b80b},
+  {0x8e41ade9fbebc27d, 0x14588f13be847307}, {0xb1d219647ae6b31c, 0x596eb2d8ae258fc8},
+  {0xde469fbd99a05fe3, 0x6fca5f8ed9aef3bb}, {0x8aec23d680043bee, 0x25de7bb9480d5854},
+  {0xada72ccc20054ae9, 0xaf561aa79a10ae6a}, {0xd910f7ff28069da4, 0x1b2ba1518094da04},
+  {0x87aa9aff79042286, 0x90fb44d2f05d0842}, {0xa99541bf57452b28, 0x353a1607ac744a53},
+  {0xd3fa922f2d1675f2, 0x42889b8997915ce8}, {0x847c9b5d7c2e09b7, 0x69956135febada11},
+  {0xa59bc234db398c25, 0x43fab9837e699095}, {0xcf02b2c21207ef2e, 0x94f967e45e03f4bb},
+  {0x8161afb94b44f57d, 0x1d1be0eebac278f5}, {0xa1ba1ba79e1632dc, 0x6462d92a69731732},
+  {0xca28a291859bbf93, 0x7d7b8f7503cfdcfe}, {0xfcb2cb35e702af78, 0x5cda735244c3d43e},
+  {0x9defbf01b061adab, 0x3a0888136afa64a7}, {0xc56baec21c7a1916, 0x088aaa1845b8fdd0},
+  {0xf6c69a72a3989f5b, 0x8aad549e57273d45}, {0x9a3c2087a63f6399, 0x36ac54e2f678864b},
+  {0xc0cb28a98fcf3c7f, 0x84576a1bb416a7dd}, {0xf0fdf2d3f3c30b9f, 0x656d44a2a11c51d5},
+  {0x969eb7c47859e743, 0x9f644ae5a4b1b325}, {0xbc4665b596706114, 0x873d5d9f0dde1fee},
+  {0xeb57ff22fc0c7959, 0xa90cb506d155a7ea}, {0x9316ff75dd87cbd8, 0x09a7f12442d588f2},
+  {0xb7dcbf5354e9bece, 0x0c11ed6d538aeb2f}, {0xe5d3ef282a242e81, 0x8f1668c8a86da5fa},
+  {0x8fa475791a569d10, 0xf96e017d694487bc}, {0xb38d92d760ec4455, 0x37c981dcc395a9ac},
+  {0xe070f78d3927556a, 0x85bbe253f47b1417}, {0x8c469ab843b89562, 0x93956d7478ccec8e},
+  {0xaf58416654a6babb, 0x387ac8d1970027b2}, {0xdb2e51bfe9d0696a, 0x06997b05fcc0319e},
+  {0x88fcf317f22241e2, 0x441fece3bdf81f03}, {0xab3c2fddeeaad25a, 0xd527e81cad7626c3},
+  {0xd60b3bd56a5586f1, 0x8a71e223d8d3b074}, {0x85c7056562757456, 0xf6872d5667844e49},
+  {0xa738c6bebb12d16c, 0xb428f8ac016561db}, {0xd106f86e69d785c7, 0xe13336d701beba52},
+  {0x82a45b450226b39c, 0xecc0024661173473}, {0xa34d721642b06084, 0x27f002d7f95d0190},
+  {0xcc20ce9bd35c78a5, 0x31ec038df7b441f4}, {0xff290242c83396ce, 0x7e67047175a15271},
+  {0x9f79a169bd203e41, 0x0f0062c6e984d386}, {0xc75809c42c684dd1, 0x52c07b78a3e60868},
+  {0xf92e0c3537826145, 0xa7709a56ccdf8a82}, {0x9bbcc7a142b17ccb, 0x88a66076400bb691},
+  {0xc2abf989935ddbfe, 0x6acff893d00ea435}, {0xf356f7ebf83552fe, 0x0583f6b8c4124d43},
+  {0x98165af37b2153de, 0xc3727a337a8b704a}, {0xbe1bf1b059e9a8d6, 0x744f18c0592e4c5c},
+  {0xeda2ee1c7064130c, 0x1162def06f79df73}, {0x9485d4d1c63e8be7, 0x8addcb5645ac2ba8},
+  {0xb9a74a0637ce2ee1, 0x6d953e2bd7173692}, {0xe8111c87c5c1ba99, 0xc8fa8db6ccdd0437},
+  {0x910ab1d4db9914a0, 0x1d9c9892400a22a2}, {0xb54d5e4a127f59c8, 0x2503beb6d00cab4b},
+  {0xe2a0b5dc971f303a, 0x2e44ae64840fd61d}, {0x8da471a9de737e24, 0x5ceaecfed289e5d2},
+  {0xb10d8e1456105dad, 0x7425a83e872c5f47}, {0xdd50f1996b947518, 0xd12f124e28f77719},
+  {0x8a5296ffe33cc92f, 0x82bd6b70d99aaa6f}, {0xace73cbfdc0bfb7b, 0x636cc64d1001550b},
+  {0xd8210befd30efa5a, 0x3c47f7e05401aa4e}, {0x8714a775e3e95c78, 0x65acfaec34810a71},
+  {0xa8d9d1535ce3b396, 0x7f1839a741a14d0d}, {0xd31045a8341ca07c, 0x1ede48111209a050},
+  {0x83ea2b892091e44d, 0x934aed0aab460432}, {0xa4e4b66b68b65d60, 0xf81da84d5617853f},
+  {0xce1de40642e3f4b9, 0x36251260ab9d668e}, {0x80d2ae83e9ce78f3, 0xc1d72b7c6b426019},
+  {0xa1075a24e4421730, 0xb24cf65b8612f81f}, {0xc94930ae1d529cfc, 0xdee033f26797b627},
+  {0xfb9b7cd9a4a7443c, 0x169840ef017da3b1}, {0x9d412e0806e88aa5, 0x8e1f289560ee864e},
+  {0xc491798a08a2ad4e, 0xf1a6f2bab92a27e2}, {0xf5b5d7ec8acb58a2, 0xae10af696774b1db},
+  {0x9991a6f3d6bf1765, 0xacca6da1e0a8ef29}, {0xbff610b0cc6edd3f, 0x17fd090a58d32af3},
+  {0xeff394dcff8a948e, 0xddfc4b4cef07f5b0}, {0x95f83d0a1fb69cd9, 0x4abdaf101564f98e},
+  {0xbb764c4ca7a4440f, 0x9d6d1ad41abe37f1}, {0xea53df5fd18d5513, 0x84c86189216dc5ed},
+  {0x92746b9be2f8552c, 0x32fd3cf5b4e49bb4}, {0xb7118682dbb66a77, 0x3fbc8c33221dc2a1},
+  {0xe4d5e82392a40515, 0x0fabaf3feaa5334a}, {0x8f05b1163ba6832d, 0x29cb4d87f2a7400e},
+  {0xb2c71d5bca9023f8, 0x743e20e9ef511012}, {0xdf78e4b2bd342cf6, 0x914da9246b255416},
+  {0x8bab8eefb6409c1a, 0x1ad089b6c2f7548e}, {0xae9672aba3d0c320, 0xa184ac2473b529b1},
+  {0xda3c0f568cc4f3e8, 0xc9e5d72d90a2741e}, {0x8865899617fb1871, 0x7e2fa67c7a658892},
+  {0xaa7eebfb9df9de8d, 0xddbb901b98feeab7}, {0xd51ea6fa85785631, 0x552a74227f3ea565},
+  {0x8533285c936b35de, 0xd53a88958f87275f}, {0xa67ff273b8460356, 0x8a892abaf368f137},
+  {0xd01fef10a657842c, 0x2d2b7569b0432d85}, {0x8213f56a67f6b29b, 0x9c3b29620e29fc73},
+  {0xa298f2c501f45f42, 0x8349f3ba91b47b8f}, {0xcb3f2f7642717713, 0x241c70a936219a73},
+  {0xfe0efb53d30dd4d7, 0xed238cd383aa0110}, {0x9ec95d1463e8a506, 0xf4363804324a40aa},
+  {0xc67bb4597ce2ce48, 0xb143c6053edcd0d5}, {0xf81aa16fdc1b81da, 0xdd94b7868e94050a},
+  {0x9b10a4e5e9913128, 0xca7cf2b4191c8326}, {0xc1d4ce1f63f57d72, 0xfd1c2f611f63a3f0},
+  {0xf24a01a73cf2dccf, 0xbc633b39673c8cec}, {0x976e41088617ca01, 0xd5be0503e085d813},
+  {0xbd49d14aa79dbc82, 0x4b2d8644d8a74e18}, {0xec9c459d51852ba2, 0xddf8e7d60ed1219e},
+  {0x93e1ab8252f33b45, 0xcabb90e5c942b503}, {0xb8da1662e7b00a17, 0x3d6a751f3b936243},
+  {0xe7109bfba19c0c9d, 0x0cc512670a783ad4}, {0x906a617d450187e2, 0x27fb2b80668b24c5},
+  {0xb484f9dc9641e9da, 0xb1f9f660802dedf6}, {0xe1a63853bbd26451, 0x5e7873f8a0396973},
+  {0x8d07e33455637eb2, 0xdb0b487b6423e1e8}, {0xb049dc016abc5e5f, 0x91ce1a9a3d2cda62},
+  {0xdc5c5301c56b75f7, 0x7641a140cc7810fb}, {0x89b9b3e11b6329ba, 0xa9e904c87fcb0a9d},
+  {0xac2820d9623bf429, 0x546345fa9fbdcd44}, {0xd732290fbacaf133, 0xa97c177947ad4095},
+  {0x867f59a9d4bed6c0, 0x49ed8eabcccc485d}, {0xa81f301449ee8c70, 0x5c68f256bfff5a74},
+  {0xd226fc195c6a2f8c, 0x73832eec6fff3111}, {0x83585d8fd9c25db7, 0xc831fd53c5ff7eab},
+  {0xa42e74f3d032f525, 0xba3e7ca8b77f5e55}, {0xcd3a1230c43fb26f, 0x28ce1bd2e55f35eb},
+  {0x80444b5e7aa7cf85, 0x7980d163cf5b81b3}, {0xa0555e361951c366, 0xd7e105bcc332621f},
+  {0xc86ab5c39fa63440, 0x8dd9472bf3fefaa7}, {0xfa856334878fc150, 0xb14f98f6f0feb951},
+  {0x9c935e00d4b9d8d2, 0x6ed1bf9a569f33d3}, {0xc3b8358109e84f07, 0x0a862f80ec4700c8},
+  {0xf4a642e14c6262c8, 0xcd27bb612758c0fa}, {0x98e7e9cccfbd7dbd, 0x8038d51cb897789c},
+  {0xbf21e44003acdd2c, 0xe0470a63e6bd56c3}, {0xeeea5d5004981478, 0x1858ccfce06cac74},
+  {0x95527a5202df0ccb, 0x0f37801e0c43ebc8}, {0xbaa718e68396cffd, 0xd30560258f54e6ba},
+  {0xe950df20247c83fd, 0x47c6b82ef32a2069}, {0x91d28b7416cdd27e, 0x4cdc331d57fa5441},
+  {0xb6472e511c81471d, 0xe0133fe4adf8e952}, {0xe3d8f9e563a198e5, 0x58180fddd97723a6},
+  {0x8e679c2f5e44ff8f, 0x570f09eaa7ea7648}
+};
+
+int lex_clz64(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_clzll(x);
+#else
+  int n = 0;
+  while ((x & ((uint64_t)1 << 63)) == 0) {
+    x <<= 1;
+    n++;
   }
-  *value = output;
-  return true;
+  return n;
+#endif
 }
 
-bool lex_read_number(lexer* l) {
+/* the high 64 bits of a * b, the low ones go to 'lo' */
+uint64_t lex_mul128(uint64_t a, uint64_t b, uint64_t* lo) {
+#ifdef __SIZEOF_INT128__
+  __extension__ unsigned __int128 r = (unsigned __int128)a * b;
+  *lo = (uint64_t)r;
+  return (uint64_t)(r >> 64);
+#else
+  uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+  uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+  uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi, hl = a_hi * b_lo, hh = a_hi * b_hi;
+  uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+  *lo = (mid << 32) | (uint32_t)ll;
+  return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+/* mantissa * 10^q correctly rounded, after Eisel and Lemire,
+ * "Number Parsing at a Gigabyte per Second". returns false in the
+ * rare cases where 128 bits of 5^q aren't enough to decide, and for
+ * results that are subnormal or too large.
+ */
+bool lex_eisel_lemire(uint64_t mantissa, int64_t q, double* value) {
+  const uint64_t* pow5;
+  uint64_t hi, lo, y_hi, y_lo, bits;
+  int64_t exp2;
+  int clz, msb;
+
+  if (q < LEX_MIN_POW5 || q > LEX_MAX_POW5) {
+    return false;
+  }
+  pow5 = lex_pow5[q - LEX_MIN_POW5];
+  clz = lex_clz64(mantissa);
+  mantissa <<= clz;
+  /* floor(q * log2(10)), the division rounds towards zero */
+  exp2 = (q * 217706 - (q < 0 ? 65535 : 0)) / 65536 + 64 + 1023 - clz;
+
+  hi = lex_mul128(mantissa, pow5[0], &lo);
+  if ((hi & 0x1ff) == 0x1ff && lo + mantissa < mantissa) {
+    y_hi = lex_mul128(mantissa, pow5[1], &y_lo);
+    lo += y_hi;
+    hi += lo < y_hi;
+    if ((hi & 0x1ff) == 0x1ff && lo + 1 == 0 && y_lo + mantissa < mantissa) {
+      return false;
+    }
+  }
+
+  msb = (int)(hi >> 63);
+  bits = hi >> (msb + 9);
+  exp2 -= 1 ^ msb;
+  /* halfway between two doubles, can't tell which way to go */
+  if (lo == 0 && (hi & 0x1ff) == 0 && (bits & 3) == 1) {
+    return false;
+  }
+  bits += bits & 1;
+  bits >>= 1;
+  if ((bits >> 53) != 0) {
+    bits >>= 1;
+    exp2++;
+  }
+  if (exp2 <= 0 || exp2 >= 0x7ff) {
+    return false;
+  }
+  bits = (uint64_t)exp2 << 52 | (bits & (((uint64_t)1 << 52) - 1));
+  memcpy(value, &bits, sizeof(bits));
+  return true;
+}
+
+/* the slow path, strtod on the significant digits of the lexeme.
+ * 768 of them are enough to round any decimal correctly, from the
+ * rest it only matters whether any is not zero.
+ */
+double lex_conv_slow(const lexer* l) {
+  char buff[800];
+  const char* p = l->input + l->lexeme.begin;
+  const char* end = l->input + l->lexeme.end;
+  size_t n = 0;
+  long exponent = 0;
+  bool fraction = false, sticky = false;
+
+  for (; p < end; p++) {
+    if (*p == '_') {
+      continue;
+    }
+    if (*p == '.') {
+      fraction = true;
+    } else if (n == 0 && *p == '0') {
+      exponent -= fraction;
+    } else if (n < 768) {
+      buff[n++] = *p;
+      exponent -= fraction;
+    } else {
+      sticky |= *p != '0';
+      exponent += !fraction;
+    }
+  }
+  if (sticky) {
+    buff[n++] = '1';
+    exponent--;
+  }
+  if (n == 0) {
+    return 0;
+  }
+  sprintf(buff + n, "e%ld", exponent);
+  return strtod(buff, NULL);
+}
+
+/* the double nearest to 'd' */
+bool lex_conv_inexact(lexer* l, const lex_decimal* d, double* value) {
+  double up;
+  if (d->mantissa == 0) {
+    *value = 0;
+    return true;
+  }
+  if (d->truncated == false && d->mantissa <= ((uint64_t)1 << 53) &&
+      d->exponent >= -22 && d->exponent <= 22) {
+    /* both are exact, so the one rounding is the right one */
+    if (d->exponent < 0) {
+      *value = (double)d->mantissa / lex_pow10[-d->exponent];
+    } else {
+      *value = (double)d->mantissa * lex_pow10[d->exponent];
+    }
+  } else if (lex_eisel_lemire(d->mantissa, d->exponent, value) == false ||
+             (d->truncated && (lex_eisel_lemire(d->mantissa + 1, d->exponent, &up) == false ||
+                               up != *value))) {
+    *value = lex_conv_slow(l);
+  }
+  if (*value > DBL_MAX) {
+    l->err = lex_err_overflow(l);
+    return false;
+  }
+  return true;
+}
+
+bool lex_read_number(lexer* l) {
   rune r = lex_peek_rune(l);
-  bool ok;
+  lex_decimal d = {0, 0, 0, false};
   uint64_t exact_value;
   double inexact_value;
   if (r < 0) {
@@ -1070,64 +2735,36 @@ bool lex_read_number(lexer* l) {
   if (r == '0') {
     lex_next_rune(l);
     r = lex_peek_rune(l);
-    switch (r) {
-      case 'x':
-        lex_next_rune(l);
-        ok = lex_accept_run(l, lex_is_hexdigit);
-        if (ok == false) {
-          return false;
-        }
-        ok = lex_conv_hex(l, &exact_value);
-        if (ok == false) {
-          return false;
-        }
-        l->lexeme.value.exact_num = exact_value;
-        l->lexeme.vkind = vk_exact_num;
-        l->lexeme.kind = lk_num;
-        return true;
-      case 'b':
-        lex_next_rune(l);
-        ok = lex_accept_run(l, lex_is_bindigit);
-        if (ok == false) {
-          return false;
-        }
-        ok = lex_conv_bin(l, &exact_value);
-        if (ok == false) {
-          return false;
-        }
-        l->lexeme.value.exact_num = exact_value;
-        l->lexeme.vkind = vk_exact_num;
-        l->lexeme.kind = lk_num;
-        return true;
+    if (r == 'x' || r == 'b') {
+      lex_next_rune(l);
+      if (lex_read_pow2(l, r == 'x' ? 4 : 1, r == 'x' ? LC_HEX : LC_BIN, &exact_value) == false) {
+        return false;
+      }
+      l->lexeme.value.exact_num = exact_value;
+      l->lexeme.vkind = vk_exact_num;
+      l->lexeme.kind = lk_num;
+      return true;
     }
   }
-  ok = lex_accept_run(l, lex_is_decdigit);
-  if (ok == false) {
-    return false;
-  }
-  r = lex_peek_rune(l);
-  if (r == '.') {
+  lex_read_digits(l, &d, false);
+  if (lex_peek_rune(l) == '.') {
     lex_next_rune(l);
-    ok = lex_accept_run(l, lex_is_decdigit);
-    if (ok == false) {
-      return false;
-    }
-    ok = lex_conv_inexact(l, &inexact_value);
-    if (ok == false) {
+    lex_read_digits(l, &d, true);
+    if (lex_conv_inexact(l, &d, &inexact_value) == false) {
       return false;
     }
     l->lexeme.value.inexact_num = inexact_value;
     l->lexeme.vkind = vk_inexact_num;
     l->lexeme.kind = lk_num;
-  } else {
-    ok = lex_conv_dec(l, &exact_value);
-    if (ok == false) {
-      return false;
-    }
-    l->lexeme.value.exact_num = exact_value;
-    l->lexeme.vkind = vk_exact_num;
-    l->lexeme.kind = lk_num;
+    return true;
   }
+  if (d.exponent != 0 || d.mantissa > INT64_MAX) {
+    l->err = lex_err_overflow(l);
+    return false;
+  }
+  l->lexeme.value.exact_num = d.mantissa;
+  l->lexeme.vkind = vk_exact_num;
+  l->lexeme.kind = lk_num;
   return true;
 }
 
@@ -1138,7 +2775,7 @@ bool lex_read_number(lexer* l) {
 bool lex_is_nil(const lexer* l) {
   char* buffer;
   if (l->lexeme.end - l->lexeme.begin != 3) {
-    false;
+    return false;
   }
   buffer = (char*)l->input + l->lexeme.begin;
   return buffer[0] == 'n' &&
@@ -1149,7 +2786,7 @@ bool lex_is_nil(const lexer* l) {
 bool lex_is_true(const lexer* l) {
   char* buffer;
   if (l->lexeme.end - l->lexeme.begin != 4) {
-    false;
+    return false;
   }
   buffer = (char*)l->input + l->lexeme.begin;
   return buffer[0] == 't' &&
@@ -1161,7 +2798,7 @@ bool lex_is_true(const lexer* l) {
 bool lex_is_false(const lexer* l) {
   char* buffer;
   if (l->lexeme.end - l->lexeme.begin != 5) {
-    false;
+    return false;
   }
   buffer = (char*)l->input + l->lexeme.begin;
   return buffer[0] == 'f' &&
@@ -1197,10 +2834,7 @@ bool lex_read_identifier(lexer* l) {
     return false;
   }
   l->lexeme.kind = lk_id;
-  ok = lex_accept_run(l, lex_is_idcharnum);
-  if (ok == false) {
-    return false;
-  }
+  lex_accept_run(l, LC_IDNUM);
   if (lex_is_nil(l)) {
     l->lexeme.kind = lk_nil;
   }
@@ -1224,12 +2858,8 @@ bool lex_read_comment(lexer* l) {
     return false;
   }
 
-  while (r != '\n' && r != EoF) {
-    lex_next_rune(l);
-    r = lex_peek_rune(l);
-    if (r < 0) {
-      return false;
-    }
+  if (lex_accept_until(l, '\n', '\n') == false) {
+    return false;
   }
   lex_next_rune(l);
   return true;
@@ -1243,7 +2873,7 @@ bool lex_ignore_whitespace(lexer* l) {
   }
   while (true) {
     if (lex_is_whitespace(r)) {
-      lex_next_rune(l);
+      l->lexeme.end = lex_scan_space((const uint8_t*)l->input, l->lexeme.end, l->input_size);
     } else if (r == '#') {
       ok = lex_read_comment(l);
       if (ok == false) {
@@ -1311,61 +2941,4799 @@ bool lex_next(lexer* l) {
   return lex_read_any(l);
 }
 
+/* input that arrives in pieces (a serial line, flash pages) is
+ * copied into a window the caller provides, only the lexeme being
+ * read needs to fit in it, whitespace and comments don't. the
+ * lexer runs over the window, so lexemes are relative to it and
+ * 'offset' is where it starts within the whole input.
+ */
+typedef struct {
+  lexer l;
+  char* buff;
+  size_t cap;
+  size_t size;
+  size_t offset;
+  utf8_state utf8;
+  size_t valid;    /* well formed utf8 in the window up to here   */
+  bool bad;        /* and the byte at 'valid' can't be part of it */
+  bool last;       /* all of the input is in the window           */
+} lex_stream;
+
+enum lex_RES {
+  lex_OK,
+  /* the lexeme may go on in the input still to come */
+  lex_MORE,
+  /* the error is stored in lex_stream.l.err, error_lexeme_too_long
+   * if a lexeme fills the whole window
+   */
+  lex_ERR
+};
+
+void lex_stream_init(lex_stream* s, char* buff, size_t cap) {
+  s->buff = buff;
+  s->cap = cap;
+  s->size = 0;
+  s->offset = 0;
+  memset(&s->utf8, 0, sizeof(s->utf8));
+  s->valid = 0;
+  s->bad = false;
+  s->last = false;
+  s->l = lex_new_lexer(buff, 0);
+}
+
+/* copies as much of 'chunk' as fits in the window,
+ * returns how many bytes were taken
+ */
+size_t lex_stream_feed(lex_stream* s, const char* chunk, size_t size) {
+  size_t at;
+  if (size > s->cap - s->size) {
+    size = s->cap - s->size;
+  }
+  memcpy(s->buff + s->size, chunk, size);
+  if (s->bad == false) {
+    at = utf8_scan(&s->utf8, (const uint8_t*)chunk, size);
+    s->bad = at < size;
+    s->valid = s->size + at - (s->utf8.need != 0 ? s->utf8.seen : 0);
+  }
+  s->size += size;
+  return size;
+}
+
+/* no more input, what's left in the window is lexed to the end */
+void lex_stream_end(lex_stream* s) {
+  s->last = true;
+}
+
+/* reads the next lexeme into s->l.lexeme. until the end of the input
+ * a lexeme that reaches the end of the window may not be complete,
+ * then the window is moved so it starts with that lexeme and lex_MORE
+ * is returned: feed more input and try again.
+ */
+enum lex_RES lex_stream_next(lex_stream* s) {
+  lexer* l = &s->l;
+  size_t start = l->lexeme.end;
+  size_t i;
+  bool ok;
+
+  l->valid = s->valid;
+  /* a rune cut in half at the end stays hidden until it's whole */
+  l->input_size = s->last || s->bad ? s->size : s->valid;
+
+  ok = lex_next(l);
+  if (s->last) {
+    return ok ? lex_OK : lex_ERR;
+  }
+  if (ok) {
+    switch (l->lexeme.kind) {
+      case lk_eof:
+        break;
+      case lk_num:
+      case lk_id:
+      case lk_nil:
+      case lk_bool:
+        if (l->lexeme.end == l->input_size) {
+          break;
+        }
+        return lex_OK;
+      default:
+        return lex_OK;
+    }
+  } else if (l->err.code != error_unexpected_eof) {
+    return lex_ERR;
+  }
+
+  if (ok && l->lexeme.kind == lk_eof) {
+    /* there's only whitespace and comments left. a comment
+     * that goes on is kept as its '#' alone, so neither has to fit
+     * in the window
+     */
+    i = l->input_size;
+    while (i > start && s->buff[i-1] != '\n') {
+      i--;
+    }
+    i = lex_scan_space((const uint8_t*)s->buff, i, l->input_size);
+    start = l->input_size;
+    if (i < l->input_size) {
+      start--;
+      s->buff[start] = '#';
+    }
+  }
+  if (start == 0 && s->size == s->cap) {
+    l->err.code = error_lexeme_too_long;
+    l->err.range.begin = start;
+    l->err.range.end = s->size;
+    return lex_ERR;
+  }
+  memmove(s->buff, s->buff + start, s->size - start);
+  s->size -= start;
+  s->valid -= start;
+  s->offset += start;
+  l->lexeme.begin = 0;
+  l->lexeme.end = 0;
+  return lex_MORE;
+}
+
 /*
  * -------------------------------------
- * |           ###PARSER###            |
+ * |      ###REPRESENTATION###         |
  * -------------------------------------
  */
 
-typedef enum {
-  tbi_null,
-  tbi_eelist,  /* expr exprlist    */
-  tbi_list,    /* "(" exprlist ")" */
-  tbi_qexpr,   /* "'" expr         */
-  tbi_empty,   /* \e               */
-  tbi_bool,    /* bool             */
-  tbi_num,     /* num              */
-  tbi_nil,     /* "nil"            */
-  tbi_id,      /* id               */
-  tbi_str      /* str              */
-} parser_table_item;
+/* every access to the contents of a datum goes through these, so the
+ * rest of the interpreter doesn't know which layout is in use.
+ *
+ * by default every datum but nil is a cell of the pool with its tag.
+ * with PAMI_COMPACT a datum* is a tagged word instead, the low bits say
+ * what it is:
+ *   xx1  fixnum, the rest of the word is the number
+ *   010  pair, points to a cell of two words (car, cdr)
+ *   100  lambda, points to a cell of two words (code, env)
+ *   110  boolean, the bit above the tag is its value
+ *   000  nil if it is zero, a boxed cell (with a tag) otherwise
+ * cells are aligned to CELL_ALIGN (8) so the low bits of their address
+ * are free, env_create refuses buffers that are not.
+ */
 
-parser_table_item parser_parsing_table[2][9] =
-{
-/*               '           (           bool        num         str         id          nil         )          eof */
-/* exprlist  */ {tbi_eelist, tbi_eelist, tbi_eelist, tbi_eelist, tbi_eelist, tbi_eelist, tbi_eelist, tbi_empty, tbi_empty},
-/* expr      */ {tbi_qexpr,  tbi_list,   tbi_bool,   tbi_num,    tbi_str,    tbi_id,     tbi_nil,    tbi_null,  tbi_null},
+#ifdef PAMI_COMPACT
+#define DT_TAG_BITS ((uintptr_t)7)
+#define DT_PAIR_BITS ((uintptr_t)2)
+#define DT_LAMBDA_BITS ((uintptr_t)4)
+#define DT_BOOL_BITS ((uintptr_t)6)
+#define DT_BITS(d) ((uintptr_t)(d) & DT_TAG_BITS)
+#define DT_FALSE ((datum*)DT_BOOL_BITS)
+#define DT_TRUE ((datum*)(DT_BOOL_BITS | 8))
+#define DT_FIXNUM_MIN (INTPTR_MIN >> 1)
+#define DT_FIXNUM_MAX (INTPTR_MAX >> 1)
+
+/* the pool is made of cells of sizeof(datum), every one has to stay aligned */
+typedef char dt_cells_aligned[sizeof(datum)%CELL_ALIGN == 0 ? 1 : -1];
+
+bool dt_fits_fixnum(int64_t num) {
+  return DT_FIXNUM_MIN <= num && num <= DT_FIXNUM_MAX;
+}
+
+datum* dt_fixnum(int64_t num) {
+  return (datum*)(((uintptr_t)num << 1) | 1);
+}
+
+datum* dt_tagged(datum* cell, uintptr_t bits) {
+  return (datum*)((uintptr_t)cell | bits);
+}
+#endif
+
+/* true if 'd' points to a cell of the pool */
+bool dt_is_cell(const datum* d) {
+#ifdef PAMI_COMPACT
+  return d != NULL && (DT_BITS(d) & 1) == 0 && DT_BITS(d) != DT_BOOL_BITS;
+#else
+  return d != NULL;
+#endif
+}
+
+/* the cell 'd' points to, without the tag. 'd' must be a cell */
+datum* dt_cell(const datum* d) {
+#ifdef PAMI_COMPACT
+  return (datum*)((uintptr_t)d & ~DT_TAG_BITS);
+#else
+  return (datum*)d;
+#endif
+}
+
+/* 'd' must not be nil */
+enum datum_tag dt_tag(const datum* d) {
+#ifdef PAMI_COMPACT
+  if (DT_BITS(d) & 1) {
+    return EXACT_NUM;
+  }
+  switch (DT_BITS(d)) {
+    case DT_PAIR_BITS: return PAIR;
+    case DT_LAMBDA_BITS: return LAMBDA;
+    case DT_BOOL_BITS: return BOOL;
+    default: break;
+  }
+  return (enum datum_tag)d->tag;
+#else
+  return d->tag;
+#endif
+}
+
+bool dt_is_pair(const datum* d) {
+  return d != NULL && dt_tag(d) == PAIR;
+}
+
+bool dt_is_symbol(const datum* d) {
+  return d != NULL && dt_tag(d) == SYMBOL;
+}
+
+bool dt_truthy(const datum* d) {
+#ifdef PAMI_COMPACT
+  return d != NULL && d != DT_FALSE;
+#else
+  return d != NULL && !(d->tag == BOOL && d->data.boolean == false);
+#endif
+}
+
+int64_t dt_exact(const datum* d) {
+#ifdef PAMI_COMPACT
+  if (DT_BITS(d) & 1) {
+    /* arithmetic shift keeps the sign */
+    return (int64_t)((intptr_t)d >> 1);
+  }
+#endif
+  return d->data.exact_num;
+}
+
+double dt_inexact(const datum* d) {
+  return d->data.inexact_num;
+}
+
+bool dt_bool(const datum* d) {
+#ifdef PAMI_COMPACT
+  return d == DT_TRUE;
+#else
+  return d->data.boolean;
+#endif
+}
+
+cproc dt_cproc(const datum* d) {
+  return d->data.cproc;
+}
+
+/* the header of a compiled function */
+const uint8_t* dt_code(const datum* d) {
+  return d->data.code;
+}
+
+/* strings and symbols */
+str dt_str(const datum* d) {
+#ifdef PAMI_COMPACT
+  str s;
+  s.start = d->start;
+  s.len = d->len;
+  s.buff = d->data.buff;
+  return s;
+#else
+  return d->data.string;
+#endif
+}
+
+void dt_set_str(datum* d, str s) {
+#ifdef PAMI_COMPACT
+  d->start = s.start;
+  d->len = s.len;
+  d->data.buff = s.buff;
+#else
+  d->data.string = s;
+#endif
+}
+
+datum** dt_car_ref(const datum* d) {
+#ifdef PAMI_COMPACT
+  return &((pair*)dt_cell(d))->car;
+#else
+  return &((datum*)d)->data.pair.car;
+#endif
+}
+
+datum** dt_cdr_ref(const datum* d) {
+#ifdef PAMI_COMPACT
+  return &((pair*)dt_cell(d))->cdr;
+#else
+  return &((datum*)d)->data.pair.cdr;
+#endif
+}
+
+datum* dt_car(const datum* d) {
+  return *dt_car_ref(d);
+}
+
+datum* dt_cdr(const datum* d) {
+  return *dt_cdr_ref(d);
+}
+
+lambda* dt_lambda(const datum* d) {
+#ifdef PAMI_COMPACT
+  return (lambda*)dt_cell(d);
+#else
+  return &((datum*)d)->data.lambda;
+#endif
+}
+
+/*
+ * -------------------------------------
+ * |        ###ENVIRONMENT###          |
+ * -------------------------------------
+ */
+
+enum eval_cont_kind {
+  ek_if,     /* 'exprs' is (then else)                        */
+  ek_begin,  /* 'exprs' are the remaining expressions of a body */
+  ek_define, /* 'exprs' is the symbol being defined           */
+  ek_set,    /* 'exprs' is the symbol being assigned          */
+  ek_args    /* 'exprs' are the arguments still to evaluate   */
 };
 
-enum parser_prodkind {
-  pk_exprlist,
-  pk_expr
+typedef struct {
+  enum eval_cont_kind kind;
+  datum* exprs;
+  datum* frame;   /* frame in which 'exprs' are evaluated */
+  size_t values;  /* size of the value stack when this was pushed */
+} eval_cont;
+
+enum eval_state {
+  st_eval,   /* evaluate 'expr' in 'frame' */
+  st_return, /* deliver 'val' to the top continuation */
+  st_apply,  /* apply the procedure at 'args' in the value stack */
+  st_wait,   /* a builtin suspended the task, see TASKS */
+  st_done
 };
-  
+
+/* registers of the evaluator, the machine never recurses,
+ * everything it still has to do lives in 'cont'
+ */
 typedef struct {
-  enum lex_kind lkind;
-  enum parser_prodkind pkind;
-  bool isTerminal;
-} parser_stack_item;
+  enum eval_state state;
+  datum* expr;
+  datum* frame;     /* (bindings . parent), nil is the global frame */
+  datum* val;
+  size_t base;      /* size of 'cont' when the evaluation started */
+  size_t args;      /* offset of the procedure being applied in 'values' */
+  stack_f* cont;    /* continuations (eval_cont) */
+  stack_f* values;  /* evaluated procedures and arguments (datum*) */
+} machine;
+
+/* a call in progress of the bytecode vm */
+typedef struct {
+  const uint8_t* pc;  /* where the caller continues */
+  datum* frame;       /* frame of the caller */
+  size_t values;      /* size of the value stack before the call */
+} vm_call;
+
+/* the constant slot given to a global by the running compile, an
+ * entry of an open addressing table keyed by the symbol
+ */
+typedef struct {
+  datum* sym;
+  uint32_t stamp;  /* of the compile that filled it, others are empty */
+  uint16_t slot;
+} cc_global;
+
+/* compiled code and the registers of the vm that are not local to
+ * vm_run. bytecode and constants are only ever appended.
+ */
+typedef struct {
+  stack_f* code;    /* bytecode of every compiled function */
+  stack_f* consts;  /* constants referenced by the bytecode (datum*) */
+  stack_f* calls;   /* calls in progress (vm_call) */
+  stack_f* tasks;   /* pending work of the compiler (cc_task) */
+  stack_f* scopes;  /* lambdas being compiled (cc_scope) */
+  datum* frame;     /* frame of the running function */
+  cc_global* globals; /* twice as many as the constants, a power of two */
+  size_t nglobals;
+  uint32_t stamp;     /* of the running compile */
+} vm_machine;
+
+enum task_state {ts_free, ts_ready, ts_waiting, ts_done};
+
+/* a task is an evaluation with its own machine and stacks that runs
+ * in turns with the others, all of them share the pool
+ */
+typedef struct {
+  machine m;         /* saved while it is not running */
+  size_t fuel;
+  enum task_state state;
+  bool receiving;    /* waiting in 'receive', not in 'yield' */
+  datum* inbox;      /* messages, oldest first */
+  datum* last;       /* last pair of 'inbox' */
+  datum* result;     /* value of a task that is done */
+  bool failed;       /* it is done because of 'err' */
+  error err;
+  uint32_t generation; /* changes when the slot is freed, part of the id */
+} task;
+
+#define SCHED_NONE SIZE_MAX
+
+typedef struct {
+  task* tasks;
+  size_t ntasks;
+  size_t current;    /* task in env->m, or SCHED_NONE */
+  size_t next;       /* where the round robin goes on */
+  machine main;      /* saved while a task is running */
+} scheduler;
+
+enum gc_phase {gp_idle, gp_mark, gp_sweep};
+
+/* state of the mark and sweep collector. every cell of the pool has
+ * a bit in 'live' (it is allocated) and in 'marks' (its color).
+ * marking uses 'gray' as an explicit stack, if it overflows we fall
+ * back to rescanning the marked cells of the heap.
+ */
+typedef struct {
+  enum gc_phase phase;
+  uint8_t* marks;
+  uint8_t* live;
+#ifdef PAMI_COMPACT
+  uint8_t* boxed;   /* the cell has a tag, otherwise it is two words */
+#endif
+  bool black;       /* value of the mark bit that means black */
+  size_t ncells;
+  size_t cursor;    /* next cell to be swept */
+  size_t strings;   /* bytes held by live strings in the freelist */
+  size_t reserve;   /* collect when fewer cells than this are free */
+  size_t string_reserve; /* or when fewer bytes than this are free */
+  stack_f* gray;
+  bool overflow;
+
+  bool incremental;   /* spread cycles over allocations */
+  size_t step_allocs; /* do some work every 'step_allocs' allocations */
+  size_t step_work;   /* cells scanned or swept per step */
+  size_t allocs;
+} collector;
+
+enum eval_special {
+  sp_none, sp_quote, sp_if, sp_define, sp_set, sp_lambda, sp_begin,
+  SP_COUNT
+};
 
+const char* const env_special_names[SP_COUNT] = {
+  NULL, "quote", "if", "define", "set!", "lambda", "begin"
+};
+
+/* limits of a single evaluation (eval, eval_program, eval_string or
+ * vm_run), 0 means no limit. going over any of them stops it with
+ * error_quota_exceeded. they are all checked with a compare, so they
+ * can always be on.
+ */
 typedef struct {
-  pool* pool;     // cells go here
-  freelist* fl;   // strings here
-  stack_f* stack; // productions (for parsing)
+  size_t fuel;   /* expressions evaluated plus calls made by the vm */
+  size_t cells;  /* cells in use in the pool */
+  size_t bytes;  /* bytes of strings in use in the freelist */
+  size_t depth;  /* continuations of the evaluator, calls of the vm */
+} env_quota;
+
+typedef struct environment {
+  pool* pool;        // cells go here
+  freelist* fl;      // strings here
+  stack_f* stack;    // productions (for parsing)
+  hashmap* symbols;  // interned symbols, name -> datum*
+  datum* globals;    // list of (symbol . value)
+  datum* specials[SP_COUNT];
+  machine m;
+  vm_machine vm;
+  collector gc;
+  error err;
+  size_t size;       // bytes of the buffer it lives in
+  const uint8_t* rom;  // read only cells and strings, or NULL
+  size_t rom_size;
+  env_quota quota;   // no limit is SIZE_MAX here
+  size_t fuel;       // left for the current evaluation
+  scheduler sched;   // tasks
 } environment;
 
-void parse(environment* env, char* text) {
+#define GC_GET(bits, i) ((bits)[(i)/8] & (1 << ((i)%8)))
+#define GC_SET(bits, i) ((bits)[(i)/8] |= (uint8_t)(1 << ((i)%8)))
+#define GC_CLEAR(bits, i) ((bits)[(i)/8] &= (uint8_t)~(1 << ((i)%8)))
+
+#ifdef PAMI_COMPACT
+#define GC_BITMAPS 3
+#else
+#define GC_BITMAPS 2
+#endif
+
+size_t env_cell_index(const environment* env, const datum* d) {
+  return distance(env->pool->begin, (const uint8_t*)d)/sizeof(datum);
+}
+
+/* true if 'd' is a cell of the read only image, see the ROM */
+bool env_in_rom(const environment* env, const datum* d) {
+  uintptr_t p;
+  if (dt_is_cell(d) == false) {
+    return false;
+  }
+  p = (uintptr_t)dt_cell(d);
+  return (uintptr_t)env->rom <= p && p < (uintptr_t)env->rom + env->rom_size;
+}
+
+void env_set_err(environment* env, enum error_code code) {
+  env->err.code = code;
+  env->err.range.begin = 0;
+  env->err.range.end = 0;
+}
+
+size_t env_quota_limit(size_t limit) {
+  return limit == 0 ? SIZE_MAX : limit;
+}
+
+/* sets the limits of the evaluations to come, NULL removes them */
+void env_set_quota(environment* env, const env_quota* q) {
+  env_quota none = {0, 0, 0, 0};
+  if (q == NULL) {
+    q = &none;
+  }
+  env->quota.fuel = env_quota_limit(q->fuel);
+  env->quota.cells = env_quota_limit(q->cells);
+  env->quota.bytes = env_quota_limit(q->bytes);
+  env->quota.depth = env_quota_limit(q->depth);
+  env->fuel = env->quota.fuel;
+}
+
+/* called when an evaluation starts */
+void env_refuel(environment* env) {
+  env->fuel = env->quota.fuel;
+}
+
+bool env_burn(environment* env) {
+  if (env->fuel == 0) {
+    env_set_err(env, error_quota_exceeded);
+    return false;
+  }
+  env->fuel--;
+  return true;
+}
+
+void env_free_str(environment* env, char* buff) {
+  env->gc.strings -= fl_objsize(buff);
+  fl_free(env->fl, buff);
 }
 
 /*
  * -------------------------------------
- * |      ###BUILTIN FUNCTIONS###      |
+ * |      ###GARBAGE COLLECTOR###      |
  * -------------------------------------
  */
 
-/*
- * -------------------------------------
- * |         ###EVALUATOR###           |
- * -------------------------------------
+/* tri-color mark and sweep. a cell is black (or gray, if it is still
+ * in the gray stack) when its mark bit equals 'black', and white
+ * otherwise. instead of clearing the marks after a cycle the meaning
+ * of the bit is flipped, so survivors become white for free.
+ *
+ * cycles start and finish marking only at safe points of the
+ * evaluator, where every reachable datum is held by the globals, the
+ * symbol table or the machine registers and stacks. in incremental
+ * mode, the work in between is done a bit at a time on allocation:
+ * cells allocated during a cycle are black, and every pointer stored
+ * into a cell while marking goes through gc_write_barrier, so a white
+ * cell can never hide behind a black one.
+ *
+ * it never recurses: gray cells wait in a bounded stack and an
+ * overflow is recovered by rescanning the heap when marking finishes.
  */
 
+bool gc_in_pool(const environment* env, const datum* d) {
+  const uint8_t* p = (const uint8_t*)d;
+  return env->pool->begin <= p && p < env->pool->end &&
+         distance(env->pool->begin, p) % sizeof(datum) == 0;
+}
+
+bool gc_is_black(const collector* gc, size_t i) {
+  return (GC_GET(gc->marks, i) != 0) == gc->black;
+}
+
+void gc_paint(collector* gc, size_t i, bool black) {
+  if (black == gc->black) {
+    GC_SET(gc->marks, i);
+  } else {
+    GC_CLEAR(gc->marks, i);
+  }
+}
+
+void gc_mark(environment* env, datum* d) {
+  collector* gc = &env->gc;
+  datum** slot;
+  size_t i;
+
+  if (dt_is_cell(d) == false) {
+    return;
+  }
+  d = dt_cell(d);
+  if (gc_in_pool(env, d) == false) {
+    return;
+  }
+  i = env_cell_index(env, d);
+  if (gc_is_black(gc, i)) {
+    return;
+  }
+  gc_paint(gc, i, true);
+
+  slot = (datum**)sf_alloc(gc->gray);
+  if (slot == NULL) {
+    gc->overflow = true;
+    return;
+  }
+  *slot = d;
+}
+
+/* must be called with every pointer stored into a cell */
+void gc_write_barrier(environment* env, datum* d) {
+  if (env->gc.phase == gp_mark) {
+    gc_mark(env, d);
+  }
+}
+
+/* 'd' is the cell itself, without the tag of the pointer */
+void gc_scan(environment* env, datum* d) {
+#ifdef PAMI_COMPACT
+  datum** words = (datum**)d;
+  /* pairs and lambdas are both two pointers */
+  if (GC_GET(env->gc.boxed, env_cell_index(env, d)) == 0) {
+    gc_mark(env, words[0]);
+    gc_mark(env, words[1]);
+  }
+#else
+  switch (d->tag) {
+    case PAIR:
+      gc_mark(env, d->data.pair.car);
+      gc_mark(env, d->data.pair.cdr);
+      break;
+    case LAMBDA:
+      gc_mark(env, d->data.lambda.code);
+      gc_mark(env, d->data.lambda.env);
+      break;
+    default:
+      break;
+  }
+#endif
+}
+
+/* scans at most 'work' gray cells, returns the work left */
+size_t gc_drain(environment* env, size_t work) {
+  datum* d;
+  while (work > 0 && sf_empty(env->gc.gray) == false) {
+    d = *(datum**)sf_top(env->gc.gray);
+    sf_free(env->gc.gray);
+    gc_scan(env, d);
+    work--;
+  }
+  return work;
+}
+
+/* cells that were marked but never scanned because the gray stack
+ * was full are found again by walking the whole heap
+ */
+void gc_recover_overflow(environment* env) {
+  collector* gc = &env->gc;
+  datum* cells = (datum*)env->pool->begin;
+  size_t i;
+
+  while (gc->overflow) {
+    gc->overflow = false;
+    for (i = 0; i < gc->ncells; i++) {
+      if (GC_GET(gc->live, i) && gc_is_black(gc, i)) {
+        gc_scan(env, &cells[i]);
+        gc_drain(env, SIZE_MAX);
+      }
+    }
+  }
+}
+
+void gc_mark_machine(environment* env, const machine* m) {
+  eval_cont* k;
+  size_t i;
+
+  gc_mark(env, m->expr);
+  gc_mark(env, m->frame);
+  gc_mark(env, m->val);
+  for (i = 0; i < sf_used(m->cont); i += sizeof(eval_cont)) {
+    k = (eval_cont*)(m->cont->buff + i);
+    gc_mark(env, k->exprs);
+    gc_mark(env, k->frame);
+  }
+  for (i = 0; i < sf_used(m->values); i += sizeof(datum*)) {
+    gc_mark(env, *(datum**)(m->values->buff + i));
+  }
+}
+
+void gc_mark_roots(environment* env) {
+  scheduler* s = &env->sched;
+  hashmap* hm = env->symbols;
+  task* t;
+  size_t i;
+
+  gc_mark(env, env->globals);
+  for (i = 0; i < hm->capacity; i++) {
+    if (hm->entries[i].hash != 0) {
+      gc_mark(env, (datum*)hm->entries[i].value);
+    }
+  }
+
+  /* the running machine is in env->m, the copy it came from is stale */
+  gc_mark_machine(env, &env->m);
+  if (s->current != SCHED_NONE) {
+    gc_mark_machine(env, &s->main);
+  }
+  for (i = 0; i < s->ntasks; i++) {
+    t = &s->tasks[i];
+    if (t->state == ts_free) {
+      continue;
+    }
+    if (i != s->current) {
+      gc_mark_machine(env, &t->m);
+    }
+    gc_mark(env, t->inbox);
+    gc_mark(env, t->result);
+  }
+
+  gc_mark(env, env->vm.frame);
+  for (i = 0; i < sf_used(env->vm.calls); i += sizeof(vm_call)) {
+    gc_mark(env, ((vm_call*)(env->vm.calls->buff + i))->frame);
+  }
+  for (i = 0; i < sf_used(env->vm.consts); i += sizeof(datum*)) {
+    gc_mark(env, *(datum**)(env->vm.consts->buff + i));
+  }
+}
+
+/* safe point only */
+void gc_start(environment* env) {
+  env->gc.phase = gp_mark;
+  env->gc.overflow = false;
+  gc_mark_roots(env);
+}
+
+/* safe point only. registers and stacks are not behind the write
+ * barrier, so they are scanned again before marking is declared done.
+ */
+void gc_finish_mark(environment* env) {
+  gc_mark_roots(env);
+  gc_drain(env, SIZE_MAX);
+  gc_recover_overflow(env);
+  env->gc.phase = gp_sweep;
+  env->gc.cursor = 0;
+}
+
+bool gc_is_string(const environment* env, size_t i) {
+  const datum* cells = (const datum*)env->pool->begin;
+#ifdef PAMI_COMPACT
+  if (GC_GET(env->gc.boxed, i) == 0) {
+    return false;
+  }
+#endif
+  return cells[i].tag == STRING;
+}
+
+/* sweeps at most 'work' cells, returns the work left */
+size_t gc_sweep(environment* env, size_t work) {
+  collector* gc = &env->gc;
+  datum* cells = (datum*)env->pool->begin;
+  size_t i;
+
+  for (i = gc->cursor; i < gc->ncells && work > 0; i++, work--) {
+    if (GC_GET(gc->live, i) == 0 || gc_is_black(gc, i)) {
+      continue;
+    }
+    /* symbols are never swept, the symbol table keeps them alive */
+    if (gc_is_string(env, i)) {
+      env_free_str(env, dt_str(&cells[i]).buff);
+    }
+    GC_CLEAR(gc->live, i);
+    pool_free(env->pool, &cells[i]);
+  }
+  gc->cursor = i;
+
+  if (gc->cursor == gc->ncells) {
+    /* every survivor becomes white */
+    gc->black = !gc->black;
+    gc->phase = gp_idle;
+  }
+  return work;
+}
+
+/* does a bounded amount of marking or sweeping, safe to call
+ * from allocation since it never finishes marking
+ */
+void gc_step(environment* env, size_t work) {
+  switch (env->gc.phase) {
+    case gp_mark:
+      gc_drain(env, work);
+      break;
+    case gp_sweep:
+      gc_sweep(env, work);
+      break;
+    case gp_idle:
+      break;
+  }
+}
+
+/* stop the world collection, must only be called at a safe point.
+ * a cycle already in progress is finished first, since it may have
+ * missed garbage created after it started.
+ */
+void gc_collect(environment* env) {
+  bool again = env->gc.phase != gp_idle;
+  while (true) {
+    if (env->gc.phase == gp_idle) {
+      gc_start(env);
+    }
+    if (env->gc.phase == gp_mark) {
+      gc_finish_mark(env);
+    }
+    gc_sweep(env, SIZE_MAX);
+    if (again == false) {
+      return;
+    }
+    again = false;
+  }
+}
+
+/* what is left of the pool and the freelist, or of the quota */
+size_t gc_free_cells(const environment* env) {
+  size_t used = env->pool->nchunks - env->pool->nfree;
+  if (env->quota.cells < env->pool->nchunks) {
+    return used >= env->quota.cells ? 0 : env->quota.cells - used;
+  }
+  return env->pool->nfree;
+}
+
+size_t gc_free_bytes(const environment* env) {
+  size_t limit = env->quota.bytes < env->fl->size ? env->quota.bytes : env->fl->size;
+  return env->gc.strings >= limit ? 0 : limit - env->gc.strings;
+}
+
+/* 'shift' divides the reserves by a power of two */
+bool gc_low_memory(const environment* env, int shift) {
+  return gc_free_cells(env) < env->gc.reserve >> shift ||
+         gc_free_bytes(env) < env->gc.string_reserve >> shift;
+}
+
+/* called by the evaluator between expressions */
+void gc_safe_point(environment* env) {
+  collector* gc = &env->gc;
+
+  if (gc->incremental == false) {
+    if (gc_low_memory(env, 0)) {
+      gc_collect(env);
+    }
+    return;
+  }
+
+  switch (gc->phase) {
+    case gp_idle:
+      if (gc_low_memory(env, 0)) {
+        gc_start(env);
+      }
+      break;
+    case gp_mark:
+      if (sf_empty(gc->gray)) {
+        gc_finish_mark(env);
+      }
+      break;
+    case gp_sweep:
+      break;
+  }
+
+  /* the cycle is not keeping up with allocation */
+  if (gc->phase != gp_idle && gc_low_memory(env, 2)) {
+    gc_collect(env);
+  }
+}
+
+/* called before every cell allocation */
+void gc_alloc_step(environment* env) {
+  collector* gc = &env->gc;
+  if (gc->incremental && gc->phase != gp_idle) {
+    gc->allocs++;
+    if (gc->allocs >= gc->step_allocs) {
+      gc->allocs = 0;
+      gc_step(env, gc->step_work);
+    }
+  }
+}
+
+/*
+ * -------------------------------------
+ * |             ###DATUM###           |
+ * -------------------------------------
+ */
+
+/* all constructors return NULL if the cell (or string)
+ * could not be allocated, the error is stored in env->err
+ */
+datum* env_new_datum(environment* env, enum datum_tag tag) {
+  datum* d;
+  size_t i;
+
+  gc_alloc_step(env);
+  if (env->pool->nchunks - env->pool->nfree >= env->quota.cells) {
+    env_set_err(env, error_quota_exceeded);
+    return NULL;
+  }
+  d = (datum*)pool_alloc(env->pool);
+  if (d == NULL) {
+    env_set_err(env, error_pool_exhausted);
+    return NULL;
+  }
+  i = env_cell_index(env, d);
+  GC_SET(env->gc.live, i);
+  /* cells are born black during a cycle, they may already be
+   * referenced by something that will not be scanned again
+   */
+  gc_paint(&env->gc, i, env->gc.phase != gp_idle);
+#ifdef PAMI_COMPACT
+  if (tag == PAIR || tag == LAMBDA) {
+    GC_CLEAR(env->gc.boxed, i);
+    return dt_tagged(d, tag == PAIR ? DT_PAIR_BITS : DT_LAMBDA_BITS);
+  }
+  GC_SET(env->gc.boxed, i);
+  d->tag = (uint16_t)tag;
+#else
+  d->tag = tag;
+#endif
+  return d;
+}
+
+datum* env_new_pair(environment* env, datum* car, datum* cdr) {
+  datum* d = env_new_datum(env, PAIR);
+  if (d == NULL) {
+    return NULL;
+  }
+  gc_write_barrier(env, car);
+  gc_write_barrier(env, cdr);
+  *dt_car_ref(d) = car;
+  *dt_cdr_ref(d) = cdr;
+  return d;
+}
+
+datum* env_new_exact(environment* env, int64_t num) {
+  datum* d;
+#ifdef PAMI_COMPACT
+  if (dt_fits_fixnum(num)) {
+    return dt_fixnum(num);
+  }
+#endif
+  d = env_new_datum(env, EXACT_NUM);
+  if (d == NULL) {
+    return NULL;
+  }
+  d->data.exact_num = num;
+  return d;
+}
+
+datum* env_new_inexact(environment* env, double num) {
+  datum* d = env_new_datum(env, INEXACT_NUM);
+  if (d == NULL) {
+    return NULL;
+  }
+  d->data.inexact_num = num;
+  return d;
+}
+
+datum* env_new_bool(environment* env, bool b) {
+#ifdef PAMI_COMPACT
+  (void)env;
+  return b ? DT_TRUE : DT_FALSE;
+#else
+  datum* d = env_new_datum(env, BOOL);
+  if (d == NULL) {
+    return NULL;
+  }
+  d->data.boolean = b;
+  return d;
+#endif
+}
+
+/* allocates the body of a string in the freelist,
+ * the contents are left for the caller to fill
+ */
+bool env_new_str(environment* env, size_t len, str* out) {
+  char* buff;
+  if (len > INT16_MAX) {
+    env_set_err(env, error_string_too_long);
+    return false;
+  }
+  if (env->gc.strings + len > env->quota.bytes) {
+    env_set_err(env, error_quota_exceeded);
+    return false;
+  }
+  buff = (char*)fl_alloc(env->fl, len == 0 ? 1 : len);
+  if (buff == NULL) {
+    env_set_err(env, error_freelist_exhausted);
+    return false;
+  }
+  env->gc.strings += fl_objsize(buff);
+  out->start = 0;
+  out->len = (int16_t)len;
+  out->buff = buff;
+  return true;
+}
+
+datum* env_new_string(environment* env, const char* text, size_t len) {
+  datum* d;
+  str s;
+  if (env_new_str(env, len, &s) == false) {
+    return NULL;
+  }
+  d = env_new_datum(env, STRING);
+  if (d == NULL) {
+    env_free_str(env, s.buff);
+    return NULL;
+  }
+  memcpy(s.buff, text, len);
+  dt_set_str(d, s);
+  return d;
+}
+
+datum* env_new_cproc(environment* env, cproc proc) {
+  datum* d = env_new_datum(env, C_PROC);
+  if (d == NULL) {
+    return NULL;
+  }
+  d->data.cproc = proc;
+  return d;
+}
+
+datum* env_new_lambda(environment* env, datum* code, datum* frame) {
+  datum* d = env_new_datum(env, LAMBDA);
+  if (d == NULL) {
+    return NULL;
+  }
+  gc_write_barrier(env, code);
+  gc_write_barrier(env, frame);
+  dt_lambda(d)->code = code;
+  dt_lambda(d)->env = frame;
+  return d;
+}
+
+datum* env_new_code(environment* env, const uint8_t* header) {
+  datum* d = env_new_datum(env, CODE);
+  if (d == NULL) {
+    return NULL;
+  }
+  d->data.code = header;
+  return d;
+}
+
+datum* env_new_symbol(environment* env, const char* name, size_t len) {
+  datum* d = env_new_string(env, name, len);
+  if (d == NULL) {
+    return NULL;
+  }
+  /* a symbol has the same contents as a string */
+  d->tag = SYMBOL;
+  return d;
+}
+
+/* every mutation of a cell must go through these */
+void env_set_car(environment* env, datum* pair, datum* val) {
+  gc_write_barrier(env, val);
+  *dt_car_ref(pair) = val;
+}
+
+void env_set_cdr(environment* env, datum* pair, datum* val) {
+  gc_write_barrier(env, val);
+  *dt_cdr_ref(pair) = val;
+}
+
+/* returns the unique symbol with the given name,
+ * the name is copied only the first time it is seen
+ */
+datum* env_intern(environment* env, const char* name, size_t len) {
+  datum* sym = (datum*)hm_get(env->symbols, name, len);
+  if (sym != NULL) {
+    return sym;
+  }
+  sym = env_new_symbol(env, name, len);
+  if (sym == NULL) {
+    return NULL;
+  }
+  if (hm_put(env->symbols, dt_str(sym).buff, len, sym) != hm_OK) {
+    env_set_err(env, error_symbols_exhausted);
+    return NULL;
+  }
+  return sym;
+}
+
+/* returns the (symbol . value) binding of 'sym' visible from 'frame',
+ * or NULL if it is unbound. symbols are interned, so they are compared
+ * by identity.
+ */
+datum* env_lookup(const environment* env, const datum* frame, const datum* sym) {
+  datum* b;
+  while (frame != NULL) {
+    for (b = dt_car(frame); b != NULL; b = dt_cdr(b)) {
+      if (dt_car(dt_car(b)) == sym) {
+        return dt_car(b);
+      }
+    }
+    frame = dt_cdr(frame);
+  }
+  for (b = env->globals; b != NULL; b = dt_cdr(b)) {
+    if (dt_car(dt_car(b)) == sym) {
+      return dt_car(b);
+    }
+  }
+  return NULL;
+}
+
+/* binds 'sym' in 'frame', redefining it if it already exists there */
+bool env_define(environment* env, datum* frame, datum* sym, datum* val) {
+  datum* bindings = frame == NULL ? env->globals : dt_car(frame);
+  datum* b;
+
+  for (b = bindings; b != NULL; b = dt_cdr(b)) {
+    if (dt_car(dt_car(b)) == sym) {
+      env_set_cdr(env, dt_car(b), val);
+      return true;
+    }
+  }
+
+  b = env_new_pair(env, sym, val);
+  if (b == NULL) {
+    return false;
+  }
+  b = env_new_pair(env, b, bindings);
+  if (b == NULL) {
+    return false;
+  }
+  if (frame == NULL) {
+    env->globals = b;
+  } else {
+    env_set_car(env, frame, b);
+  }
+  return true;
+}
+
+/*
+ * -------------------------------------
+ * |           ###PARSER###            |
+ * -------------------------------------
+ */
+
+typedef enum {
+  tbi_null,
+  tbi_eelist,  /* expr exprlist    */
+  tbi_list,    /* "(" exprlist ")" */
+  tbi_qexpr,   /* "'" expr         */
+  tbi_empty,   /* \e               */
+  tbi_bool,    /* bool             */
+  tbi_num,     /* num              */
+  tbi_nil,     /* "nil"            */
+  tbi_id,      /* id               */
+  tbi_str      /* str              */
+} parser_table_item;
+
+const parser_table_item parser_parsing_table[2][9] =
+{
+/*               '           (           bool        num         str         id          nil         )          eof */
+/* exprlist  */ {tbi_eelist, tbi_eelist, tbi_eelist, tbi_eelist, tbi_eelist, tbi_eelist, tbi_eelist, tbi_empty, tbi_empty},
+/* expr      */ {tbi_qexpr,  tbi_list,   tbi_bool,   tbi_num,    tbi_str,    tbi_id,     tbi_nil,    tbi_null,  tbi_null},
+};
+
+/* maps a lex_kind to a column of the parsing table */
+const int parser_table_column[] = {
+  -1, /* lk_bad          */
+  0,  /* lk_quote        */
+  1,  /* lk_left_parens  */
+  7,  /* lk_right_parens */
+  2,  /* lk_bool         */
+  3,  /* lk_num          */
+  4,  /* lk_str          */
+  5,  /* lk_id           */
+  6,  /* lk_nil          */
+  8   /* lk_eof          */
+};
+
+enum parser_prodkind {
+  pk_exprlist,
+  pk_expr
+};
+
+/* 'dest' is where the datum produced by this item is written,
+ * it points either to the output of parse or to the car/cdr
+ * of a cell that is still being built.
+ */
+typedef struct {
+  enum lex_kind lkind;
+  enum parser_prodkind pkind;
+  bool isTerminal;
+  datum** dest;
+} parser_stack_item;
+
+error parser_err(lexer* l, enum error_code code) {
+  error err;
+  err.code = code;
+  err.range.begin = l->lexeme.begin;
+  err.range.end = l->lexeme.end;
+  return err;
+}
+
+bool parser_push(environment* env, parser_stack_item item) {
+  parser_stack_item* top = (parser_stack_item*)sf_alloc(env->stack);
+  if (top == NULL) {
+    env_set_err(env, error_stack_exhausted);
+    return false;
+  }
+  *top = item;
+  return true;
+}
+
+bool parser_push_prod(environment* env, enum parser_prodkind pkind, datum** dest) {
+  parser_stack_item item;
+  item.lkind = lk_bad;
+  item.pkind = pkind;
+  item.isTerminal = false;
+  item.dest = dest;
+  return parser_push(env, item);
+}
+
+bool parser_push_term(environment* env, enum lex_kind lkind) {
+  parser_stack_item item;
+  item.lkind = lkind;
+  item.pkind = pk_expr;
+  item.isTerminal = true;
+  item.dest = NULL;
+  return parser_push(env, item);
+}
+
+char parser_escape(char c) {
+  switch (c) {
+    case 'n':
+      return '\n';
+    case 't':
+      return '\t';
+    case 'r':
+      return '\r';
+  }
+  return c;
+}
+
+/* copies the string literal (without quotes) into the freelist,
+ * decoding escapes on the way.
+ */
+datum* parser_new_strlit(environment* env, const lexer* l) {
+  const char* begin = l->input + l->lexeme.begin + 1;
+  const char* end = l->input + l->lexeme.end - 1;
+  size_t len = 0;
+  datum* d;
+  str s;
+
+  /* escapes only shrink the string */
+  if (env_new_str(env, distance((uint8_t*)begin, (uint8_t*)end), &s) == false) {
+    return NULL;
+  }
+  while (begin < end) {
+    if (*begin == '\\') {
+      begin++;
+      s.buff[len] = parser_escape(*begin);
+    } else {
+      s.buff[len] = *begin;
+    }
+    begin++;
+    len++;
+  }
+  s.len = (int16_t)len;
+
+  d = env_new_datum(env, STRING);
+  if (d == NULL) {
+    env_free_str(env, s.buff);
+    return NULL;
+  }
+  dt_set_str(d, s);
+  return d;
+}
+
+datum* parser_new_atom(environment* env, const lexer* l, parser_table_item tbi) {
+  switch (tbi) {
+    case tbi_bool:
+      return env_new_bool(env, l->lexeme.value.boolean);
+    case tbi_num:
+      if (l->lexeme.vkind == vk_inexact_num) {
+        return env_new_inexact(env, l->lexeme.value.inexact_num);
+      }
+      return env_new_exact(env, (int64_t)l->lexeme.value.exact_num);
+    case tbi_id:
+      return env_intern(env, l->input + l->lexeme.begin,
+                        l->lexeme.end - l->lexeme.begin);
+    case tbi_str:
+      return parser_new_strlit(env, l);
+    default:
+      break;
+  }
+  env_set_err(env, error_internal);
+  return NULL;
+}
+
+/* builds (quote . (nil . nil)) and returns where the
+ * quoted expression must be written
+ */
+datum** parser_new_quote(environment* env, datum** dest) {
+  datum* quote; datum* rest;
+
+  rest = env_new_pair(env, NULL, NULL);
+  if (rest == NULL) {
+    return NULL;
+  }
+  quote = env_new_pair(env, env->specials[sp_quote], rest);
+  if (quote == NULL) {
+    return NULL;
+  }
+  *dest = quote;
+  return dt_car_ref(rest);
+}
+
+/* parses the whole text without recursion, productions are kept
+ * in env->stack and cells are built directly into env->pool.
+ * the list of top level expressions is written to 'out'.
+ * returns false if there was an error, the error is stored in env->err.
+ */
+bool parse(environment* env, const char* text, size_t size, datum** out) {
+  lexer l = lex_new_lexer(text, size);
+  size_t base = sf_used(env->stack);
+  parser_stack_item item;
+  parser_table_item tbi;
+  datum* cell;
+  datum** dest;
+  int column;
+
+  *out = NULL;
+  if (parser_push_prod(env, pk_exprlist, out) == false) {
+    return false;
+  }
+  if (lex_next(&l) == false) {
+    env->err = l.err;
+    goto fail;
+  }
+
+  while (sf_used(env->stack) > base) {
+    item = *(parser_stack_item*)sf_top(env->stack);
+    sf_free(env->stack);
+
+    if (item.isTerminal) {
+      if (l.lexeme.kind != item.lkind) {
+        env->err = parser_err(&l, error_unexpected_lexeme);
+        goto fail;
+      }
+      if (lex_next(&l) == false) {
+        env->err = l.err;
+        goto fail;
+      }
+      continue;
+    }
+
+    column = parser_table_column[l.lexeme.kind];
+    if (column < 0) {
+      env->err = parser_err(&l, error_internal_lexer);
+      goto fail;
+    }
+    tbi = parser_parsing_table[item.pkind][column];
+
+    switch (tbi) {
+      case tbi_null:
+        env->err = parser_err(&l, error_unexpected_lexeme);
+        goto fail;
+      case tbi_empty:
+        *item.dest = NULL;
+        continue;
+      case tbi_eelist:
+        cell = env_new_pair(env, NULL, NULL);
+        if (cell == NULL) {
+          goto fail_range;
+        }
+        *item.dest = cell;
+        if (parser_push_prod(env, pk_exprlist, dt_cdr_ref(cell)) == false ||
+            parser_push_prod(env, pk_expr, dt_car_ref(cell)) == false) {
+          goto fail_range;
+        }
+        continue;
+      case tbi_list:
+        if (parser_push_term(env, lk_right_parens) == false ||
+            parser_push_prod(env, pk_exprlist, item.dest) == false) {
+          goto fail_range;
+        }
+        break;
+      case tbi_qexpr:
+        dest = parser_new_quote(env, item.dest);
+        if (dest == NULL || parser_push_prod(env, pk_expr, dest) == false) {
+          goto fail_range;
+        }
+        break;
+      case tbi_nil:
+        *item.dest = NULL;
+        break;
+      default:
+        cell = parser_new_atom(env, &l, tbi);
+        if (cell == NULL) {
+          goto fail_range;
+        }
+        *item.dest = cell;
+        break;
+    }
+
+    /* every production except eelist and empty consumes a lexeme */
+    if (lex_next(&l) == false) {
+      env->err = l.err;
+      goto fail;
+    }
+  }
+
+  if (l.lexeme.kind != lk_eof) {
+    env->err = parser_err(&l, error_unexpected_lexeme);
+    goto fail;
+  }
+  return true;
+
+fail_range:
+  env->err.range.begin = l.lexeme.begin;
+  env->err.range.end = l.lexeme.end;
+fail:
+  while (sf_used(env->stack) > base) {
+    sf_free(env->stack);
+  }
+  return false;
+}
+
+/*
+ * -------------------------------------
+ * |      ###BUILTIN FUNCTIONS###      |
+ * -------------------------------------
+ */
+
+bool bi_arity(environment* env, size_t argc, size_t min, size_t max) {
+  if (argc < min || argc > max) {
+    env_set_err(env, error_arity);
+    return false;
+  }
+  return true;
+}
+
+bool bi_is_num(const datum* d) {
+  return d != NULL && (dt_tag(d) == EXACT_NUM || dt_tag(d) == INEXACT_NUM);
+}
+
+double bi_inexact(const datum* d) {
+  if (dt_tag(d) == EXACT_NUM) {
+    return (double)dt_exact(d);
+  }
+  return dt_inexact(d);
+}
+
+bool bi_check_nums(environment* env, datum** args, size_t argc, bool* exact) {
+  size_t i;
+  *exact = true;
+  for (i = 0; i < argc; i++) {
+    if (bi_is_num(args[i]) == false) {
+      env_set_err(env, error_contract_violation);
+      return false;
+    }
+    if (dt_tag(args[i]) == INEXACT_NUM) {
+      *exact = false;
+    }
+  }
+  return true;
+}
+
+enum bi_arith_op {bo_add, bo_sub, bo_mul};
+
+/* exact arithmetic wraps around instead of invoking undefined behaviour */
+bool bi_arith(environment* env, datum** args, size_t argc, datum** out, enum bi_arith_op op) {
+  uint64_t exact = op == bo_mul ? 1 : 0;
+  double inexact = op == bo_mul ? 1 : 0;
+  bool is_exact;
+  size_t i = 0;
+
+  if (bi_check_nums(env, args, argc, &is_exact) == false) {
+    return false;
+  }
+  if (op == bo_sub) {
+    if (bi_arity(env, argc, 1, SIZE_MAX) == false) {
+      return false;
+    }
+    if (argc > 1) {
+      exact = is_exact ? (uint64_t)dt_exact(args[0]) : 0;
+      inexact = bi_inexact(args[0]);
+      i = 1;
+    }
+  }
+
+  for (; i < argc; i++) {
+    if (is_exact) {
+      switch (op) {
+        case bo_add: exact += (uint64_t)dt_exact(args[i]); break;
+        case bo_sub: exact -= (uint64_t)dt_exact(args[i]); break;
+        case bo_mul: exact *= (uint64_t)dt_exact(args[i]); break;
+      }
+    } else {
+      switch (op) {
+        case bo_add: inexact += bi_inexact(args[i]); break;
+        case bo_sub: inexact -= bi_inexact(args[i]); break;
+        case bo_mul: inexact *= bi_inexact(args[i]); break;
+      }
+    }
+  }
+
+  if (is_exact) {
+    *out = env_new_exact(env, (int64_t)exact);
+  } else {
+    *out = env_new_inexact(env, inexact);
+  }
+  return *out != NULL;
+}
+
+bool bi_add(environment* env, datum** args, size_t argc, datum** out) {
+  return bi_arith(env, args, argc, out, bo_add);
+}
+
+bool bi_sub(environment* env, datum** args, size_t argc, datum** out) {
+  return bi_arith(env, args, argc, out, bo_sub);
+}
+
+bool bi_mul(environment* env, datum** args, size_t argc, datum** out) {
+  return bi_arith(env, args, argc, out, bo_mul);
+}
+
+/* exact division stays exact only if there's no remainder */
+bool bi_div(environment* env, datum** args, size_t argc, datum** out) {
+  bool is_exact;
+  int64_t a, b;
+  if (bi_arity(env, argc, 2, 2) == false ||
+      bi_check_nums(env, args, argc, &is_exact) == false) {
+    return false;
+  }
+  if (is_exact) {
+    a = dt_exact(args[0]);
+    b = dt_exact(args[1]);
+    if (b == 0 || (a == INT64_MIN && b == -1)) {
+      env_set_err(env, error_contract_violation);
+      return false;
+    }
+    if (a % b == 0) {
+      *out = env_new_exact(env, a / b);
+      return *out != NULL;
+    }
+  }
+  *out = env_new_inexact(env, bi_inexact(args[0]) / bi_inexact(args[1]));
+  return *out != NULL;
+}
+
+enum bi_cmp_op {bo_lt, bo_gt, bo_eq, bo_le, bo_ge};
+
+bool bi_cmp(environment* env, datum** args, size_t argc, datum** out, enum bi_cmp_op op) {
+  bool is_exact, res = true;
+  double a, b;
+  size_t i;
+  if (bi_arity(env, argc, 1, SIZE_MAX) == false ||
+      bi_check_nums(env, args, argc, &is_exact) == false) {
+    return false;
+  }
+  for (i = 1; i < argc && res; i++) {
+    if (dt_tag(args[i-1]) == EXACT_NUM && dt_tag(args[i]) == EXACT_NUM) {
+      a = 0; b = 0;
+      if (dt_exact(args[i-1]) < dt_exact(args[i])) {
+        b = 1;
+      } else if (dt_exact(args[i-1]) > dt_exact(args[i])) {
+        a = 1;
+      }
+    } else {
+      a = bi_inexact(args[i-1]);
+      b = bi_inexact(args[i]);
+    }
+    switch (op) {
+      case bo_lt: res = a < b; break;
+      case bo_gt: res = a > b; break;
+      case bo_eq: res = a == b; break;
+      case bo_le: res = a <= b; break;
+      case bo_ge: res = a >= b; break;
+    }
+  }
+  *out = env_new_bool(env, res);
+  return *out != NULL;
+}
+
+bool bi_lt(environment* env, datum** args, size_t argc, datum** out) {
+  return bi_cmp(env, args, argc, out, bo_lt);
+}
+
+bool bi_gt(environment* env, datum** args, size_t argc, datum** out) {
+  return bi_cmp(env, args, argc, out, bo_gt);
+}
+
+bool bi_num_eq(environment* env, datum** args, size_t argc, datum** out) {
+  return bi_cmp(env, args, argc, out, bo_eq);
+}
+
+bool bi_le(environment* env, datum** args, size_t argc, datum** out) {
+  return bi_cmp(env, args, argc, out, bo_le);
+}
+
+bool bi_ge(environment* env, datum** args, size_t argc, datum** out) {
+  return bi_cmp(env, args, argc, out, bo_ge);
+}
+
+bool bi_car(environment* env, datum** args, size_t argc, datum** out) {
+  if (bi_arity(env, argc, 1, 1) == false) {
+    return false;
+  }
+  if (dt_is_pair(args[0]) == false) {
+    env_set_err(env, error_contract_violation);
+    return false;
+  }
+  *out = dt_car(args[0]);
+  return true;
+}
+
+bool bi_cdr(environment* env, datum** args, size_t argc, datum** out) {
+  if (bi_arity(env, argc, 1, 1) == false) {
+    return false;
+  }
+  if (dt_is_pair(args[0]) == false) {
+    env_set_err(env, error_contract_violation);
+    return false;
+  }
+  *out = dt_cdr(args[0]);
+  return true;
+}
+
+bool bi_cons(environment* env, datum** args, size_t argc, datum** out) {
+  if (bi_arity(env, argc, 2, 2) == false) {
+    return false;
+  }
+  *out = env_new_pair(env, args[0], args[1]);
+  return *out != NULL;
+}
+
+bool bi_list(environment* env, datum** args, size_t argc, datum** out) {
+  datum* list = NULL;
+  while (argc > 0) {
+    argc--;
+    list = env_new_pair(env, args[argc], list);
+    if (list == NULL) {
+      return false;
+    }
+  }
+  *out = list;
+  return true;
+}
+
+bool bi_set_car(environment* env, datum** args, size_t argc, datum** out) {
+  if (bi_arity(env, argc, 2, 2) == false) {
+    return false;
+  }
+  if (dt_is_pair(args[0]) == false || env_in_rom(env, args[0])) {
+    env_set_err(env, error_contract_violation);
+    return false;
+  }
+  env_set_car(env, args[0], args[1]);
+  *out = NULL;
+  return true;
+}
+
+bool bi_set_cdr(environment* env, datum** args, size_t argc, datum** out) {
+  if (bi_arity(env, argc, 2, 2) == false) {
+    return false;
+  }
+  if (dt_is_pair(args[0]) == false || env_in_rom(env, args[0])) {
+    env_set_err(env, error_contract_violation);
+    return false;
+  }
+  env_set_cdr(env, args[0], args[1]);
+  *out = NULL;
+  return true;
+}
+
+bool bi_is_null(environment* env, datum** args, size_t argc, datum** out) {
+  if (bi_arity(env, argc, 1, 1) == false) {
+    return false;
+  }
+  *out = env_new_bool(env, args[0] == NULL);
+  return *out != NULL;
+}
+
+bool bi_is_pair(environment* env, datum** args, size_t argc, datum** out) {
+  if (bi_arity(env, argc, 1, 1) == false) {
+    return false;
+  }
+  *out = env_new_bool(env, dt_is_pair(args[0]));
+  return *out != NULL;
+}
+
+bool bi_not(environment* env, datum** args, size_t argc, datum** out) {
+  if (bi_arity(env, argc, 1, 1) == false) {
+    return false;
+  }
+  *out = env_new_bool(env, !dt_truthy(args[0]));
+  return *out != NULL;
+}
+
+/* numbers and booleans are compared by value, everything else by identity */
+bool bi_is_eq(environment* env, datum** args, size_t argc, datum** out) {
+  datum* a; datum* b;
+  bool res;
+  if (bi_arity(env, argc, 2, 2) == false) {
+    return false;
+  }
+  a = args[0];
+  b = args[1];
+  if (a == b) {
+    res = true;
+  } else if (a == NULL || b == NULL || dt_tag(a) != dt_tag(b)) {
+    res = false;
+  } else {
+    switch (dt_tag(a)) {
+      case EXACT_NUM: res = dt_exact(a) == dt_exact(b); break;
+      case INEXACT_NUM: res = dt_inexact(a) == dt_inexact(b); break;
+      case BOOL: res = dt_bool(a) == dt_bool(b); break;
+      default: res = false; break;
+    }
+  }
+  *out = env_new_bool(env, res);
+  return *out != NULL;
+}
+
+/* the id of a task is its slot and the generation of the slot, so
+ * the id of a task that was collected never names a later one
+ */
+int64_t task_id(const scheduler* s, size_t i) {
+  return (int64_t)((uint64_t)s->tasks[i].generation << 32 | i);
+}
+
+/* the task with 'id' that has not been collected, or NULL */
+task* task_find(scheduler* s, int64_t id) {
+  uint64_t i = (uint64_t)id & 0xffffffff;
+  if (id < 0 || i >= s->ntasks || s->tasks[i].state == ts_free ||
+      s->tasks[i].generation != (uint64_t)id >> 32) {
+    return NULL;
+  }
+  return &s->tasks[i];
+}
+
+/* the task running the builtin, or NULL if it was not called by the
+ * evaluator from a task
+ */
+task* bi_task(environment* env) {
+  if (env->sched.current == SCHED_NONE || env->m.state != st_return) {
+    env_set_err(env, error_contract_violation);
+    return NULL;
+  }
+  return &env->sched.tasks[env->sched.current];
+}
+
+/* (spawn proc) runs proc without arguments in a new task, returns its id */
+bool bi_spawn(environment* env, datum** args, size_t argc, datum** out) {
+  scheduler* s = &env->sched;
+  datum** proc;
+  task* t;
+  size_t i;
+
+  if (bi_arity(env, argc, 1, 1) == false) {
+    return false;
+  }
+  for (i = 0; i < s->ntasks; i++) {
+    if (s->tasks[i].state == ts_free) {
+      break;
+    }
+  }
+  if (i == s->ntasks) {
+    env_set_err(env, error_stack_exhausted);
+    return false;
+  }
+  t = &s->tasks[i];
+  sf_free_all(t->m.cont);
+  sf_free_all(t->m.values);
+  proc = (datum**)sf_alloc(t->m.values);
+  if (proc == NULL) {
+    env_set_err(env, error_stack_exhausted);
+    return false;
+  }
+  *proc = args[0];
+  *out = env_new_exact(env, task_id(s, i));
+  if (*out == NULL) {
+    return false;
+  }
+  t->m.state = st_apply;
+  t->m.expr = NULL;
+  t->m.frame = NULL;
+  t->m.val = NULL;
+  t->m.base = 0;
+  t->m.args = 0;
+  t->fuel = env->quota.fuel;
+  t->state = ts_ready;
+  t->receiving = false;
+  t->inbox = NULL;
+  t->last = NULL;
+  t->result = NULL;
+  t->failed = false;
+  return true;
+}
+
+/* (send id msg) appends msg to the inbox of a task, it is not copied */
+bool bi_send(environment* env, datum** args, size_t argc, datum** out) {
+  scheduler* s = &env->sched;
+  datum* cell;
+  task* t;
+
+  if (bi_arity(env, argc, 2, 2) == false) {
+    return false;
+  }
+  if (args[0] == NULL || dt_tag(args[0]) != EXACT_NUM ||
+      (t = task_find(s, dt_exact(args[0]))) == NULL || t->state == ts_done) {
+    env_set_err(env, error_contract_violation);
+    return false;
+  }
+  cell = env_new_pair(env, args[1], NULL);
+  if (cell == NULL) {
+    return false;
+  }
+  if (t->last == NULL) {
+    t->inbox = cell;
+  } else {
+    env_set_cdr(env, t->last, cell);
+  }
+  t->last = cell;
+  if (t->state == ts_waiting) {
+    t->state = ts_ready;
+  }
+  *out = NULL;
+  return true;
+}
+
+/* the oldest message of 't', its inbox must not be empty */
+datum* bi_take_message(task* t) {
+  datum* msg = dt_car(t->inbox);
+  t->inbox = dt_cdr(t->inbox);
+  if (t->inbox == NULL) {
+    t->last = NULL;
+  }
+  return msg;
+}
+
+/* (receive) returns the oldest message, the task waits for one if
+ * there is none
+ */
+bool bi_receive(environment* env, datum** args, size_t argc, datum** out) {
+  task* t;
+  (void)args;
+  if (bi_arity(env, argc, 0, 0) == false || (t = bi_task(env)) == NULL) {
+    return false;
+  }
+  if (t->inbox != NULL) {
+    *out = bi_take_message(t);
+    return true;
+  }
+  t->receiving = true;
+  t->state = ts_waiting;
+  env->m.state = st_wait;
+  *out = NULL;
+  return true;
+}
+
+/* (yield) lets the other tasks run */
+bool bi_yield(environment* env, datum** args, size_t argc, datum** out) {
+  (void)args;
+  if (bi_arity(env, argc, 0, 0) == false || bi_task(env) == NULL) {
+    return false;
+  }
+  env->m.state = st_wait;
+  *out = NULL;
+  return true;
+}
+
+/* (self) returns the id of the running task */
+bool bi_self(environment* env, datum** args, size_t argc, datum** out) {
+  (void)args;
+  if (bi_arity(env, argc, 0, 0) == false || bi_task(env) == NULL) {
+    return false;
+  }
+  *out = env_new_exact(env, task_id(&env->sched, env->sched.current));
+  return *out != NULL;
+}
+
+typedef struct {
+  const char* name;
+  cproc proc;
+} builtin;
+
+const builtin builtins[] = {
+  {"+", bi_add},
+  {"-", bi_sub},
+  {"*", bi_mul},
+  {"/", bi_div},
+  {"<", bi_lt},
+  {">", bi_gt},
+  {"=", bi_num_eq},
+  {"<=", bi_le},
+  {">=", bi_ge},
+  {"car", bi_car},
+  {"cdr", bi_cdr},
+  {"cons", bi_cons},
+  {"list", bi_list},
+  {"set-car!", bi_set_car},
+  {"set-cdr!", bi_set_cdr},
+  {"null?", bi_is_null},
+  {"pair?", bi_is_pair},
+  {"not", bi_not},
+  {"eq?", bi_is_eq},
+  {"spawn", bi_spawn},
+  {"send", bi_send},
+  {"receive", bi_receive},
+  {"yield", bi_yield},
+  {"self", bi_self}
+};
+
+#define BUILTIN_COUNT (sizeof(builtins)/sizeof(builtin))
+
+bool bi_define_all(environment* env) {
+  datum* sym; datum* proc;
+  size_t i;
+  for (i = 0; i < BUILTIN_COUNT; i++) {
+    sym = env_intern(env, builtins[i].name, strlen(builtins[i].name));
+    if (sym == NULL) {
+      return false;
+    }
+    proc = env_new_cproc(env, builtins[i].proc);
+    if (proc == NULL) {
+      return false;
+    }
+    if (env_define(env, NULL, sym, proc) == false) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * -------------------------------------
+ * |         ###EVALUATOR###           |
+ * -------------------------------------
+ */
+
+/* the (params . body) a compiled lambda was made from, see the VM */
+datum* vm_source(const environment* env, const datum* code);
+
+enum eval_special eval_special_form(const environment* env, const datum* op) {
+  int sp;
+  if (dt_is_symbol(op) == false) {
+    return sp_none;
+  }
+  for (sp = sp_quote; sp < SP_COUNT; sp++) {
+    if (op == env->specials[sp]) {
+      return (enum eval_special)sp;
+    }
+  }
+  return sp_none;
+}
+
+/* returns the number of elements of a proper list, or -1 otherwise */
+int eval_length(const datum* list) {
+  int n = 0;
+  while (dt_is_pair(list)) {
+    n++;
+    list = dt_cdr(list);
+  }
+  return list == NULL ? n : -1;
+}
+
+bool eval_push(environment* env, enum eval_cont_kind kind, datum* exprs) {
+  eval_cont* k;
+  if (sf_used(env->m.cont)/sizeof(eval_cont) >= env->quota.depth) {
+    env_set_err(env, error_quota_exceeded);
+    return false;
+  }
+  k = (eval_cont*)sf_alloc(env->m.cont);
+  if (k == NULL) {
+    env_set_err(env, error_stack_exhausted);
+    return false;
+  }
+  k->kind = kind;
+  k->exprs = exprs;
+  k->frame = env->m.frame;
+  k->values = sf_used(env->m.values);
+  return true;
+}
+
+bool eval_push_value(environment* env, datum* val) {
+  datum** slot = (datum**)sf_alloc(env->m.values);
+  if (slot == NULL) {
+    env_set_err(env, error_stack_exhausted);
+    return false;
+  }
+  *slot = val;
+  return true;
+}
+
+/* evaluates the expressions of 'body' in sequence, the last one in
+ * tail position. 'body' must be a proper list.
+ */
+bool eval_body(environment* env, datum* body) {
+  machine* m = &env->m;
+  if (body == NULL) {
+    m->val = NULL;
+    m->state = st_return;
+    return true;
+  }
+  if (dt_cdr(body) != NULL && eval_push(env, ek_begin, dt_cdr(body)) == false) {
+    return false;
+  }
+  m->expr = dt_car(body);
+  m->state = st_eval;
+  return true;
+}
+
+bool eval_special(environment* env, enum eval_special sp, datum* expr) {
+  machine* m = &env->m;
+  datum* target;
+  int len = eval_length(expr);
+
+  switch (sp) {
+    case sp_quote:
+      if (len != 2) {
+        break;
+      }
+      m->val = dt_car(dt_cdr(expr));
+      m->state = st_return;
+      return true;
+    case sp_if:
+      if (len != 3 && len != 4) {
+        break;
+      }
+      if (eval_push(env, ek_if, dt_cdr(dt_cdr(expr))) == false) {
+        return false;
+      }
+      m->expr = dt_car(dt_cdr(expr));
+      return true;
+    case sp_set:
+    case sp_define:
+      if (len < 3) {
+        break;
+      }
+      target = dt_car(dt_cdr(expr));
+      if (sp == sp_define && dt_is_pair(target) && dt_is_symbol(dt_car(target))) {
+        /* (define (name . params) body...) */
+        m->val = env_new_pair(env, dt_cdr(target), dt_cdr(dt_cdr(expr)));
+        if (m->val == NULL) {
+          return false;
+        }
+        m->val = env_new_lambda(env, m->val, m->frame);
+        if (m->val == NULL ||
+            env_define(env, m->frame, dt_car(target), m->val) == false) {
+          return false;
+        }
+        m->val = dt_car(target);
+        m->state = st_return;
+        return true;
+      }
+      if (len != 3 || dt_is_symbol(target) == false) {
+        break;
+      }
+      if (eval_push(env, sp == sp_define ? ek_define : ek_set, target) == false) {
+        return false;
+      }
+      m->expr = dt_car(dt_cdr(dt_cdr(expr)));
+      return true;
+    case sp_lambda:
+      if (len < 3) {
+        break;
+      }
+      m->val = env_new_lambda(env, dt_cdr(expr), m->frame);
+      if (m->val == NULL) {
+        return false;
+      }
+      m->state = st_return;
+      return true;
+    case sp_begin:
+      if (len < 1) {
+        break;
+      }
+      return eval_body(env, dt_cdr(expr));
+    case sp_none:
+    case SP_COUNT:
+      break;
+  }
+  env_set_err(env, error_bad_form);
+  return false;
+}
+
+bool eval_expr(environment* env) {
+  machine* m = &env->m;
+  datum* expr = m->expr;
+  datum* b;
+  enum eval_special sp;
+
+  if (expr == NULL) {
+    m->val = NULL;
+    m->state = st_return;
+    return true;
+  }
+
+  switch (dt_tag(expr)) {
+    case SYMBOL:
+      b = env_lookup(env, m->frame, expr);
+      if (b == NULL) {
+        env_set_err(env, error_unbound_symbol);
+        return false;
+      }
+      m->val = dt_cdr(b);
+      m->state = st_return;
+      return true;
+    case PAIR:
+      break;
+    default:
+      m->val = expr;
+      m->state = st_return;
+      return true;
+  }
+
+  sp = eval_special_form(env, dt_car(expr));
+  if (sp != sp_none) {
+    return eval_special(env, sp, expr);
+  }
+
+  /* application: the operator is evaluated first, then every argument,
+   * all of them end up in the value stack
+   */
+  if (eval_push(env, ek_args, dt_cdr(expr)) == false) {
+    return false;
+  }
+  m->expr = dt_car(expr);
+  return true;
+}
+
+bool eval_return(environment* env) {
+  machine* m = &env->m;
+  eval_cont* k;
+  datum* b;
+
+  if (sf_used(m->cont) == m->base) {
+    m->state = st_done;
+    return true;
+  }
+
+  k = (eval_cont*)sf_top(m->cont);
+  m->frame = k->frame;
+  switch (k->kind) {
+    case ek_if:
+      b = k->exprs;
+      sf_free(m->cont);
+      if (dt_truthy(m->val) == false) {
+        b = dt_cdr(b);
+        if (b == NULL) {
+          m->val = NULL;
+          return true;
+        }
+      }
+      m->expr = dt_car(b);
+      m->state = st_eval;
+      return true;
+    case ek_begin:
+      m->expr = dt_car(k->exprs);
+      if (dt_cdr(k->exprs) == NULL) {
+        sf_free(m->cont);
+      } else {
+        k->exprs = dt_cdr(k->exprs);
+      }
+      m->state = st_eval;
+      return true;
+    case ek_define:
+      b = k->exprs;
+      sf_free(m->cont);
+      if (env_define(env, m->frame, b, m->val) == false) {
+        return false;
+      }
+      m->val = b;
+      return true;
+    case ek_set:
+      b = env_lookup(env, m->frame, k->exprs);
+      sf_free(m->cont);
+      if (b == NULL) {
+        env_set_err(env, error_unbound_symbol);
+        return false;
+      }
+      env_set_cdr(env, b, m->val);
+      m->val = NULL;
+      return true;
+    case ek_args:
+      if (eval_push_value(env, m->val) == false) {
+        return false;
+      }
+      if (k->exprs == NULL) {
+        m->args = k->values;
+        sf_free(m->cont);
+        m->state = st_apply;
+        return true;
+      }
+      if (dt_is_pair(k->exprs) == false) {
+        env_set_err(env, error_bad_form);
+        return false;
+      }
+      m->expr = dt_car(k->exprs);
+      k->exprs = dt_cdr(k->exprs);
+      m->state = st_eval;
+      return true;
+  }
+  env_set_err(env, error_internal);
+  return false;
+}
+
+/* binds the arguments to the parameters of a lambda in a new frame,
+ * a symbol (or dotted tail) in the parameters gets the rest as a list
+ */
+bool eval_bind(environment* env, datum* params, datum** args, size_t argc, datum* parent) {
+  machine* m = &env->m;
+  datum* bindings = NULL;
+  datum* rest; datum* b;
+  size_t i = 0;
+
+  while (dt_is_pair(params)) {
+    if (i >= argc || dt_is_symbol(dt_car(params)) == false) {
+      env_set_err(env, i >= argc ? error_arity : error_bad_form);
+      return false;
+    }
+    b = env_new_pair(env, dt_car(params), args[i]);
+    if (b == NULL || (bindings = env_new_pair(env, b, bindings)) == NULL) {
+      return false;
+    }
+    params = dt_cdr(params);
+    i++;
+  }
+
+  if (params != NULL) {
+    if (dt_is_symbol(params) == false) {
+      env_set_err(env, error_bad_form);
+      return false;
+    }
+    rest = NULL;
+    while (argc > i) {
+      argc--;
+      rest = env_new_pair(env, args[argc], rest);
+      if (rest == NULL) {
+        return false;
+      }
+    }
+    b = env_new_pair(env, params, rest);
+    if (b == NULL || (bindings = env_new_pair(env, b, bindings)) == NULL) {
+      return false;
+    }
+  } else if (i != argc) {
+    env_set_err(env, error_arity);
+    return false;
+  }
+
+  m->frame = env_new_pair(env, bindings, parent);
+  return m->frame != NULL;
+}
+
+bool eval_apply(environment* env) {
+  machine* m = &env->m;
+  datum** slots = (datum**)(m->values->buff + m->args);
+  size_t argc = (sf_used(m->values) - m->args)/sizeof(datum*) - 1;
+  datum* proc = slots[0];
+  datum* code;
+  bool ok;
+
+  if (proc == NULL) {
+    env_set_err(env, error_not_applicable);
+    return false;
+  }
+
+  switch (dt_tag(proc)) {
+    case C_PROC:
+      /* unless the builtin suspends the task, see TASKS */
+      m->state = st_return;
+      ok = dt_cproc(proc)(env, slots+1, argc, &m->val);
+      sf_free_to(m->values, m->args);
+      return ok;
+    case LAMBDA:
+      code = dt_lambda(proc)->code;
+      if (dt_tag(code) == CODE) {
+        /* compiled lambdas are interpreted from their source */
+        code = vm_source(env, code);
+      }
+      ok = eval_bind(env, dt_car(code), slots+1, argc, dt_lambda(proc)->env);
+      sf_free_to(m->values, m->args);
+      if (ok == false) {
+        return false;
+      }
+      /* the body of a lambda is always a proper list, checked when it was created */
+      return eval_body(env, dt_cdr(code));
+    default:
+      break;
+  }
+  env_set_err(env, error_not_applicable);
+  return false;
+}
+
+enum eval_RES {eval_OK, eval_SUSPENDED, eval_ERR};
+
+/* runs the machine until the current evaluation is done, the result
+ * is left in env->m.val. it stops after evaluating 'steps' expressions
+ * and can be resumed by calling it again, since all of its state is in
+ * env->m. the collector may run in between.
+ */
+enum eval_RES eval_resume(environment* env, size_t steps) {
+  machine* m = &env->m;
+  bool ok = true;
+
+  while (ok) {
+    switch (m->state) {
+      case st_eval:
+        if (steps == 0) {
+          return eval_SUSPENDED;
+        }
+        steps--;
+        gc_safe_point(env);
+        ok = env_burn(env) && eval_expr(env);
+        break;
+      case st_return:
+        ok = eval_return(env);
+        break;
+      case st_apply:
+        ok = eval_apply(env);
+        break;
+      case st_wait:
+        return eval_SUSPENDED;
+      case st_done:
+        return eval_OK;
+    }
+  }
+
+  sf_free_to(m->cont, m->base);
+  m->state = st_done;
+  return eval_ERR;
+}
+
+bool eval_run(environment* env) {
+  return eval_resume(env, SIZE_MAX) == eval_OK;
+}
+
+/* evaluates 'expr' in the global frame */
+bool eval(environment* env, datum* expr, datum** out) {
+  machine* m = &env->m;
+  size_t values = sf_used(m->values);
+  bool ok;
+
+  env_refuel(env);
+  m->base = sf_used(m->cont);
+  m->frame = NULL;
+  m->expr = expr;
+  m->state = st_eval;
+  ok = eval_run(env);
+  sf_free_to(m->values, values);
+  *out = m->val;
+  return ok;
+}
+
+/* prepares the evaluation of a parsed 'program' without running it */
+bool eval_start(environment* env, datum* program) {
+  machine* m = &env->m;
+  env_refuel(env);
+  m->base = sf_used(m->cont);
+  m->frame = NULL;
+  m->state = st_eval;
+  return eval_body(env, program);
+}
+
+/* evaluates the top level expressions of a parsed 'program',
+ * the value of the last one is written to 'out'
+ */
+bool eval_program(environment* env, datum* program, datum** out) {
+  machine* m = &env->m;
+  size_t values = sf_used(m->values);
+  bool ok;
+
+  *out = NULL;
+  if (eval_start(env, program) == false) {
+    return false;
+  }
+  ok = eval_run(env);
+  sf_free_to(m->values, values);
+  *out = m->val;
+  return ok;
+}
+
+/* parses and evaluates every top level expression in 'text',
+ * the value of the last one is written to 'out'.
+ * results are only kept alive until the next evaluation.
+ */
+bool eval_string(environment* env, const char* text, size_t size, datum** out) {
+  datum* program;
+
+  *out = NULL;
+  gc_safe_point(env);
+  if (parse(env, text, size, &program) == false) {
+    return false;
+  }
+  return eval_program(env, program, out);
+}
+
+/*
+ * -------------------------------------
+ * |            ###TASKS###            |
+ * -------------------------------------
+ */
+
+/* tasks are spawned by the builtin 'spawn' and run in turns by
+ * sched_run, each for at most a quantum of expressions. a task gives
+ * up its turn early by calling 'yield', or by calling 'receive' with
+ * an empty inbox, then it is not run again until a message arrives.
+ * switching tasks is swapping env->m, the stacks of each task are
+ * carved from the environment buffer when it is created.
+ */
+
+enum sched_RES {
+  sched_DONE,     /* the task returned a value */
+  sched_FAILED,   /* it stopped with an error */
+  sched_RUNNING,  /* it is ready or waiting */
+  sched_UNKNOWN   /* there is no task with the id, or it was collected */
+};
+
+/* runs up to 'turns' turns of 'quantum' expressions of the tasks that
+ * are ready, round robin. it returns sooner if none is ready, and
+ * returns how many are. it can be called while an evaluation is
+ * suspended, but not from a builtin.
+ */
+size_t sched_run(environment* env, size_t quantum, size_t turns) {
+  scheduler* s = &env->sched;
+  size_t fuel = env->fuel;
+  error err = env->err;
+  size_t idle = 0;
+  size_t ready = 0;
+  enum eval_RES res;
+  task* t;
+  size_t i;
+
+  if (s->current != SCHED_NONE) {
+    env_set_err(env, error_contract_violation);
+    return 0;
+  }
+  s->main = env->m;
+  while (turns > 0 && idle < s->ntasks) {
+    i = s->next;
+    s->next = (i + 1)%s->ntasks;
+    t = &s->tasks[i];
+    if (t->state != ts_ready) {
+      idle++;
+      continue;
+    }
+    idle = 0;
+    turns--;
+
+    s->current = i;
+    env->m = t->m;
+    env->fuel = t->fuel;
+    if (env->m.state == st_wait) {
+      /* back from 'yield' or 'receive' */
+      env->m.val = t->receiving ? bi_take_message(t) : NULL;
+      env->m.state = st_return;
+      t->receiving = false;
+    }
+    res = eval_resume(env, quantum);
+    t->m = env->m;
+    t->fuel = env->fuel;
+    s->current = SCHED_NONE;
+
+    if (res == eval_OK) {
+      t->state = ts_done;
+      t->result = env->m.val;
+    } else if (res == eval_ERR) {
+      t->state = ts_done;
+      t->result = NULL;
+      t->failed = true;
+      t->err = env->err;
+    }
+  }
+  env->m = s->main;
+  env->fuel = fuel;
+  env->err = err;
+  memset(&s->main, 0, sizeof(s->main));
+
+  for (i = 0; i < s->ntasks; i++) {
+    ready += s->tasks[i].state == ts_ready;
+  }
+  return ready;
+}
+
+/* if the task 'id' is done, frees its slot for another one and gives
+ * its value in 'result' or its error in 'err'. the value is no longer
+ * kept alive by the task, it must be used before allocating again.
+ */
+enum sched_RES sched_collect(environment* env, int64_t id, datum** result, error* err) {
+  task* t = task_find(&env->sched, id);
+
+  if (t == NULL) {
+    return sched_UNKNOWN;
+  }
+  if (t->state != ts_done) {
+    return sched_RUNNING;
+  }
+  t->state = ts_free;
+  t->generation = (t->generation + 1) & 0x7fffffff;
+  t->inbox = NULL;
+  t->last = NULL;
+  if (t->failed) {
+    *err = t->err;
+    return sched_FAILED;
+  }
+  *result = t->result;
+  return sched_DONE;
+}
+
+/*
+ * -------------------------------------
+ * |          ###COMPILER###           |
+ * -------------------------------------
+ */
+
+/* parsed code can also be compiled to bytecode and run by the vm
+ * below. every lambda becomes a function: a header followed by its
+ * instructions, placed right after the instruction that makes its
+ * closures. the header has the constant with the names of its locals
+ * (u16), the constant with its (params . body) (u16), the number of
+ * required params (u16) and whether the rest are collected (u8).
+ * operands are little endian, jumps only go forward and are relative
+ * to the end of the instruction.
+ *
+ * frames have the same shape as in the evaluator, so compiled and
+ * interpreted code can share them, but compiled code finds its locals
+ * by position: the params of a lambda and the names it defines are
+ * bound all at once when it is called.
+ */
+
+enum vm_op {
+  vo_const,    /* k     push consts[k]                              */
+  vo_nil,      /*       push nil                                    */
+  vo_lref,     /* d i   push local i of the frame d levels up       */
+  vo_lset,     /* d i   pop into local i of the frame d levels up   */
+  vo_gref,     /* k     push the global named by consts[k]          */
+  vo_gset,     /* k     pop into the global named by consts[k]      */
+  vo_gdef,     /* k     pop and define the global consts[k]         */
+  vo_pop,      /*       drop the top of the stack                   */
+  vo_jump,     /* o     skip o bytes                                */
+  vo_jumpf,    /* o     pop, skip o bytes if it is false            */
+  vo_closure,  /* k o   push a closure of consts[k], skip o bytes   */
+  vo_call,     /* n     call with n arguments                       */
+  vo_tailcall, /* n     call with n arguments, replacing this call  */
+  vo_return    /*       return the top of the stack                 */
+};
+
+#define VM_HEADER 7
+#define VM_U16(p) ((size_t)((p)[0] | (p)[1] << 8))
+
+enum cc_task_kind {
+  ck_expr,    /* compile 'expr'                                      */
+  ck_body,    /* compile the list 'expr' in sequence, pop first if n */
+  ck_args,    /* compile the arguments left in 'expr', then call n   */
+  ck_then,    /* the test of an if is done, 'expr' is (then [else])  */
+  ck_else,    /* the then branch is done, 'expr' is ([else])         */
+  ck_patch,   /* make the jump at n land here                        */
+  ck_define,  /* store the value in the variable 'expr' (define)     */
+  ck_set,     /* store the value in the variable 'expr' (set!)       */
+  ck_lambda   /* the body of the function after the jump at n is done */
+};
+
+typedef struct {
+  enum cc_task_kind kind;
+  datum* expr;
+  bool tail;
+  size_t n;
+} cc_task;
+
+typedef struct {
+  datum* names;  /* locals of the lambda, in frame order */
+  datum* last;   /* last pair of 'names' */
+} cc_scope;
+
+bool cc_exhausted(environment* env) {
+  env_set_err(env, error_code_exhausted);
+  return false;
+}
+
+bool cc_emit(environment* env, uint8_t byte) {
+  uint8_t* p = sf_alloc(env->vm.code);
+  if (p == NULL) {
+    return cc_exhausted(env);
+  }
+  *p = byte;
+  return true;
+}
+
+bool cc_emit16(environment* env, size_t v) {
+  if (v > UINT16_MAX) {
+    return cc_exhausted(env);
+  }
+  return cc_emit(env, (uint8_t)(v & 0xff)) && cc_emit(env, (uint8_t)(v >> 8));
+}
+
+size_t cc_here(const environment* env) {
+  return sf_used(env->vm.code);
+}
+
+/* adds 'd' to the constant pool, its index is written to 'k' */
+bool cc_const(environment* env, datum* d, size_t* k) {
+  datum** slot;
+  *k = sf_used(env->vm.consts)/sizeof(datum*);
+  slot = (datum**)sf_alloc(env->vm.consts);
+  if (slot == NULL || *k > UINT16_MAX) {
+    return cc_exhausted(env);
+  }
+  *slot = d;
+  return true;
+}
+
+/* the entry of the global 'sym' in this compile, or the empty one
+ * where it goes. there are never more globals than constants, so
+ * the table is at most half full.
+ */
+cc_global* cc_global_entry(environment* env, const datum* sym) {
+  vm_machine* vm = &env->vm;
+  size_t mask = vm->nglobals - 1;
+  size_t i = (size_t)((uintptr_t)sym >> 3)*2654435761u & mask;
+
+  while (vm->globals[i].stamp == vm->stamp && vm->globals[i].sym != sym) {
+    i = (i + 1) & mask;
+  }
+  return &vm->globals[i];
+}
+
+bool cc_emit_const(environment* env, enum vm_op op, datum* d) {
+  cc_global* g = NULL;
+  size_t k;
+
+  /* vm_global replaces the name in these slots with the binding, so
+   * the refs and sets of a global share one, and nothing else does
+   */
+  if (op == vo_gref || op == vo_gset) {
+    g = cc_global_entry(env, d);
+    if (g->stamp == env->vm.stamp) {
+      return cc_emit(env, (uint8_t)op) && cc_emit16(env, g->slot);
+    }
+  }
+  if (cc_const(env, d, &k) == false) {
+    return false;
+  }
+  if (g != NULL) {
+    g->sym = d;
+    g->stamp = env->vm.stamp;
+    g->slot = (uint16_t)k;
+  }
+  return cc_emit(env, (uint8_t)op) && cc_emit16(env, k);
+}
+
+/* emits a jump with an operand to be patched later, at 'at' */
+bool cc_emit_jump(environment* env, enum vm_op op, size_t* at) {
+  if (cc_emit(env, (uint8_t)op) == false) {
+    return false;
+  }
+  *at = cc_here(env);
+  return cc_emit16(env, 0);
+}
+
+/* makes the jump whose operand is at 'at' land here */
+bool cc_patch(environment* env, size_t at) {
+  size_t offset = cc_here(env) - (at + 2);
+  if (offset > UINT16_MAX) {
+    return cc_exhausted(env);
+  }
+  env->vm.code->buff[at] = (uint8_t)(offset & 0xff);
+  env->vm.code->buff[at+1] = (uint8_t)(offset >> 8);
+  return true;
+}
+
+bool cc_push(environment* env, enum cc_task_kind kind, datum* expr, bool tail, size_t n) {
+  cc_task* t = (cc_task*)sf_alloc(env->vm.tasks);
+  if (t == NULL) {
+    env_set_err(env, error_stack_exhausted);
+    return false;
+  }
+  t->kind = kind;
+  t->expr = expr;
+  t->tail = tail;
+  t->n = n;
+  return true;
+}
+
+/* appends 'sym' to the locals of 'scope', names that are
+ * defined are added only once
+ */
+bool cc_add_local(environment* env, cc_scope* scope, datum* sym, bool unique) {
+  datum* l;
+  if (unique) {
+    for (l = scope->names; l != NULL; l = dt_cdr(l)) {
+      if (dt_car(l) == sym) {
+        return true;
+      }
+    }
+  }
+  l = env_new_pair(env, sym, NULL);
+  if (l == NULL) {
+    return false;
+  }
+  if (scope->last == NULL) {
+    scope->names = l;
+  } else {
+    env_set_cdr(env, scope->last, l);
+  }
+  scope->last = l;
+  return true;
+}
+
+/* finds the local 'sym' in the lambdas being compiled,
+ * returns false if it can only be a global
+ */
+bool cc_resolve(const environment* env, const datum* sym, size_t* depth, size_t* index) {
+  const stack_f* scopes = env->vm.scopes;
+  size_t used = sf_used(scopes);
+  const datum* l;
+
+  *depth = 0;
+  while (used > 0) {
+    used -= sizeof(cc_scope);
+    *index = 0;
+    for (l = ((const cc_scope*)(scopes->buff + used))->names; l != NULL; l = dt_cdr(l)) {
+      if (dt_car(l) == sym) {
+        return true;
+      }
+      (*index)++;
+    }
+    (*depth)++;
+  }
+  return false;
+}
+
+bool cc_variable(environment* env, datum* sym, bool set) {
+  size_t depth, index;
+  if (cc_resolve(env, sym, &depth, &index)) {
+    return cc_emit(env, set ? vo_lset : vo_lref) &&
+           cc_emit16(env, depth) && cc_emit16(env, index);
+  }
+  return cc_emit_const(env, set ? vo_gset : vo_gref, sym);
+}
+
+/* returns the name defined by 'form', or NULL if it is not a define */
+datum* cc_defined_name(const environment* env, const datum* form) {
+  datum* target;
+  if (dt_is_pair(form) == false || dt_car(form) != env->specials[sp_define] ||
+      dt_is_pair(dt_cdr(form)) == false) {
+    return NULL;
+  }
+  target = dt_car(dt_cdr(form));
+  if (dt_is_pair(target)) {
+    target = dt_car(target);
+  }
+  return dt_is_symbol(target) ? target : NULL;
+}
+
+/* emits the closure instruction and the header of the function,
+ * its body is compiled next. 'source' is (params . body).
+ */
+bool cc_lambda(environment* env, datum* source) {
+  datum* params = dt_car(source);
+  datum* form; datum* name;
+  cc_scope* scope;
+  size_t closure, names, src, at, nparams = 0;
+  bool rest = false;
+
+  if (eval_length(dt_cdr(source)) < 1) {
+    env_set_err(env, error_bad_form);
+    return false;
+  }
+  /* the code and the names are only known at the end, see ck_lambda */
+  if (cc_const(env, NULL, &closure) == false ||
+      cc_emit(env, vo_closure) == false || cc_emit16(env, closure) == false) {
+    return false;
+  }
+  at = cc_here(env);
+  if (cc_emit16(env, 0) == false ||
+      cc_const(env, NULL, &names) == false ||
+      cc_const(env, source, &src) == false) {
+    return false;
+  }
+
+  scope = (cc_scope*)sf_alloc(env->vm.scopes);
+  if (scope == NULL) {
+    env_set_err(env, error_stack_exhausted);
+    return false;
+  }
+  scope->names = NULL;
+  scope->last = NULL;
+  while (dt_is_pair(params)) {
+    if (dt_is_symbol(dt_car(params)) == false) {
+      env_set_err(env, error_bad_form);
+      return false;
+    }
+    if (cc_add_local(env, scope, dt_car(params), false) == false) {
+      return false;
+    }
+    nparams++;
+    params = dt_cdr(params);
+  }
+  if (params != NULL) {
+    if (dt_is_symbol(params) == false) {
+      env_set_err(env, error_bad_form);
+      return false;
+    }
+    if (cc_add_local(env, scope, params, false) == false) {
+      return false;
+    }
+    rest = true;
+  }
+  /* names defined at the top of the body are known from the start,
+   * so they can be referenced before their definition
+   */
+  for (form = dt_cdr(source); form != NULL; form = dt_cdr(form)) {
+    name = cc_defined_name(env, dt_car(form));
+    if (name != NULL && cc_add_local(env, scope, name, true) == false) {
+      return false;
+    }
+  }
+
+  return cc_emit16(env, names) && cc_emit16(env, src) &&
+         cc_emit16(env, nparams) && cc_emit(env, rest ? 1 : 0) &&
+         cc_push(env, ck_lambda, NULL, false, at) &&
+         cc_push(env, ck_body, dt_cdr(source), true, 0);
+}
+
+bool cc_special(environment* env, enum eval_special sp, datum* expr, bool tail) {
+  datum* target;
+  datum* source;
+  int len = eval_length(expr);
+
+  switch (sp) {
+    case sp_quote:
+      if (len != 2) {
+        break;
+      }
+      if (dt_car(dt_cdr(expr)) == NULL) {
+        return cc_emit(env, vo_nil);
+      }
+      return cc_emit_const(env, vo_const, dt_car(dt_cdr(expr)));
+    case sp_if:
+      if (len != 3 && len != 4) {
+        break;
+      }
+      return cc_push(env, ck_then, dt_cdr(dt_cdr(expr)), tail, 0) &&
+             cc_push(env, ck_expr, dt_car(dt_cdr(expr)), false, 0);
+    case sp_set:
+    case sp_define:
+      if (len < 3) {
+        break;
+      }
+      target = dt_car(dt_cdr(expr));
+      if (sp == sp_define && dt_is_pair(target) && dt_is_symbol(dt_car(target))) {
+        /* (define (name . params) body...) */
+        source = env_new_pair(env, dt_cdr(target), dt_cdr(dt_cdr(expr)));
+        return source != NULL &&
+               cc_push(env, ck_define, dt_car(target), false, 0) &&
+               cc_lambda(env, source);
+      }
+      if (len != 3 || dt_is_symbol(target) == false) {
+        break;
+      }
+      return cc_push(env, sp == sp_define ? ck_define : ck_set, target, false, 0) &&
+             cc_push(env, ck_expr, dt_car(dt_cdr(dt_cdr(expr))), false, 0);
+    case sp_lambda:
+      if (len < 3) {
+        break;
+      }
+      return cc_lambda(env, dt_cdr(expr));
+    case sp_begin:
+      if (len < 1) {
+        break;
+      }
+      return cc_push(env, ck_body, dt_cdr(expr), tail, 0);
+    case sp_none:
+    case SP_COUNT:
+      break;
+  }
+  env_set_err(env, error_bad_form);
+  return false;
+}
+
+bool cc_expr(environment* env, datum* expr, bool tail) {
+  enum eval_special sp;
+
+  if (expr == NULL) {
+    return cc_emit(env, vo_nil);
+  }
+  switch (dt_tag(expr)) {
+    case SYMBOL:
+      return cc_variable(env, expr, false);
+    case PAIR:
+      break;
+    default:
+      return cc_emit_const(env, vo_const, expr);
+  }
+
+  sp = eval_special_form(env, dt_car(expr));
+  if (sp != sp_none) {
+    return cc_special(env, sp, expr, tail);
+  }
+  if (eval_length(expr) < 0) {
+    env_set_err(env, error_bad_form);
+    return false;
+  }
+  /* the operator first, then every argument, then the call */
+  return cc_push(env, ck_args, dt_cdr(expr), tail, 0) &&
+         cc_push(env, ck_expr, dt_car(expr), false, 0);
+}
+
+/* the value on the stack is stored in 'sym', the define
+ * evaluates to the symbol and the set! to nil
+ */
+bool cc_store(environment* env, datum* sym, bool define) {
+  if (define == false) {
+    return cc_variable(env, sym, true) && cc_emit(env, vo_nil);
+  }
+  if (sf_empty(env->vm.scopes)) {
+    return cc_emit_const(env, vo_gdef, sym) && cc_emit_const(env, vo_const, sym);
+  }
+  /* defines that were not at the top of the body are added late */
+  return cc_add_local(env, (cc_scope*)sf_top(env->vm.scopes), sym, true) &&
+         cc_variable(env, sym, true) && cc_emit_const(env, vo_const, sym);
+}
+
+/* the body of the lambda is done, its closure instruction
+ * gets its code and the jump over the function is patched
+ */
+bool cc_lambda_end(environment* env, size_t at) {
+  uint8_t* code = env->vm.code->buff;
+  datum** consts = (datum**)env->vm.consts->buff;
+  cc_scope* scope = (cc_scope*)sf_top(env->vm.scopes);
+  datum* d;
+
+  if (cc_emit(env, vo_return) == false) {
+    return false;
+  }
+  d = env_new_code(env, code + at + 2);
+  if (d == NULL) {
+    return false;
+  }
+  consts[VM_U16(code + at - 2)] = d;
+  consts[VM_U16(code + at + 2)] = scope->names;
+  sf_free(env->vm.scopes);
+  return cc_patch(env, at);
+}
+
+bool cc_run_task(environment* env, const cc_task* t) {
+  size_t at;
+
+  switch (t->kind) {
+    case ck_expr:
+      return cc_expr(env, t->expr, t->tail);
+    case ck_body:
+      if (t->n != 0 && cc_emit(env, vo_pop) == false) {
+        return false;
+      }
+      if (t->expr == NULL) {
+        return cc_emit(env, vo_nil);
+      }
+      if (dt_is_pair(t->expr) == false) {
+        break;
+      }
+      if (dt_cdr(t->expr) == NULL) {
+        return cc_expr(env, dt_car(t->expr), t->tail);
+      }
+      return cc_push(env, ck_body, dt_cdr(t->expr), t->tail, 1) &&
+             cc_push(env, ck_expr, dt_car(t->expr), false, 0);
+    case ck_args:
+      if (t->expr == NULL) {
+        return cc_emit(env, t->tail ? vo_tailcall : vo_call) && cc_emit16(env, t->n);
+      }
+      return cc_push(env, ck_args, dt_cdr(t->expr), t->tail, t->n + 1) &&
+             cc_push(env, ck_expr, dt_car(t->expr), false, 0);
+    case ck_then:
+      return cc_emit_jump(env, vo_jumpf, &at) &&
+             cc_push(env, ck_else, dt_cdr(t->expr), t->tail, at) &&
+             cc_push(env, ck_expr, dt_car(t->expr), t->tail, 0);
+    case ck_else:
+      return cc_emit_jump(env, vo_jump, &at) &&
+             cc_patch(env, t->n) &&
+             cc_push(env, ck_patch, NULL, false, at) &&
+             cc_push(env, ck_expr, t->expr == NULL ? NULL : dt_car(t->expr), t->tail, 0);
+    case ck_patch:
+      return cc_patch(env, t->n);
+    case ck_define:
+    case ck_set:
+      return cc_store(env, t->expr, t->kind == ck_define);
+    case ck_lambda:
+      return cc_lambda_end(env, t->n);
+  }
+  env_set_err(env, error_bad_form);
+  return false;
+}
+
+/* compiles the top level expressions of 'program' into a function
+ * without parameters, written to 'out' to be run with vm_run.
+ * compiled code is never freed, it is meant to be compiled once and
+ * run many times. returns false if there was an error, the error is
+ * stored in env->err and nothing is kept.
+ */
+bool compile(environment* env, datum* program, datum** out) {
+  vm_machine* vm = &env->vm;
+  size_t code = sf_used(vm->code);
+  size_t consts = sf_used(vm->consts);
+  size_t k, none, header;
+  cc_task t;
+  bool ok;
+
+  *out = NULL;
+  /* entries of earlier compiles are empty from now on */
+  vm->stamp++;
+  if (vm->stamp == 0) {
+    memset(vm->globals, 0, vm->nglobals*sizeof(cc_global));
+    vm->stamp = 1;
+  }
+  ok = cc_const(env, NULL, &k) && cc_const(env, NULL, &none);
+  header = cc_here(env);
+  ok = ok && cc_emit16(env, none) && cc_emit16(env, none) &&
+       cc_emit16(env, 0) && cc_emit(env, 0) &&
+       cc_push(env, ck_body, program, true, 0);
+  while (ok && sf_empty(vm->tasks) == false) {
+    t = *(cc_task*)sf_top(vm->tasks);
+    sf_free(vm->tasks);
+    ok = cc_run_task(env, &t);
+  }
+  ok = ok && cc_emit(env, vo_return) &&
+       (*out = env_new_code(env, vm->code->buff + header)) != NULL;
+
+  if (ok == false) {
+    sf_free_all(vm->tasks);
+    sf_free_all(vm->scopes);
+    sf_free_to(vm->code, code);
+    sf_free_to(vm->consts, consts);
+    *out = NULL;
+    return false;
+  }
+  /* the constant pool keeps it alive */
+  ((datum**)vm->consts->buff)[k] = *out;
+  return true;
+}
+
+/* parses and compiles every top level expression in 'text' */
+bool compile_string(environment* env, const char* text, size_t size, datum** out) {
+  datum* program;
+
+  *out = NULL;
+  gc_safe_point(env);
+  if (parse(env, text, size, &program) == false) {
+    return false;
+  }
+  return compile(env, program, out);
+}
+
+/*
+ * -------------------------------------
+ * |              ###VM###             |
+ * -------------------------------------
+ */
+
+/* a non recursive dispatch loop. values live in the value stack of
+ * the evaluator and calls in env->vm.calls. it jumps through a table
+ * of labels where the compiler supports it, a switch otherwise.
+ */
+
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define VM_CASE(op) l_##op
+#define VM_NEXT() goto *labels[*pc++]
+#else
+#define VM_CASE(op) case op
+#define VM_NEXT() continue
+#endif
+
+datum** vm_const(const environment* env, size_t k) {
+  return (datum**)env->vm.consts->buff + k;
+}
+
+datum* vm_source(const environment* env, const datum* code) {
+  return *vm_const(env, VM_U16(dt_code(code) + 2));
+}
+
+datum* vm_pop(environment* env) {
+  datum* val = *(datum**)sf_top(env->m.values);
+  sf_free(env->m.values);
+  return val;
+}
+
+/* returns the (symbol . value) binding of a local */
+datum* vm_local(const environment* env, size_t depth, size_t index) {
+  datum* frame = env->vm.frame;
+  datum* b;
+  while (depth > 0) {
+    frame = dt_cdr(frame);
+    depth--;
+  }
+  for (b = dt_car(frame); index > 0; index--) {
+    b = dt_cdr(b);
+  }
+  return dt_car(b);
+}
+
+/* returns the binding of the global named by consts[k], global
+ * bindings never move so it replaces the name after the first lookup
+ */
+datum* vm_global(environment* env, size_t k) {
+  datum** slot = vm_const(env, k);
+  datum* b = *slot;
+  if (dt_is_symbol(b)) {
+    b = env_lookup(env, NULL, b);
+    if (b == NULL) {
+      env_set_err(env, error_unbound_symbol);
+      return NULL;
+    }
+    *slot = b;
+  }
+  return b;
+}
+
+/* makes the frame of a call to the function at 'header',
+ * every local is bound, the ones that are not params to nil
+ */
+bool vm_bind(environment* env, const uint8_t* header, datum** args, size_t argc, datum* parent) {
+  datum* names = *vm_const(env, VM_U16(header));
+  size_t nparams = VM_U16(header + 4);
+  bool rest = header[6] != 0;
+  datum* bindings = NULL;
+  datum* last = NULL;
+  datum* val; datum* cell;
+  size_t i;
+
+  if (argc < nparams || (rest == false && argc != nparams)) {
+    env_set_err(env, error_arity);
+    return false;
+  }
+  for (i = 0; names != NULL; i++, names = dt_cdr(names)) {
+    val = NULL;
+    if (i < nparams) {
+      val = args[i];
+    } else if (i == nparams && rest) {
+      while (argc > nparams) {
+        argc--;
+        val = env_new_pair(env, args[argc], val);
+        if (val == NULL) {
+          return false;
+        }
+      }
+    }
+    cell = env_new_pair(env, dt_car(names), val);
+    if (cell == NULL || (cell = env_new_pair(env, cell, NULL)) == NULL) {
+      return false;
+    }
+    if (last == NULL) {
+      bindings = cell;
+    } else {
+      env_set_cdr(env, last, cell);
+    }
+    last = cell;
+  }
+  env->vm.frame = env_new_pair(env, bindings, parent);
+  return env->vm.frame != NULL;
+}
+
+/* runs code made by compile, its value is written to 'out'.
+ * results are only kept alive until the next evaluation.
+ */
+bool vm_run(environment* env, const datum* code, datum** out) {
+  vm_machine* vm = &env->vm;
+  machine* m = &env->m;
+  stack_f* values = m->values;
+  size_t base_values = sf_used(values);
+  size_t base_calls = sf_used(vm->calls);
+  const uint8_t* pc = dt_code(code) + VM_HEADER;
+  const uint8_t* header;
+  datum** slots;
+  datum* proc; datum* val; datum* b;
+  vm_call* call;
+  size_t n, at;
+  bool tail, ok;
+#ifdef VM_COMPUTED_GOTO
+  static const void* labels[] = {
+    &&l_vo_const, &&l_vo_nil, &&l_vo_lref, &&l_vo_lset,
+    &&l_vo_gref, &&l_vo_gset, &&l_vo_gdef, &&l_vo_pop,
+    &&l_vo_jump, &&l_vo_jumpf, &&l_vo_closure, &&l_vo_call,
+    &&l_vo_tailcall, &&l_vo_return
+  };
+#endif
+
+  *out = NULL;
+  vm->frame = NULL;
+  env_refuel(env);
+  gc_safe_point(env);
+
+#ifdef VM_COMPUTED_GOTO
+  VM_NEXT();
+#else
+  for (;;) {
+    switch (*pc++) {
+#endif
+      VM_CASE(vo_const):
+        val = *vm_const(env, VM_U16(pc));
+        pc += 2;
+        goto do_push;
+      VM_CASE(vo_nil):
+        val = NULL;
+        goto do_push;
+      VM_CASE(vo_lref):
+        val = dt_cdr(vm_local(env, VM_U16(pc), VM_U16(pc + 2)));
+        pc += 4;
+        goto do_push;
+      VM_CASE(vo_lset):
+        env_set_cdr(env, vm_local(env, VM_U16(pc), VM_U16(pc + 2)), vm_pop(env));
+        pc += 4;
+        VM_NEXT();
+      VM_CASE(vo_gref):
+        b = vm_global(env, VM_U16(pc));
+        if (b == NULL) {
+          goto fail;
+        }
+        val = dt_cdr(b);
+        pc += 2;
+        goto do_push;
+      VM_CASE(vo_gset):
+        b = vm_global(env, VM_U16(pc));
+        if (b == NULL) {
+          goto fail;
+        }
+        env_set_cdr(env, b, vm_pop(env));
+        pc += 2;
+        VM_NEXT();
+      VM_CASE(vo_gdef):
+        if (env_define(env, NULL, *vm_const(env, VM_U16(pc)), vm_pop(env)) == false) {
+          goto fail;
+        }
+        pc += 2;
+        VM_NEXT();
+      VM_CASE(vo_pop):
+        sf_free(values);
+        VM_NEXT();
+      VM_CASE(vo_jump):
+        pc += 2 + VM_U16(pc);
+        VM_NEXT();
+      VM_CASE(vo_jumpf):
+        pc += dt_truthy(vm_pop(env)) ? 2 : 2 + VM_U16(pc);
+        VM_NEXT();
+      VM_CASE(vo_closure):
+        val = env_new_lambda(env, *vm_const(env, VM_U16(pc)), vm->frame);
+        if (val == NULL) {
+          goto fail;
+        }
+        pc += 4 + VM_U16(pc + 2);
+        goto do_push;
+      VM_CASE(vo_call):
+        tail = false;
+        goto do_call;
+      VM_CASE(vo_tailcall):
+        tail = true;
+        goto do_call;
+      VM_CASE(vo_return):
+        val = vm_pop(env);
+        goto do_return;
+#ifndef VM_COMPUTED_GOTO
+      default:
+        env_set_err(env, error_internal);
+        goto fail;
+#endif
+
+      do_push:
+        if (eval_push_value(env, val) == false) {
+          goto fail;
+        }
+        VM_NEXT();
+
+      do_call:
+        n = VM_U16(pc);
+        pc += 2;
+        /* everything is in the stacks or the registers of env->vm */
+        gc_safe_point(env);
+        if (env_burn(env) == false) {
+          goto fail;
+        }
+        slots = (datum**)(values->buff + sf_used(values)) - n - 1;
+        at = distance(values->buff, (uint8_t*)slots);
+        proc = slots[0];
+        if (proc == NULL) {
+          env_set_err(env, error_not_applicable);
+          goto fail;
+        }
+        switch (dt_tag(proc)) {
+          case C_PROC:
+            ok = dt_cproc(proc)(env, slots+1, n, &val);
+            sf_free_to(values, at);
+            if (ok == false) {
+              goto fail;
+            }
+            break;
+          case LAMBDA:
+            if (dt_tag(dt_lambda(proc)->code) == CODE) {
+              header = dt_code(dt_lambda(proc)->code);
+              if (tail == false) {
+                if (sf_used(vm->calls)/sizeof(vm_call) >= env->quota.depth) {
+                  env_set_err(env, error_quota_exceeded);
+                  goto fail;
+                }
+                call = (vm_call*)sf_alloc(vm->calls);
+                if (call == NULL) {
+                  env_set_err(env, error_stack_exhausted);
+                  goto fail;
+                }
+                call->pc = pc;
+                call->frame = vm->frame;
+                call->values = at;
+              }
+              if (vm_bind(env, header, slots+1, n, dt_lambda(proc)->env) == false) {
+                goto fail;
+              }
+              sf_free_to(values, at);
+              pc = header + VM_HEADER;
+              VM_NEXT();
+            }
+            /* interpreted lambdas are applied by the evaluator,
+             * which never calls back into the vm
+             */
+            m->args = at;
+            m->base = sf_used(m->cont);
+            m->state = st_apply;
+            if (eval_run(env) == false) {
+              goto fail;
+            }
+            val = m->val;
+            sf_free_to(values, at);
+            break;
+          default:
+            env_set_err(env, error_not_applicable);
+            goto fail;
+        }
+        if (tail == false) {
+          goto do_push;
+        }
+        goto do_return;
+
+      do_return:
+        if (sf_used(vm->calls) == base_calls) {
+          sf_free_to(values, base_values);
+          vm->frame = NULL;
+          *out = val;
+          return true;
+        }
+        call = (vm_call*)sf_top(vm->calls);
+        pc = call->pc;
+        vm->frame = call->frame;
+        sf_free_to(values, call->values);
+        sf_free(vm->calls);
+        goto do_push;
+#ifndef VM_COMPUTED_GOTO
+    }
+  }
+#endif
+
+fail:
+  sf_free_to(vm->calls, base_calls);
+  sf_free_to(values, base_values);
+  vm->frame = NULL;
+  return false;
+}
+
+/*
+ * -------------------------------------
+ * |            ###SETUP###            |
+ * -------------------------------------
+ */
+
+enum env_RES {
+  env_OK,
+  /* Buffer is too small for the given configuration */
+  env_ERR_SMALLBUFF,
+  /* Builtins (or the symbols of the rom) did not fit */
+  env_ERR_BUILTINS,
+  /* The image is not valid for this build */
+  env_ERR_IMAGE,
+  /* The program of the rom failed */
+  env_ERR_PROGRAM,
+  /* The configuration can not work, see env_config */
+  env_ERR_CONFIG
+};
+
+char* env_str_res(enum env_RES res);
+
+/* sizes of each region carved out of the environment buffer */
+typedef struct {
+  size_t cells;        /* cells in the pool                  */
+  size_t strings;      /* bytes in the freelist              */
+  size_t parse_depth;  /* items in the parser stack          */
+  size_t eval_depth;   /* continuations in the eval stack    */
+  size_t values;       /* slots in the value stack           */
+  size_t symbols;      /* slots in the symbol table          */
+  size_t gc_depth;     /* slots in the collector gray stack  */
+  size_t gc_reserve;   /* collect when fewer cells are free  */
+  size_t gc_string_reserve; /* or fewer bytes for strings     */
+  bool gc_incremental;      /* spread collections over time     */
+  size_t gc_step_allocs;    /* allocations between two steps    */
+  size_t gc_step_work;      /* cells marked or swept per step   */
+  size_t code;         /* bytes of compiled code             */
+  size_t constants;    /* slots in the constant pool         */
+  const uint8_t* rom;  /* image made by rom_build, or NULL    */
+  size_t rom_size;
+  size_t tasks;        /* tasks that can exist at once        */
+  size_t task_depth;   /* continuations in the stack of each, */
+  size_t task_values;  /* slots in the value stack of each,   */
+                       /* neither can be 0 if there are tasks */
+} env_config;
+
+/* registers the read only image 'rom' with a new environment, see the ROM */
+enum env_RES rom_attach(environment* env, const uint8_t* rom, size_t size);
+
+/* returns the size of the buffer required by env_create */
+size_t env_size(const env_config* cfg);
+
+/* returns an environment allocated at the beginning of the buffer,
+ * with every builtin defined. the buffer has to be aligned to
+ * CELL_ALIGN. if it is NULL, 'res' contains the reason.
+ */
+environment* env_create(uint8_t* buff, size_t size, const env_config* cfg, enum env_RES* res);
+
+enum env_RES env_setup(environment* env, const uint8_t* rom, size_t rom_size);
+
+/* brings the environment back to how env_create left it, in place:
+ * the pool, freelist and stacks are emptied with their free_all and
+ * the builtins defined again. the rom and the quota are kept. every
+ * datum of the environment is gone after this.
+ */
+enum env_RES env_reset(environment* env);
+
+char* env_str_res(enum env_RES res) {
+  switch (res) {
+    case env_OK:
+      return "OK";
+    case env_ERR_SMALLBUFF:
+      return "Provided buffer is too small";
+    case env_ERR_BUILTINS:
+      return "Builtins do not fit in the pool";
+    case env_ERR_IMAGE:
+      return "Image is not valid for this build";
+    case env_ERR_PROGRAM:
+      return "The program of the rom failed";
+    case env_ERR_CONFIG:
+      return "The configuration is not valid";
+  }
+  return "??";
+}
+
+size_t env_align(size_t size) {
+  if (size%CELL_ALIGN != 0) {
+    return size + (CELL_ALIGN-size%CELL_ALIGN);
+  }
+  return size;
+}
+
+size_t env_pool_size(const env_config* cfg) {
+  return env_align(sizeof(pool) + cfg->cells*sizeof(datum));
+}
+
+size_t env_fl_size(const env_config* cfg) {
+  return env_align(sizeof(freelist) + sizeof(fl_node) + cfg->strings);
+}
+
+size_t env_hm_size(const env_config* cfg) {
+  return env_align(sizeof(hashmap) + cfg->symbols*sizeof(hm_entry));
+}
+
+size_t env_bitmap_size(const env_config* cfg) {
+  return env_align((cfg->cells+7)/8);
+}
+
+size_t env_stack_size(size_t items, size_t itemsize) {
+  return env_align(sizeof(stack_f) + items*itemsize);
+}
+
+/* entries in the table of globals of the compiler */
+size_t env_globals(const env_config* cfg) {
+  size_t n = 1;
+  while (n < 2*cfg->constants) {
+    n *= 2;
+  }
+  return n;
+}
+
+size_t env_tasks_size(const env_config* cfg) {
+  return env_align(cfg->tasks*sizeof(task)) +
+         cfg->tasks*(env_stack_size(cfg->task_depth, sizeof(eval_cont)) +
+                     env_stack_size(cfg->task_values, sizeof(datum*)));
+}
+
+size_t env_size(const env_config* cfg) {
+  return env_align(sizeof(environment)) +
+         env_pool_size(cfg) +
+         env_fl_size(cfg) +
+         env_hm_size(cfg) +
+         env_stack_size(cfg->parse_depth, sizeof(parser_stack_item)) +
+         env_stack_size(cfg->eval_depth, sizeof(eval_cont)) +
+         env_stack_size(cfg->values, sizeof(datum*)) +
+         GC_BITMAPS*env_bitmap_size(cfg) +
+         env_stack_size(cfg->gc_depth, sizeof(datum*)) +
+         env_stack_size(cfg->code, 1) +
+         env_stack_size(cfg->constants, sizeof(datum*)) +
+         env_align(env_globals(cfg)*sizeof(cc_global)) +
+         env_stack_size(cfg->eval_depth, sizeof(vm_call)) +
+         env_stack_size(cfg->parse_depth, sizeof(cc_task)) +
+         env_stack_size(cfg->parse_depth, sizeof(cc_scope)) +
+         env_tasks_size(cfg);
+}
+
+environment* env_create(uint8_t* buff, size_t size, const env_config* cfg, enum env_RES* res) {
+  environment* env;
+  enum pool_RES pres;
+  enum fl_RES flres;
+  enum sf_RES sfres;
+  enum hm_RES hmres;
+  size_t region;
+  size_t i;
+
+  if (cfg->tasks > 0 && (cfg->task_depth == 0 || cfg->task_values == 0)) {
+    *res = env_ERR_CONFIG;
+    return NULL;
+  }
+  if (buff == NULL || size < env_size(cfg) || (uintptr_t)buff%CELL_ALIGN != 0) {
+    *res = env_ERR_SMALLBUFF;
+    return NULL;
+  }
+
+  env = (environment*)buff;
+  env->size = env_size(cfg);
+  buff += env_align(sizeof(environment));
+
+  region = env_pool_size(cfg);
+  env->pool = pool_create(buff, region, sizeof(datum), &pres);
+  buff += region;
+
+  region = env_fl_size(cfg);
+  env->fl = fl_create(buff, region, &flres);
+  buff += region;
+
+  region = env_hm_size(cfg);
+  env->symbols = hm_create(buff, region, &hmres);
+  buff += region;
+
+  region = env_stack_size(cfg->parse_depth, sizeof(parser_stack_item));
+  env->stack = sf_create(buff, region, sizeof(parser_stack_item), &sfres);
+  buff += region;
+
+  region = env_stack_size(cfg->eval_depth, sizeof(eval_cont));
+  env->m.cont = sf_create(buff, region, sizeof(eval_cont), &sfres);
+  buff += region;
+
+  region = env_stack_size(cfg->values, sizeof(datum*));
+  env->m.values = sf_create(buff, region, sizeof(datum*), &sfres);
+  buff += region;
+
+  region = env_bitmap_size(cfg);
+  env->gc.marks = buff;
+  memset(env->gc.marks, 0, region);
+  buff += region;
+  env->gc.live = buff;
+  memset(env->gc.live, 0, region);
+  buff += region;
+#ifdef PAMI_COMPACT
+  env->gc.boxed = buff;
+  memset(env->gc.boxed, 0, region);
+  buff += region;
+#endif
+
+  region = env_stack_size(cfg->gc_depth, sizeof(datum*));
+  env->gc.gray = sf_create(buff, region, sizeof(datum*), &sfres);
+  buff += region;
+
+  region = env_stack_size(cfg->code, 1);
+  env->vm.code = sf_create(buff, region, 1, &sfres);
+  buff += region;
+
+  region = env_stack_size(cfg->constants, sizeof(datum*));
+  env->vm.consts = sf_create(buff, region, sizeof(datum*), &sfres);
+  buff += region;
+
+  env->vm.globals = (cc_global*)buff;
+  env->vm.nglobals = env_globals(cfg);
+  env->vm.stamp = 0;
+  memset(env->vm.globals, 0, env->vm.nglobals*sizeof(cc_global));
+  buff += env_align(env->vm.nglobals*sizeof(cc_global));
+
+  /* the vm calls as deep as the evaluator and compiles as deep as the parser */
+  region = env_stack_size(cfg->eval_depth, sizeof(vm_call));
+  env->vm.calls = sf_create(buff, region, sizeof(vm_call), &sfres);
+  buff += region;
+
+  region = env_stack_size(cfg->parse_depth, sizeof(cc_task));
+  env->vm.tasks = sf_create(buff, region, sizeof(cc_task), &sfres);
+  buff += region;
+
+  region = env_stack_size(cfg->parse_depth, sizeof(cc_scope));
+  env->vm.scopes = sf_create(buff, region, sizeof(cc_scope), &sfres);
+  env->vm.frame = NULL;
+  buff += region;
+
+  env->sched.tasks = (task*)buff;
+  env->sched.ntasks = cfg->tasks;
+  env->sched.current = SCHED_NONE;
+  env->sched.next = 0;
+  memset(&env->sched.main, 0, sizeof(env->sched.main));
+  buff += env_align(cfg->tasks*sizeof(task));
+  for (i = 0; i < cfg->tasks; i++) {
+    memset(&env->sched.tasks[i], 0, sizeof(task));
+    region = env_stack_size(cfg->task_depth, sizeof(eval_cont));
+    env->sched.tasks[i].m.cont = sf_create(buff, region, sizeof(eval_cont), &sfres);
+    buff += region;
+    region = env_stack_size(cfg->task_values, sizeof(datum*));
+    env->sched.tasks[i].m.values = sf_create(buff, region, sizeof(datum*), &sfres);
+    buff += region;
+    env->sched.tasks[i].state = ts_free;
+  }
+
+  if (env->pool == NULL || env->fl == NULL || env->symbols == NULL) {
+    *res = env_ERR_SMALLBUFF;
+    return NULL;
+  }
+
+  env->gc.ncells = env->pool->nchunks;
+  env->gc.reserve = cfg->gc_reserve;
+  env->gc.string_reserve = cfg->gc_string_reserve;
+  env->gc.incremental = cfg->gc_incremental;
+  env->gc.step_allocs = cfg->gc_step_allocs == 0 ? 1 : cfg->gc_step_allocs;
+  env->gc.step_work = cfg->gc_step_work;
+  env_set_quota(env, NULL);
+
+  *res = env_setup(env, cfg->rom, cfg->rom_size);
+  if (*res != env_OK) {
+    return NULL;
+  }
+  return env;
+}
+
+/* everything that is not a region or the configuration, from a
+ * blank pool, freelist and symbol table
+ */
+enum env_RES env_setup(environment* env, const uint8_t* rom, size_t rom_size) {
+  enum env_RES res;
+  int sp;
+
+  env->gc.strings = 0;
+  env->gc.overflow = false;
+  env->gc.phase = gp_idle;
+  env->gc.black = true;
+  env->gc.cursor = 0;
+  env->gc.allocs = 0;
+
+  env->globals = NULL;
+  env->rom = NULL;
+  env->rom_size = 0;
+  env->m.state = st_done;
+  env->m.expr = NULL;
+  env->m.frame = NULL;
+  env->m.val = NULL;
+  env->m.base = 0;
+  env->m.args = 0;
+  env_set_err(env, error_contract_violation);
+
+  /* symbols of the rom go first, so the specials and builtins
+   * with the same name are the ones it refers to
+   */
+  if (rom != NULL) {
+    res = rom_attach(env, rom, rom_size);
+    if (res != env_OK) {
+      return res;
+    }
+  }
+
+  env->specials[sp_none] = NULL;
+  for (sp = sp_quote; sp < SP_COUNT; sp++) {
+    env->specials[sp] = env_intern(env, env_special_names[sp], strlen(env_special_names[sp]));
+    if (env->specials[sp] == NULL) {
+      return env_ERR_BUILTINS;
+    }
+  }
+
+  if (bi_define_all(env) == false) {
+    return env_ERR_BUILTINS;
+  }
+  return env_OK;
+}
+
+enum env_RES env_reset(environment* env) {
+  size_t bitmap = (env->gc.ncells+7)/8;
+  size_t i;
+
+  pool_free_all(env->pool);
+  fl_free_all(env->fl);
+  hm_clear(env->symbols);
+  sf_free_all(env->stack);
+  sf_free_all(env->m.cont);
+  sf_free_all(env->m.values);
+  sf_free_all(env->gc.gray);
+  sf_free_all(env->vm.code);
+  sf_free_all(env->vm.consts);
+  sf_free_all(env->vm.calls);
+  sf_free_all(env->vm.tasks);
+  sf_free_all(env->vm.scopes);
+  env->vm.frame = NULL;
+  memset(env->gc.marks, 0, bitmap);
+  memset(env->gc.live, 0, bitmap);
+#ifdef PAMI_COMPACT
+  memset(env->gc.boxed, 0, bitmap);
+#endif
+
+  env->sched.current = SCHED_NONE;
+  env->sched.next = 0;
+  memset(&env->sched.main, 0, sizeof(env->sched.main));
+  for (i = 0; i < env->sched.ntasks; i++) {
+    sf_free_all(env->sched.tasks[i].m.cont);
+    sf_free_all(env->sched.tasks[i].m.values);
+    env->sched.tasks[i].state = ts_free;
+    env->sched.tasks[i].generation = (env->sched.tasks[i].generation + 1) & 0x7fffffff;
+  }
+  return env_setup(env, env->rom, env->rom_size);
+}
+
+/*
+ * -------------------------------------
+ * |             ###ROM###             |
+ * -------------------------------------
+ */
+
+/* a program can be parsed ahead of time into a read only image of
+ * cells and strings, that is evaluated in place from flash or from a
+ * mapped file instead of being parsed into the pool. its cells are
+ * never written: they only point to each other, the collector skips
+ * them since they are outside the pool and the builtins that mutate
+ * refuse them.
+ *
+ * cells hold real pointers, so an image is built for the address it
+ * will be read from ('base'). the symbols of the image are interned
+ * when an environment is created with it, before any other.
+ *
+ * the image is this header, the cells, the bytes of strings and
+ * symbols and the offsets of the symbol cells (uint32_t).
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t layout;
+  uint64_t base;     /* address of the image */
+  uint64_t size;
+  uint64_t ncells;
+  uint64_t nsymbols;
+  uint64_t symbols;  /* offset of the symbol table */
+  datum* program;    /* list of top level expressions */
+} rom_header;
+
+#define ROM_MAGIC 0x4d4f5250  /* "PROM" */
+
+#ifdef PAMI_COMPACT
+#define ROM_LAYOUT ((uint32_t)(sizeof(datum) | sizeof(void*) << 8 | 1 << 16))
+#else
+#define ROM_LAYOUT ((uint32_t)(sizeof(datum) | sizeof(void*) << 8))
+#endif
+
+#define ROM_CELLS env_align(sizeof(rom_header))
+
+/* parses 'text' and writes its image for address 'base' to 'out',
+ * returns its size or 0 if there was an error, stored in env->err.
+ * while building, the end of 'out' holds two uint32_t per cell of
+ * the pool. 'env' must not have a rom of its own.
+ */
+size_t rom_build(environment* env, const char* text, size_t size, uint8_t* out, size_t out_size, uintptr_t base);
+
+/* the program of the rom of 'env', NULL if it has none */
+datum* rom_program(const environment* env);
+
+typedef struct {
+  environment* env;
+  uint8_t* cells;    /* of the image being built */
+  uintptr_t base;
+  uint32_t* fwd;     /* 1 + index in the image of each cell of the pool, 0 if not copied */
+  uint32_t* back;    /* index in the pool of each cell of the image */
+  size_t ncells;
+  size_t limit;      /* cells that fit before the tables */
+  bool ok;
+} rom_builder;
+
+/* the address in the image of the copy of 'd', copied if needed */
+datum* rom_forward(rom_builder* b, datum* d) {
+  environment* env = b->env;
+  datum* cell;
+  size_t i;
+
+  if (dt_is_cell(d) == false) {
+    return d;
+  }
+  cell = dt_cell(d);
+  if (gc_in_pool(env, cell) == false) {
+    b->ok = false;
+    return NULL;
+  }
+  i = env_cell_index(env, cell);
+  if (b->fwd[i] == 0) {
+    if (b->ncells == b->limit) {
+      b->ok = false;
+      return NULL;
+    }
+    memcpy(b->cells + b->ncells*sizeof(datum), cell, sizeof(datum));
+    b->back[b->ncells] = (uint32_t)i;
+    b->ncells++;
+    b->fwd[i] = (uint32_t)b->ncells;
+  }
+  return (datum*)(b->base + ROM_CELLS + (b->fwd[i] - 1)*sizeof(datum) +
+                  ((uintptr_t)d - (uintptr_t)cell));
+}
+
+/* true if the k-th cell of the image is two datum* */
+bool rom_is_pair(const rom_builder* b, size_t k) {
+  datum* d = (datum*)(b->cells + k*sizeof(datum));
+#ifdef PAMI_COMPACT
+  (void)d;
+  return GC_GET(b->env->gc.boxed, b->back[k]) == 0;
+#else
+  return d->tag == PAIR;
+#endif
+}
+
+bool rom_is_string(const rom_builder* b, size_t k) {
+  datum* d = (datum*)(b->cells + k*sizeof(datum));
+  return rom_is_pair(b, k) == false && (d->tag == STRING || d->tag == SYMBOL);
+}
+
+size_t rom_build(environment* env, const char* text, size_t size, uint8_t* out, size_t out_size, uintptr_t base) {
+  rom_builder b;
+  rom_header hdr;
+  datum* program;
+  datum* d;
+  datum** words;
+  size_t tables = env->gc.ncells*2*sizeof(uint32_t);
+  size_t at, k;
+  str s;
+
+  if (env->rom != NULL || base%CELL_ALIGN != 0 || out_size < ROM_CELLS + tables ||
+      out_size > UINT32_MAX) {
+    env_set_err(env, error_contract_violation);
+    return 0;
+  }
+  if (parse(env, text, size, &program) == false) {
+    return 0;
+  }
+
+  /* cells are copied breadth first, the image itself is the queue */
+  b.env = env;
+  b.cells = out + ROM_CELLS;
+  b.base = base;
+  b.fwd = (uint32_t*)(out + ((out_size - tables) & ~(size_t)3));
+  b.back = b.fwd + env->gc.ncells;
+  b.ncells = 0;
+  b.limit = (distance(out, (uint8_t*)b.fwd) - ROM_CELLS)/sizeof(datum);
+  b.ok = true;
+  memset(b.fwd, 0, env->gc.ncells*sizeof(uint32_t));
+
+  hdr.program = rom_forward(&b, program);
+  for (k = 0; k < b.ncells && b.ok; k++) {
+    d = (datum*)(b.cells + k*sizeof(datum));
+    if (rom_is_pair(&b, k)) {
+      words = (datum**)dt_car_ref(d);
+      words[0] = rom_forward(&b, words[0]);
+      words = (datum**)dt_cdr_ref(d);
+      words[0] = rom_forward(&b, words[0]);
+      continue;
+    }
+    switch ((enum datum_tag)d->tag) {
+      case EXACT_NUM:
+      case INEXACT_NUM:
+      case BOOL:
+      case STRING:
+      case SYMBOL:
+        break;
+      default:
+        /* parsing makes nothing else */
+        b.ok = false;
+        break;
+    }
+  }
+
+  /* the bytes of strings go after the cells */
+  at = ROM_CELLS + b.ncells*sizeof(datum);
+  hdr.nsymbols = 0;
+  for (k = 0; k < b.ncells && b.ok; k++) {
+    if (rom_is_string(&b, k) == false) {
+      continue;
+    }
+    d = (datum*)(b.cells + k*sizeof(datum));
+    s = dt_str(d);
+    if (at + (size_t)s.len > distance(out, (uint8_t*)b.fwd)) {
+      b.ok = false;
+      break;
+    }
+    memcpy(out + at, s.buff + s.start, (size_t)s.len);
+    s.buff = (char*)(base + at);
+    s.start = 0;
+    dt_set_str(d, s);
+    at += (size_t)s.len;
+    if (d->tag == SYMBOL) {
+      hdr.nsymbols++;
+    }
+  }
+
+  at = (at + 3) & ~(size_t)3;
+  hdr.symbols = at;
+  if (b.ok && at + hdr.nsymbols*sizeof(uint32_t) > distance(out, (uint8_t*)b.fwd)) {
+    b.ok = false;
+  }
+  for (k = 0; k < b.ncells && b.ok; k++) {
+    d = (datum*)(b.cells + k*sizeof(datum));
+    if (rom_is_string(&b, k) && d->tag == SYMBOL) {
+      *(uint32_t*)(out + at) = (uint32_t)(ROM_CELLS + k*sizeof(datum));
+      at += sizeof(uint32_t);
+    }
+  }
+  if (b.ok == false) {
+    env_set_err(env, error_contract_violation);
+    return 0;
+  }
+
+  hdr.magic = ROM_MAGIC;
+  hdr.layout = ROM_LAYOUT;
+  hdr.base = base;
+  hdr.size = at;
+  hdr.ncells = b.ncells;
+  memcpy(out, &hdr, sizeof(hdr));
+  return at;
+}
+
+/* true if 'rom' was built for this build and this address */
+bool rom_valid(const uint8_t* rom, size_t size) {
+  const rom_header* hdr = (const rom_header*)rom;
+  return rom != NULL && size >= ROM_CELLS && (uintptr_t)rom%CELL_ALIGN == 0 && hdr->magic == ROM_MAGIC &&
+         hdr->layout == ROM_LAYOUT && hdr->base == (uintptr_t)rom && hdr->size == size &&
+         hdr->symbols <= size && hdr->nsymbols <= (size - hdr->symbols)/sizeof(uint32_t);
+}
+
+enum env_RES rom_attach(environment* env, const uint8_t* rom, size_t size) {
+  const rom_header* hdr = (const rom_header*)rom;
+  const uint32_t* symbols;
+  datum* sym;
+  str name;
+  size_t i;
+
+  if (rom_valid(rom, size) == false) {
+    return env_ERR_IMAGE;
+  }
+  env->rom = rom;
+  env->rom_size = size;
+
+  symbols = (const uint32_t*)(rom + hdr->symbols);
+  for (i = 0; i < hdr->nsymbols; i++) {
+    if (symbols[i] < ROM_CELLS || symbols[i] > size - sizeof(datum)) {
+      return env_ERR_IMAGE;
+    }
+    sym = (datum*)(rom + symbols[i]);
+    name = dt_str(sym);
+    if (hm_put(env->symbols, name.buff, (size_t)name.len, sym) != hm_OK) {
+      return env_ERR_BUILTINS;
+    }
+  }
+  return env_OK;
+}
+
+datum* rom_program(const environment* env) {
+  if (env->rom == NULL) {
+    return NULL;
+  }
+  return ((const rom_header*)env->rom)->program;
+}
+
+/*
+ * -------------------------------------
+ * |          ###SNAPSHOT###           |
+ * -------------------------------------
+ */
+
+/* an environment is a single buffer, so it is saved as a copy of
+ * that buffer plus a table with the offset of every word in it that
+ * holds a pointer. in the image those words are offsets from the
+ * start of the buffer and builtins are indices into 'builtins', so
+ * the same state always gives the same image, and restoring it
+ * anywhere is a copy and one addition per pointer.
+ *
+ * an image is this header, the buffer, the pointer offsets and the
+ * builtin offsets (both uint32_t).
+ *
+ * pointers into the rom are kept as they are, the rom can only be
+ * used at the address it was built for, so the image records it and
+ * is only restored with the same rom.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t layout;   /* must match the build that restores it */
+  uint32_t nrelocs;
+  uint32_t nprocs;
+  uint64_t size;     /* bytes of the buffer */
+  uint64_t rom;      /* address of the rom, 0 without one */
+  uint64_t rom_size;
+} env_image;
+
+#define SNAP_MAGIC 0x494d4150  /* "PAMI" */
+
+/* changes with anything that changes what's inside the buffer */
+#define SNAP_LAYOUT ((uint32_t)(sizeof(datum) | sizeof(environment) << 6 |     \
+                                sizeof(freelist) << 16 | BUILTIN_COUNT << 24) ^ \
+                     (uint32_t)(sizeof(void*) << 28))
+
+/* returns the size of the image of 'env', 0 if it can't be saved.
+ * the environment must not be evaluating, compiling or parsing,
+ * a full collection is done first so garbage is not saved.
+ */
+size_t env_snapshot_size(environment* env);
+
+/* writes the image of 'env' to 'out', returns its size or 0 if
+ * 'size' is too small or the environment can't be saved
+ */
+size_t env_snapshot(environment* env, uint8_t* out, size_t size);
+
+/* returns the environment saved in 'image', restored at the beginning
+ * of the buffer. 'rom' must be the rom of the saved environment, or
+ * NULL if it had none. if it is NULL, 'res' contains the reason.
+ */
+environment* env_restore(uint8_t* buff, size_t size, const uint8_t* image, size_t image_size,
+                         const uint8_t* rom, size_t rom_size, enum env_RES* res);
+
+typedef struct {
+  const uint8_t* base;  /* buffer of the environment */
+  size_t size;
+  uint8_t* image;       /* its copy, NULL while counting */
+  uint32_t* relocs;
+  uint32_t* procs;
+  size_t nrelocs;
+  size_t nprocs;
+  bool ok;
+} snap_walk;
+
+uintptr_t snap_word(const void* site) {
+  uintptr_t w;
+  memcpy(&w, site, sizeof(w));
+  return w;
+}
+
+/* the word of the copy at the same offset as 'site' */
+void snap_rewrite(snap_walk* w, const void* site, uintptr_t value) {
+  memcpy(w->image + distance(w->base, (const uint8_t*)site), &value, sizeof(value));
+}
+
+/* 'site' holds a plain pointer, or NULL */
+void snap_ptr(snap_walk* w, const void* site) {
+  uintptr_t p = snap_word(site);
+  if (p < (uintptr_t)w->base || p >= (uintptr_t)w->base + w->size) {
+    return;
+  }
+  if (w->image != NULL) {
+    w->relocs[w->nrelocs] = (uint32_t)distance(w->base, (const uint8_t*)site);
+    snap_rewrite(w, site, p - (uintptr_t)w->base);
+  }
+  w->nrelocs++;
+}
+
+/* 'site' holds a datum*, which may be an immediate */
+void snap_datum(snap_walk* w, datum* const* site) {
+  if (dt_is_cell(*site)) {
+    snap_ptr(w, site);
+  }
+}
+
+void snap_proc(snap_walk* w, const cproc* site) {
+  size_t i;
+  for (i = 0; i < BUILTIN_COUNT && builtins[i].proc != *site; i++) {
+  }
+  if (i == BUILTIN_COUNT) {
+    w->ok = false;
+    return;
+  }
+  if (w->image != NULL) {
+    w->procs[w->nprocs] = (uint32_t)distance(w->base, (const uint8_t*)site);
+    snap_rewrite(w, site, i);
+  }
+  w->nprocs++;
+}
+
+void snap_stack(snap_walk* w, stack_f* const* site) {
+  snap_ptr(w, site);
+  snap_ptr(w, &(*site)->buff);
+}
+
+/* a task may be suspended anywhere, its stacks are walked too */
+void snap_task(snap_walk* w, task* t) {
+  eval_cont* k;
+  datum** values;
+  size_t i;
+
+  snap_stack(w, &t->m.cont);
+  snap_stack(w, &t->m.values);
+  snap_datum(w, &t->m.expr);
+  snap_datum(w, &t->m.frame);
+  snap_datum(w, &t->m.val);
+  snap_datum(w, &t->inbox);
+  snap_datum(w, &t->last);
+  snap_datum(w, &t->result);
+  for (i = 0; i < sf_used(t->m.cont)/sizeof(eval_cont); i++) {
+    k = (eval_cont*)t->m.cont->buff + i;
+    snap_datum(w, &k->exprs);
+    snap_datum(w, &k->frame);
+  }
+  values = (datum**)t->m.values->buff;
+  for (i = 0; i < sf_used(t->m.values)/sizeof(datum*); i++) {
+    snap_datum(w, &values[i]);
+  }
+}
+
+/* finds every pointer in the environment, the walk follows the
+ * free lists of the allocators and the cells marked live
+ */
+void snap_walk_env(snap_walk* w, environment* env) {
+  const pool* p = env->pool;
+  const freelist* fl = env->fl;
+  fl_node* node;
+  pool_node* pnode;
+  hm_entry* e;
+  datum* d;
+  datum** words;
+  size_t i;
+
+  snap_ptr(w, &env->pool);
+  snap_ptr(w, &env->fl);
+  snap_ptr(w, &env->symbols);
+  snap_stack(w, &env->stack);
+  snap_datum(w, &env->globals);
+  for (i = 0; i < SP_COUNT; i++) {
+    snap_datum(w, &env->specials[i]);
+  }
+  snap_datum(w, &env->m.expr);
+  snap_datum(w, &env->m.frame);
+  snap_datum(w, &env->m.val);
+  snap_stack(w, &env->m.cont);
+  snap_stack(w, &env->m.values);
+  snap_stack(w, &env->vm.code);
+  snap_stack(w, &env->vm.consts);
+  snap_stack(w, &env->vm.calls);
+  snap_stack(w, &env->vm.tasks);
+  snap_stack(w, &env->vm.scopes);
+  snap_datum(w, &env->vm.frame);
+  /* its symbols are only compared in the compile that put them there */
+  snap_ptr(w, &env->vm.globals);
+  snap_ptr(w, &env->gc.marks);
+  snap_ptr(w, &env->gc.live);
+#ifdef PAMI_COMPACT
+  snap_ptr(w, &env->gc.boxed);
+#endif
+  snap_stack(w, &env->gc.gray);
+  snap_ptr(w, &env->sched.tasks);
+  for (i = 0; i < env->sched.ntasks; i++) {
+    snap_task(w, &env->sched.tasks[i]);
+  }
+
+  snap_ptr(w, &p->head);
+  snap_ptr(w, &p->tail);
+  snap_ptr(w, &p->begin);
+  snap_ptr(w, &p->end);
+  for (pnode = p->head; pnode != NULL; pnode = pnode->next) {
+    snap_ptr(w, &pnode->next);
+  }
+
+  snap_ptr(w, &fl->head);
+  snap_ptr(w, &fl->begin);
+  snap_ptr(w, &fl->end);
+  for (node = fl->head; node != NULL; node = node->next) {
+    snap_ptr(w, &node->next);
+#ifdef FL_BOUNDARY_TAGS
+    snap_ptr(w, &node->prev);
+#endif
+  }
+  for (i = 0; i < FL_CLASSES; i++) {
+    snap_ptr(w, &fl->classes[i]);
+    for (node = fl->classes[i]; node != NULL; node = node->next) {
+      snap_ptr(w, &node->next);
+    }
+  }
+
+  snap_ptr(w, &env->symbols->entries);
+  for (i = 0; i < env->symbols->capacity; i++) {
+    e = &env->symbols->entries[i];
+    if (e->hash != 0) {
+      snap_ptr(w, &e->key);
+      snap_datum(w, (datum* const*)&e->value);
+    }
+  }
+
+  words = (datum**)env->vm.consts->buff;
+  for (i = 0; i < sf_used(env->vm.consts)/sizeof(datum*); i++) {
+    snap_datum(w, &words[i]);
+  }
+
+  for (i = 0; i < env->gc.ncells; i++) {
+    if (GC_GET(env->gc.live, i) == 0) {
+      continue;
+    }
+    d = (datum*)(p->begin + i*sizeof(datum));
+#ifdef PAMI_COMPACT
+    if (GC_GET(env->gc.boxed, i) == 0) {
+      /* a pair or a lambda, two datum* */
+      words = (datum**)d;
+      snap_datum(w, &words[0]);
+      snap_datum(w, &words[1]);
+      continue;
+    }
+    switch (d->tag) {
+      case STRING:
+      case SYMBOL:
+        snap_ptr(w, &d->data.buff);
+        break;
+#else
+    switch (d->tag) {
+      case PAIR:
+        snap_datum(w, &d->data.pair.car);
+        snap_datum(w, &d->data.pair.cdr);
+        break;
+      case LAMBDA:
+        snap_datum(w, &d->data.lambda.code);
+        snap_datum(w, &d->data.lambda.env);
+        break;
+      case STRING:
+        snap_ptr(w, &d->data.string.buff);
+        break;
+      case SYMBOL:
+        snap_ptr(w, &d->data.symbol.name.buff);
+        break;
+#endif
+      case C_PROC:
+        snap_proc(w, &d->data.cproc);
+        break;
+      case CODE:
+        snap_ptr(w, &d->data.code);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+/* sets up the walk, false if 'env' can't be saved now */
+bool snap_begin(environment* env, snap_walk* w) {
+  if (sf_used(env->stack) != 0 || sf_used(env->m.cont) != 0 ||
+      sf_used(env->m.values) != 0 || sf_used(env->vm.calls) != 0 ||
+      sf_used(env->vm.tasks) != 0 || sf_used(env->vm.scopes) != 0 ||
+      env->size > UINT32_MAX) {
+    env_set_err(env, error_contract_violation);
+    return false;
+  }
+  gc_collect(env);
+  memset(w, 0, sizeof(*w));
+  w->base = (const uint8_t*)env;
+  w->size = env->size;
+  w->ok = true;
+  snap_walk_env(w, env);
+  if (w->ok == false) {
+    env_set_err(env, error_contract_violation);
+  }
+  return w->ok;
+}
+
+size_t snap_image_size(const snap_walk* w) {
+  return sizeof(env_image) + w->size + (w->nrelocs + w->nprocs)*sizeof(uint32_t);
+}
+
+size_t env_snapshot_size(environment* env) {
+  snap_walk w;
+  if (snap_begin(env, &w) == false) {
+    return 0;
+  }
+  return snap_image_size(&w);
+}
+
+size_t env_snapshot(environment* env, uint8_t* out, size_t size) {
+  env_image hdr;
+  snap_walk w;
+
+  if (snap_begin(env, &w) == false) {
+    return 0;
+  }
+  if (size < snap_image_size(&w)) {
+    env_set_err(env, error_contract_violation);
+    return 0;
+  }
+
+  hdr.magic = SNAP_MAGIC;
+  hdr.layout = SNAP_LAYOUT;
+  hdr.nrelocs = (uint32_t)w.nrelocs;
+  hdr.nprocs = (uint32_t)w.nprocs;
+  hdr.size = w.size;
+  hdr.rom = (uintptr_t)env->rom;
+  hdr.rom_size = env->rom_size;
+  memcpy(out, &hdr, sizeof(hdr));
+
+  w.image = out + sizeof(hdr);
+  memcpy(w.image, env, w.size);
+  w.relocs = (uint32_t*)(w.image + w.size);
+  w.procs = w.relocs + w.nrelocs;
+  w.nrelocs = 0;
+  w.nprocs = 0;
+  snap_walk_env(&w, env);
+  return snap_image_size(&w);
+}
+
+environment* env_restore(uint8_t* buff, size_t size, const uint8_t* image, size_t image_size,
+                         const uint8_t* rom, size_t rom_size, enum env_RES* res) {
+  env_image hdr;
+  const uint8_t* table;
+  uint32_t offset;
+  uintptr_t word;
+  size_t i;
+
+  if (image_size < sizeof(hdr)) {
+    *res = env_ERR_IMAGE;
+    return NULL;
+  }
+  memcpy(&hdr, image, sizeof(hdr));
+  if (hdr.magic != SNAP_MAGIC || hdr.layout != SNAP_LAYOUT ||
+      hdr.size > image_size - sizeof(hdr) ||
+      image_size != sizeof(hdr) + hdr.size + ((size_t)hdr.nrelocs + hdr.nprocs)*sizeof(uint32_t)) {
+    *res = env_ERR_IMAGE;
+    return NULL;
+  }
+  if (hdr.rom != (uintptr_t)rom || hdr.rom_size != rom_size ||
+      (rom != NULL && rom_valid(rom, rom_size) == false)) {
+    *res = env_ERR_IMAGE;
+    return NULL;
+  }
+  if (buff == NULL || size < hdr.size || (uintptr_t)buff%CELL_ALIGN != 0) {
+    *res = env_ERR_SMALLBUFF;
+    return NULL;
+  }
+
+  memcpy(buff, image + sizeof(hdr), hdr.size);
+  table = image + sizeof(hdr) + hdr.size;
+  for (i = 0; i < (size_t)hdr.nrelocs + hdr.nprocs; i++) {
+    memcpy(&offset, table + i*sizeof(uint32_t), sizeof(offset));
+    if (offset%sizeof(word) != 0 || offset > hdr.size - sizeof(word)) {
+      *res = env_ERR_IMAGE;
+      return NULL;
+    }
+    memcpy(&word, buff + offset, sizeof(word));
+    if (i < hdr.nrelocs) {
+      if (word >= hdr.size) {
+        *res = env_ERR_IMAGE;
+        return NULL;
+      }
+      word += (uintptr_t)buff;
+      memcpy(buff + offset, &word, sizeof(word));
+    } else {
+      if (word >= BUILTIN_COUNT) {
+        *res = env_ERR_IMAGE;
+        return NULL;
+      }
+      memcpy(buff + offset, &builtins[word].proc, sizeof(cproc));
+    }
+  }
+  *res = env_OK;
+  return (environment*)buff;
+}
+
+/*
+ * -------------------------------------
+ * |          ###INSTANCE###           |
+ * -------------------------------------
+ */
+
+/* an instance is a sandbox: an environment and its last result,
+ * both inside one region given by the caller. nothing outside the
+ * region is ever written, the only globals are const tables, so
+ * any number of instances can run at the same time on different
+ * threads. each instance must be used by a single thread at a time.
+ */
+typedef struct {
+  environment* env;
+  datum* result;  /* of the last evaluation, alive until the next one */
+  bool running;   /* an evaluation is suspended, see pami_step */
+  size_t values;  /* size of the value stack when it started */
+} pami_instance;
+
+enum pami_RES {pami_OK, pami_SUSPENDED, pami_ERR};
+
+/* returns the size of the region required by pami_create */
+size_t pami_size(const env_config* cfg);
+
+/* returns an instance allocated at the beginning of the region,
+ * the program of the rom, if any, has already been evaluated.
+ * if it is NULL 'res' contains the reason.
+ */
+pami_instance* pami_create(uint8_t* buff, size_t size, const env_config* cfg, enum env_RES* res);
+
+/* evaluates the program of the rom, if any */
+enum env_RES pami_load(pami_instance* p);
+
+/* makes the instance as new again, without carving its region a
+ * second time, see env_reset. everything defined by earlier
+ * evaluations is gone, the rom program has been evaluated again.
+ */
+enum env_RES pami_reset(pami_instance* p);
+
+/* evaluates 'text', returns false if there was an error, see pami_error */
+bool pami_eval(pami_instance* p, const char* text, size_t size);
+
+/* parses 'text' and prepares its evaluation, that is run by pami_step.
+ * returns false if there was an error or an evaluation is suspended.
+ */
+bool pami_start(pami_instance* p, const char* text, size_t size);
+
+/* runs the evaluation for at most 'budget' expressions. returns
+ * pami_SUSPENDED if it is not done, to be called again later,
+ * pami_OK if it is, with the value in pami_result, and pami_ERR
+ * if it failed. each expression does a bounded amount of work, so
+ * the budget bounds the time spent in one call.
+ */
+enum pami_RES pami_step(pami_instance* p, size_t budget);
+
+/* drops a suspended evaluation */
+void pami_cancel(pami_instance* p);
+
+datum* pami_result(const pami_instance* p);
+
+error pami_error(const pami_instance* p);
+
+/* limits every evaluation of the instance from now on, see env_quota */
+void pami_set_quota(pami_instance* p, const env_quota* q);
+
+/* runs the tasks of the instance, see sched_run */
+size_t pami_run_tasks(pami_instance* p, size_t quantum, size_t turns);
+
+/* collects the task 'id' if it is done, see sched_collect */
+enum sched_RES pami_collect_task(pami_instance* p, int64_t id, datum** result, error* err);
+
+size_t pami_size(const env_config* cfg) {
+  return env_align(sizeof(pami_instance)) + env_size(cfg);
+}
+
+pami_instance* pami_create(uint8_t* buff, size_t size, const env_config* cfg, enum env_RES* res) {
+  pami_instance* p;
+  size_t header = env_align(sizeof(pami_instance));
+
+  if (buff == NULL || size < pami_size(cfg) || (uintptr_t)buff%CELL_ALIGN != 0) {
+    *res = env_ERR_SMALLBUFF;
+    return NULL;
+  }
+  p = (pami_instance*)buff;
+  p->result = NULL;
+  p->running = false;
+  p->env = env_create(buff + header, size - header, cfg, res);
+  if (p->env == NULL) {
+    return NULL;
+  }
+  *res = pami_load(p);
+  if (*res != env_OK) {
+    return NULL;
+  }
+  return p;
+}
+
+enum env_RES pami_load(pami_instance* p) {
+  if (rom_program(p->env) != NULL &&
+      eval_program(p->env, rom_program(p->env), &p->result) == false) {
+    return env_ERR_PROGRAM;
+  }
+  return env_OK;
+}
+
+enum env_RES pami_reset(pami_instance* p) {
+  enum env_RES res;
+
+  p->result = NULL;
+  p->running = false;
+  res = env_reset(p->env);
+  if (res != env_OK) {
+    return res;
+  }
+  return pami_load(p);
+}
+
+bool pami_eval(pami_instance* p, const char* text, size_t size) {
+  return pami_start(p, text, size) && pami_step(p, SIZE_MAX) == pami_OK;
+}
+
+bool pami_start(pami_instance* p, const char* text, size_t size) {
+  environment* env = p->env;
+  datum* program;
+
+  if (p->running) {
+    env_set_err(env, error_contract_violation);
+    return false;
+  }
+  p->result = NULL;
+  gc_safe_point(env);
+  if (parse(env, text, size, &program) == false) {
+    return false;
+  }
+  p->values = sf_used(env->m.values);
+  if (eval_start(env, program) == false) {
+    return false;
+  }
+  p->running = true;
+  return true;
+}
+
+enum pami_RES pami_step(pami_instance* p, size_t budget) {
+  environment* env = p->env;
+  enum eval_RES res;
+
+  if (p->running == false) {
+    env_set_err(env, error_contract_violation);
+    return pami_ERR;
+  }
+  res = eval_resume(env, budget);
+  if (res == eval_SUSPENDED) {
+    return pami_SUSPENDED;
+  }
+  p->running = false;
+  sf_free_to(env->m.values, p->values);
+  if (res == eval_ERR) {
+    return pami_ERR;
+  }
+  p->result = env->m.val;
+  return pami_OK;
+}
+
+void pami_cancel(pami_instance* p) {
+  environment* env = p->env;
+  if (p->running) {
+    sf_free_to(env->m.cont, env->m.base);
+    sf_free_to(env->m.values, p->values);
+    env->m.state = st_done;
+    p->running = false;
+  }
+}
+
+datum* pami_result(const pami_instance* p) {
+  return p->result;
+}
+
+error pami_error(const pami_instance* p) {
+  return p->env->err;
+}
+
+void pami_set_quota(pami_instance* p, const env_quota* q) {
+  env_set_quota(p->env, q);
+}
+
+size_t pami_run_tasks(pami_instance* p, size_t quantum, size_t turns) {
+  return sched_run(p->env, quantum, turns);
+}
+
+enum sched_RES pami_collect_task(pami_instance* p, int64_t id, datum** result, error* err) {
+  return sched_collect(p->env, id, result, err);
+}
+
+/*
+ * -------------------------------------
+ * |            ###BATCH###            |
+ * -------------------------------------
+ */
+
+/* a batch evaluates many independent scripts with a few workers,
+ * each with an instance of its own that is reset between scripts.
+ * the jobs start split in equal runs, one per worker, and a worker
+ * that is out of jobs steals half of those left to another one.
+ * with PAMI_THREADS every worker but the first runs in a thread of
+ * its own, otherwise they all run on the calling thread in turn.
+ */
+typedef struct {
+  const char* text;
+  size_t size;
+  bool ok;        /* set by pami_batch */
+  error err;      /* if it is not ok */
+  size_t worker;  /* that evaluated it */
+} pami_job;
+
+/* called by the worker right after evaluating 'job', its result is
+ * in 'p' until the next one. with threads the calls are concurrent.
+ */
+typedef void (*pami_job_done)(pami_instance* p, pami_job* job, void* ctx);
+
+typedef struct {
+  size_t workers;
+  const env_quota* quota;  /* limits of each job, or NULL */
+  pami_job_done done;      /* or NULL */
+  void* ctx;
+} pami_batch_config;
+
+/* returns the size of the region required by pami_batch */
+size_t pami_batch_size(const env_config* cfg, size_t workers);
+
+/* evaluates every job, the instances are carved from 'buff' and
+ * created once. returns env_OK when they are all done, the outcome
+ * of each one is in the job itself.
+ */
+enum env_RES pami_batch(uint8_t* buff, size_t size, const env_config* cfg,
+                        const pami_batch_config* bc, pami_job* jobs, size_t njobs);
+
+struct batch;
+
+/* each worker takes whole cache lines, so the range stolen from
+ * shares none with another worker
+ */
+typedef struct {
+  uint64_t range;  /* jobs left, the first in the high half, the end in the low */
+  pami_instance* p;
+  size_t id;
+  bool fresh;      /* no job evaluated since it was created */
+  struct batch* b;
+#ifdef PAMI_THREADS
+  pthread_t thread;
+  bool started;
+#endif
+} batch_worker;
+
+typedef struct batch {
+  uint8_t* workers;  /* batch_line(sizeof(batch_worker)) apart */
+  size_t nworkers;
+  pami_job* jobs;
+  const pami_batch_config* bc;
+} batch;
+
+size_t batch_line(size_t size) {
+  return size + (CACHE_LINE - size%CACHE_LINE)%CACHE_LINE;
+}
+
+batch_worker* batch_at(batch* b, size_t i) {
+  return (batch_worker*)(b->workers + i*batch_line(sizeof(batch_worker)));
+}
+
+uint64_t batch_range(uint64_t first, uint64_t end) {
+  return first << 32 | end;
+}
+
+/* the owner takes from the end, with a compare and swap like the
+ * thieves, so the two ends never race
+ */
+bool batch_pop(batch_worker* w, uint32_t* job) {
+  uint64_t r, first, end;
+
+  for (;;) {
+    r = word_load(&w->range);
+    first = r >> 32;
+    end = r & 0xffffffff;
+    if (first == end) {
+      return false;
+    }
+    if (word_cas(&w->range, r, batch_range(first, end - 1))) {
+      *job = (uint32_t)(end - 1);
+      return true;
+    }
+  }
+}
+
+/* thieves take the first half. indices only ever move from one
+ * range to an empty one, so a range never holds a value twice and
+ * a stale compare always fails.
+ */
+bool batch_steal(batch_worker* w, uint32_t* job) {
+  batch* b = w->b;
+  batch_worker* victim;
+  uint64_t r, first, end, half;
+  size_t i;
+
+  for (i = 1; i < b->nworkers; i++) {
+    victim = batch_at(b, (w->id + i) % b->nworkers);
+    for (;;) {
+      r = word_load(&victim->range);
+      first = r >> 32;
+      end = r & 0xffffffff;
+      if (first == end) {
+        break;
+      }
+      half = (end - first + 1)/2;
+      if (word_cas(&victim->range, r, batch_range(first + half, end))) {
+        word_store(&w->range, batch_range(first + 1, first + half));
+        *job = (uint32_t)first;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void batch_eval(batch_worker* w, pami_job* job) {
+  pami_instance* p = w->p;
+  const pami_batch_config* bc = w->b->bc;
+
+  job->worker = w->id;
+  /* it worked when created, only a rom program that fails can stop it */
+  if (w->fresh == false && pami_reset(p) != env_OK) {
+    job->ok = false;
+  } else {
+    job->ok = pami_eval(p, job->text, job->size);
+  }
+  w->fresh = false;
+  job->err = pami_error(p);
+  if (bc->done != NULL) {
+    bc->done(p, job, bc->ctx);
+  }
+}
+
+void batch_work(batch_worker* w) {
+  uint32_t job;
+
+  while (batch_pop(w, &job) || batch_steal(w, &job)) {
+    batch_eval(w, &w->b->jobs[job]);
+  }
+}
+
+#ifdef PAMI_THREADS
+void* batch_thread(void* arg) {
+  batch_work((batch_worker*)arg);
+  return NULL;
+}
+#endif
+
+/* the workers and then their instances, from the first cache line of the region */
+size_t pami_batch_size(const env_config* cfg, size_t workers) {
+  return CACHE_LINE + workers*(batch_line(sizeof(batch_worker)) + batch_line(pami_size(cfg)));
+}
+
+enum env_RES pami_batch(uint8_t* buff, size_t size, const env_config* cfg,
+                        const pami_batch_config* bc, pami_job* jobs, size_t njobs) {
+  size_t n = bc->workers == 0 ? 1 : bc->workers;
+  size_t stride = batch_line(pami_size(cfg));
+  uint8_t* regions;
+  batch_worker* w;
+  enum env_RES res;
+  batch b;
+  size_t i;
+
+  if (buff == NULL || size < pami_batch_size(cfg, n) || njobs > UINT32_MAX) {
+    return env_ERR_SMALLBUFF;
+  }
+  b.workers = buff + (CACHE_LINE - (uintptr_t)buff%CACHE_LINE)%CACHE_LINE;
+  b.nworkers = n;
+  b.jobs = jobs;
+  b.bc = bc;
+  regions = b.workers + n*batch_line(sizeof(batch_worker));
+
+  for (i = 0; i < n; i++) {
+    w = batch_at(&b, i);
+    w->b = &b;
+    w->id = i;
+    w->fresh = true;
+    w->range = batch_range(njobs*i/n, njobs*(i + 1)/n);
+    w->p = pami_create(regions + i*stride, stride, cfg, &res);
+    if (w->p == NULL) {
+      return res;
+    }
+    pami_set_quota(w->p, bc->quota);
+  }
+
+#ifdef PAMI_THREADS
+  for (i = 1; i < n; i++) {
+    w = batch_at(&b, i);
+    /* if it does not start the others steal its jobs */
+    w->started = pthread_create(&w->thread, NULL, batch_thread, w) == 0;
+  }
+  batch_work(batch_at(&b, 0));
+  for (i = 1; i < n; i++) {
+    w = batch_at(&b, i);
+    if (w->started) {
+      pthread_join(w->thread, NULL);
+    }
+  }
+#else
+  for (i = 0; i < n; i++) {
+    batch_work(batch_at(&b, i));
+  }
+#endif
+  return env_OK;
+}
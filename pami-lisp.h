@@ -3,8 +3,10 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 struct datum;
+struct environment;
 
 typedef struct {
   int16_t start;
@@ -21,13 +23,23 @@ typedef struct {
   struct datum* cdr;
 } pair;
 
-typedef struct datum*(*lambda)(struct datum*);
-typedef struct datum*(*cproc)(struct datum*);
+/* 'code' is (params . body), 'env' is the frame it closes over */
+typedef struct {
+  struct datum* code;
+  struct datum* env;
+} lambda;
+
+/* builtins receive their evaluated arguments in place, in the value
+ * stack, and write the result to 'out'. returns false if there was
+ * an error, the error is stored in the environment.
+ */
+typedef bool (*cproc)(struct environment* env, struct datum** args, size_t argc, struct datum** out);
 
 enum datum_tag {
   EXACT_NUM, INEXACT_NUM,
   BOOL, STRING, LAMBDA,
-  C_PROC, SYMBOL, PAIR
+  C_PROC, SYMBOL, PAIR,
+  CODE
 };
 
 typedef union {
@@ -42,18 +54,59 @@ typedef union {
   /* only generated on evaluation */
   cproc cproc;
   lambda lambda;
+
+  /* only generated by the compiler */
+  const uint8_t* code;
 } datum_union;
 
+#ifdef PAMI_COMPACT
+/* compact layout: a datum* is a tagged word, see the REPRESENTATION
+ * section of pami-lisp.c. nil, fixnums and booleans live in the word
+ * itself, pairs and lambdas keep two words in a cell and are told
+ * apart by the tag of the pointer, only the rest are boxed cells that
+ * look like this.
+ */
+typedef struct datum {
+  uint16_t tag;
+  int16_t start;
+  int16_t len;
+  union {
+    int64_t exact_num;
+    double inexact_num;
+    char* buff;
+    cproc cproc;
+    const uint8_t* code;
+  } data;
+} datum;
+#else
 typedef struct datum {
   enum datum_tag tag;
   datum_union data;
 } datum;
+#endif
 
 enum error_code {
   error_contract_violation,
   error_bad_rune,
   error_internal_lexer,
-  error_unrecognized_rune
+  error_unrecognized_rune,
+  error_unexpected_eof,
+  error_unexpected_lexeme,
+  error_string_too_long,
+  error_pool_exhausted,
+  error_symbols_exhausted,
+  error_freelist_exhausted,
+  error_stack_exhausted,
+  error_unbound_symbol,
+  error_not_applicable,
+  error_arity,
+  error_bad_form,
+  error_code_exhausted,
+  error_number_overflow,
+  error_quota_exceeded,
+  /* a state that can't be reached was, it is a bug of pami-lisp */
+  error_internal,
+  error_lexeme_too_long
 };
 
 typedef struct {
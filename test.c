@@ -1,6 +1,12 @@
+#define _XOPEN_SOURCE 600
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef PAMI_THREADS
+#include <pthread.h>
+#endif
 #include "pami-lisp.c"
 
 char* utf8_test_data = "\x68\U00000393\U000030AC\U000101FA";
@@ -8,7 +14,7 @@ char* utf8_test_data = "\x68\U00000393\U000030AC\U000101FA";
 void check_rune(char** curr_char, rune expected) {
   rune r;
   size_t rune_size;
-  rune_size = utf8_decode(*curr_char, &r);
+  rune_size = utf8_decode(*curr_char, strlen(*curr_char), &r);
   if (rune_size > 0) {
     *curr_char += rune_size;
     if (r != expected) {
@@ -21,13 +27,104 @@ void check_rune(char** curr_char, rune expected) {
   }
 }
 
-/* very weak test, but can be improved later */
+/* sequences at the edges of table 3-7 of the unicode standard,
+ * and the length of the valid prefix of each
+ */
+struct {
+  const char* text;
+  size_t valid;
+} utf8_edges[] = {
+  { "\x7f", 1 },
+  { "\xc2\x80", 2 },
+  { "\xdf\xbf", 2 },
+  { "\xe0\xa0\x80", 3 },
+  { "\xed\x9f\xbf", 3 },          /* U+D7FF */
+  { "\xee\x80\x80", 3 },          /* U+E000 */
+  { "\xf0\x90\x80\x80", 4 },
+  { "\xf4\x8f\xbf\xbf", 4 },      /* U+10FFFF */
+  { "\xc0\x80", 0 },              /* overlong */
+  { "\xc1\xbf", 0 },
+  { "\xe0\x9f\xbf", 0 },
+  { "\xf0\x8f\xbf\xbf", 0 },
+  { "\xed\xa0\x80", 0 },          /* surrogate */
+  { "\xed\xbf\xbf", 0 },
+  { "\xf4\x90\x80\x80", 0 },      /* past U+10FFFF */
+  { "\xf5\x80\x80\x80", 0 },
+  { "\xff", 0 },
+  { "a\x80", 1 },                  /* lone continuation */
+  { "ab\xe3\x82", 2 },             /* cut short */
+  { "ab\xe3\x82\xac", 5 },
+  { "\xe3\x82" "a", 0 },
+};
+
+/* whole buffers, each of them fed to a stream split in two at
+ * every point, validated at every offset, decoded if it's a single
+ * sequence and lexed inside a long string
+ */
+void utf8_strict_test() {
+  char text[80];
+  utf8_state s;
+  size_t i, k, n, at;
+  lexer l;
+  rune r;
+
+  for (i = 0; i < sizeof(utf8_edges)/sizeof(utf8_edges[0]); i++) {
+    n = strlen(utf8_edges[i].text);
+    if (utf8_valid(utf8_edges[i].text, n) != utf8_edges[i].valid) {
+      printf("utf8_valid: edge %d\n", (int)i);
+      abort();
+    }
+    for (k = 0; k <= n; k++) {
+      memset(&s, 0, sizeof(s));
+      at = utf8_scan(&s, (const uint8_t*)utf8_edges[i].text, k);
+      if (at == k) {
+        at = k + utf8_scan(&s, (const uint8_t*)utf8_edges[i].text + k, n - k);
+      }
+      if ((at == n && s.need == 0) != (utf8_edges[i].valid == n)) {
+        printf("utf8_scan: edge %d split at %d\n", (int)i, (int)k);
+        abort();
+      }
+    }
+    if ((utf8_edges[i].text[0] & 0x80) != 0 &&
+        (utf8_decode(utf8_edges[i].text, n, &r) == n) != (utf8_edges[i].valid == n)) {
+      printf("utf8_decode: edge %d\n", (int)i);
+      abort();
+    }
+
+    /* behind runes of two bytes and in front of runes of three, so it
+     * falls at every place of a block of 16
+     */
+    for (k = 0; k < 40; k++) {
+      memset(text, 0, sizeof(text));
+      for (at = 0; at + 2 <= k; at += 2) {
+        memcpy(text + at, "\xc3\xa9", 2);
+      }
+      memcpy(text + at, "a", k%2);
+      at += k%2;
+      sprintf(text + at, "%s\xe3\x82\xac\xe3\x82\xac\xe3\x82\xac\xe3\x82\xac\xe3\x82\xac", utf8_edges[i].text);
+      if (utf8_valid(text, strlen(text)) != at + (utf8_edges[i].valid == n ? n + 15 : utf8_edges[i].valid)) {
+        printf("utf8_valid: edge %d at %d\n", (int)i, (int)at);
+        abort();
+      }
+    }
+
+    sprintf(text, "\"a string long enough to be scanned in bulk %s\"", utf8_edges[i].text);
+    l = lex_new_lexer(text, strlen(text));
+    if (lex_next(&l) != (utf8_edges[i].valid == n)) {
+      printf("lex_next: edge %d\n", (int)i);
+      abort();
+    }
+  }
+}
+
 void utf8_test() {
   char* curr_char = utf8_test_data;
   check_rune(&curr_char, 0x68);
   check_rune(&curr_char, 0x0393);
   check_rune(&curr_char, 0x30AC);
   check_rune(&curr_char, 0x101FA);
+
+  utf8_strict_test();
   printf("utf8_test: OK\n");
 }
 
@@ -44,8 +141,1626 @@ void print_lexeme(const char* input, lexeme l) {
   putchar('\n');
 }
 
+size_t naive_scan_until(const uint8_t* p, size_t i, size_t n, uint8_t a, uint8_t b) {
+  while (i < n && p[i] != a && p[i] != b && p[i] != 0) {
+    i++;
+  }
+  return i;
+}
+
+size_t naive_scan_space(const uint8_t* p, size_t i, size_t n) {
+  while (i < n && (p[i] == ' ' || p[i] == '\n' || p[i] == '\r' || p[i] == '\t')) {
+    i++;
+  }
+  return i;
+}
+
+/* lexes 'text' and checks that it ends with 'code', or without error if -1 */
+void check_lex(const char* text, int code) {
+  lexer l = lex_new_lexer(text, strlen(text));
+  while (lex_next(&l) && l.lexeme.kind != lk_eof) {
+  }
+  if ((code < 0) != (l.lexeme.kind == lk_eof) || (code >= 0 && (int)l.err.code != code)) {
+    printf("check_lex: %s\n", text);
+    abort();
+  }
+}
+
+/* the bulk scanners against byte loops, from every offset of
+ * texts longer than a few blocks with the stop byte at every position
+ */
+void scan_test() {
+  uint8_t text[80];
+  const uint8_t stops[] = { '"', '\\', '\n', 0, 0x80, 0xce, 'x' };
+  size_t i, j, k;
+
+  for (k = 0; k < sizeof(stops); k++) {
+    for (j = 0; j <= sizeof(text); j++) {
+      memset(text, ' ', sizeof(text));
+      if (j < sizeof(text)) {
+        text[j] = stops[k];
+      }
+      for (i = 0; i <= sizeof(text); i++) {
+        if (lex_scan_until(text, i, sizeof(text), '"', '\\') != naive_scan_until(text, i, sizeof(text), '"', '\\') ||
+            lex_scan_until(text, i, sizeof(text), '\n', '\n') != naive_scan_until(text, i, sizeof(text), '\n', '\n') ||
+            lex_scan_space(text, i, sizeof(text)) != naive_scan_space(text, i, sizeof(text))) {
+          printf("scan_test: stop 0x%x at %d from %d\n", stops[k], (int)j, (int)i);
+          abort();
+        }
+      }
+    }
+  }
+
+  check_lex("# a comment long enough to be scanned in bulk, ünïcödé \xce\x93\n(a)", -1);
+  check_lex("\"a string long enough to be scanned in bulk, \\\" ünïcödé \xce\x93\" b", -1);
+  check_lex("                                   \t\r\n                      x", -1);
+  check_lex("# a comment long enough to be scanned in bulk, then \xce a bad rune\n", error_bad_rune);
+  check_lex("\"a string long enough to be scanned in bulk, then \xff a bad rune\"", error_bad_rune);
+  check_lex("\"a string long enough to be scanned in bulk, then cut \xe3\x82", error_bad_rune);
+  printf("scan_test: OK\n");
+}
+
+const char stream_test_data[] =
+  "# a comment much longer than the window used to lex this script\n"
+  "(define (f x) (if (> x 0x1F) \"a \\\"str\\\" ünïcödé\" 0b1010)) \r\n"
+  "  '(alpha beta 123 12.75 true false nil)   # trailing comment\n"
+  "(\"\xe3\x82\xac\" identifier_with_more_than_ten_runes \"\xf0\x90\x87\xba\")\n"
+  "# and the script ends inside one";
+
+/* lexes the whole input through a stream, fed 'chunk' bytes at a
+ * time. returns how many lexemes it read or -1 with the error in 'err'
+ */
+int stream_lex(const char* text, size_t size, char* window, size_t cap, size_t chunk, lexeme* out,
+               error* err) {
+  lex_stream s;
+  size_t fed = 0;
+  int count = 0;
+  enum lex_RES res;
+
+  lex_stream_init(&s, window, cap);
+  while (true) {
+    res = lex_stream_next(&s);
+    if (res == lex_ERR) {
+      *err = s.l.err;
+      return -1;
+    }
+    if (res == lex_MORE) {
+      if (fed == size) {
+        lex_stream_end(&s);
+      } else {
+        fed += lex_stream_feed(&s, text + fed, fed + chunk > size ? size - fed : chunk);
+      }
+      continue;
+    }
+    out[count] = s.l.lexeme;
+    out[count].begin += s.offset;
+    out[count].end += s.offset;
+    count++;
+    if (s.l.lexeme.kind == lk_eof) {
+      return count;
+    }
+  }
+}
+
+/* every chunk size must give the same lexemes as the whole text */
+void stream_test() {
+  lexeme whole[64], part[64];
+  char window[40];
+  error err;
+  size_t size = strlen(stream_test_data);
+  size_t chunk;
+  lexer l = lex_new_lexer(stream_test_data, size);
+  int count = 0, i;
+
+  while (lex_next(&l)) {
+    whole[count++] = l.lexeme;
+    if (l.lexeme.kind == lk_eof) {
+      break;
+    }
+  }
+  if (l.lexeme.kind != lk_eof) {
+    printf("stream_test: lex error %d\n", l.err.code);
+    abort();
+  }
+
+  for (chunk = 1; chunk <= sizeof(window); chunk++) {
+    if (stream_lex(stream_test_data, size, window, sizeof(window), chunk, part, &err) != count) {
+      printf("stream_test: chunks of %d\n", (int)chunk);
+      abort();
+    }
+    for (i = 0; i < count; i++) {
+      if (part[i].kind != whole[i].kind || part[i].begin != whole[i].begin ||
+          part[i].end != whole[i].end ||
+          (part[i].kind == lk_num && (part[i].vkind != whole[i].vkind ||
+                                      part[i].value.exact_num != whole[i].value.exact_num)) ||
+          (part[i].kind == lk_bool && part[i].value.boolean != whole[i].value.boolean)) {
+        printf("stream_test: chunks of %d, lexeme %d\n", (int)chunk, i);
+        abort();
+      }
+    }
+  }
+
+  /* a lexeme that doesn't fit, a bad rune and one cut short by the end */
+  if (stream_lex("(a_very_long_identifier_indeed)", 31, window, 8, 3, part, &err) != -1 ||
+      err.code != error_lexeme_too_long ||
+      stream_lex("(ab \xed\xa0\x80)", 8, window, 8, 3, part, &err) != -1 ||
+      err.code != error_bad_rune ||
+      stream_lex("(ab \xe3\x82", 6, window, 8, 1, part, &err) != -1 ||
+      err.code != error_bad_rune) {
+    printf("stream_test: errors %d\n", err.code);
+    abort();
+  }
+  printf("stream_test: OK\n");
+}
+
+/* lexes 'text' as one number, it must be valid if 'ok' */
+lexeme check_number(const char* text, bool ok) {
+  lexer l = lex_new_lexer(text, strlen(text));
+  if (lex_next(&l) != ok || (ok == false && l.err.code != error_number_overflow)) {
+    printf("check_number: %s\n", text);
+    abort();
+  }
+  return l.lexeme;
+}
+
+void check_lex_exact(const char* text, uint64_t expected) {
+  if (check_number(text, true).value.exact_num != expected) {
+    printf("check_lex_exact: %s\n", text);
+    abort();
+  }
+}
+
+/* the lexer must round exactly like strtod */
+void check_lex_inexact(const char* text) {
+  char buff[800];
+  size_t i, n = 0;
+  double value = check_number(text, true).value.inexact_num;
+  double expected;
+  for (i = 0; text[i] != 0; i++) {
+    if (text[i] != '_') {
+      buff[n++] = text[i];
+    }
+  }
+  buff[n] = 0;
+  expected = strtod(buff, NULL);
+  if (memcmp(&value, &expected, sizeof(double)) != 0) {
+    printf("check_lex_inexact: %s %.17g != %.17g\n", text, value, expected);
+    abort();
+  }
+}
+
+void number_test() {
+  char big[400];
+
+  check_lex_exact("0", 0);
+  check_lex_exact("1_000_000", 1000000);
+  check_lex_exact("12345678901234567", 12345678901234567);
+  check_lex_exact("00000000000000000000000000000123", 123);
+  check_lex_exact("9223372036854775807", INT64_MAX);
+  check_lex_exact("0xCAFE_f00d", 0xcafef00d);
+  check_lex_exact("0xFFFFFFFFFFFFFFFF", UINT64_MAX);
+  check_lex_exact("0b1010", 10);
+  check_number("9223372036854775808", false);
+  check_number("123456789012345678901234", false);
+  check_number("0x1_0000_0000_0000_0000", false);
+  check_number("0b1_0000000000000000000000000000000000000000000000000000000000000000", false);
+
+  check_lex_inexact("0.1");
+  check_lex_inexact("1.");
+  check_lex_inexact("12.75");
+  check_lex_inexact("0.30000000000000004");
+  check_lex_inexact("3.141592653589793238462643383279");
+  check_lex_inexact("123456789012345678.901234567");
+  check_lex_inexact("9007199254740993.0");  /* halfway, rounds to even */
+  check_lex_inexact("0.000000000000000000000000000000000000000000000000000000000000001");
+  check_lex_inexact("2.2250738585072011");
+  check_lex_inexact("1_234.567_8");
+
+  /* the largest double, then ten times it */
+  memset(big, '0', sizeof(big));
+  memcpy(big, "17976931348623157", 17);
+  strcpy(big + 309, ".0");
+  check_lex_inexact(big);
+  big[309] = '0';
+  strcpy(big + 310, ".0");
+  check_number(big, false);
+  printf("number_test: OK\n");
+}
+
+uint8_t env_buff[1 << 18];
+
+env_config test_config(size_t eval_depth) {
+  env_config cfg;
+  cfg.cells = 4096;
+  cfg.strings = 4096;
+  cfg.parse_depth = 256;
+  cfg.eval_depth = eval_depth;
+  cfg.values = 64;
+  cfg.symbols = 256;
+  cfg.gc_depth = 16;
+  cfg.gc_reserve = 64;
+  cfg.gc_string_reserve = 256;
+  cfg.gc_incremental = false;
+  cfg.gc_step_allocs = 0;
+  cfg.gc_step_work = 0;
+  cfg.code = 4096;
+  cfg.constants = 256;
+  cfg.rom = NULL;
+  cfg.rom_size = 0;
+  cfg.tasks = 0;
+  cfg.task_depth = 0;
+  cfg.task_values = 0;
+  return cfg;
+}
+
+environment* new_env(const env_config* cfg) {
+  enum env_RES res;
+  environment* env = env_create(env_buff, sizeof(env_buff), cfg, &res);
+  if (env == NULL) {
+    printf("could not create environment: %s\n", env_str_res(res));
+    abort();
+  }
+  return env;
+}
+
+environment* new_eval_env(size_t eval_depth) {
+  env_config cfg = test_config(eval_depth);
+  return new_env(&cfg);
+}
+
+datum* nth(datum* list, int n) {
+  while (n > 0) {
+    list = dt_cdr(list);
+    n--;
+  }
+  return dt_car(list);
+}
+
+void check_tag(datum* d, enum datum_tag tag) {
+  if (d == NULL || dt_tag(d) != tag) {
+    printf("expected tag %d\n", tag);
+    abort();
+  }
+}
+
+void check_symbol(datum* d, const char* name) {
+  check_tag(d, SYMBOL);
+  if (dt_str(d).len != (int16_t)strlen(name) ||
+      memcmp(dt_str(d).buff, name, strlen(name)) != 0) {
+    printf("expected symbol %s\n", name);
+    abort();
+  }
+}
+
+void pool_test() {
+  uint8_t buff[sizeof(pool) + 16*sizeof(datum)];
+  enum pool_RES res;
+  pool* p = pool_create(buff, sizeof(buff), sizeof(datum), &res);
+  void* a; void* b;
+  pool_stats st;
+
+  a = pool_alloc(p);
+  b = pool_alloc(p);
+  pool_free(p, a);
+  st = pool_get_stats(p);
+  if (st.chunks != 16 || st.free != 15 || st.used != 1 ||
+      st.high_water != 2 || st.allocs != 2 || st.frees != 1 ||
+      pool_available(p) != 15*sizeof(datum) || pool_empty(p)) {
+    printf("wrong pool counters\n");
+    abort();
+  }
+  pool_free(p, b);
+  if (pool_empty(p) == false || pool_used(p) != 0) {
+    printf("pool should be empty\n");
+    abort();
+  }
+  printf("pool_test: OK\n");
+}
+
+void cpool_test() {
+  static uint8_t buff[4096];
+  void* chunks[256];
+  enum pool_RES res;
+  cpool_cache a, b;
+  cpool* p = cpool_create(buff, sizeof(buff), 24, &res);
+  size_t n = 0, i;
+
+  if (p == NULL || p->nchunks < CPOOL_BATCH + 1 || cpool_available(p) != p->nchunks*24) {
+    printf("could not create the concurrent pool\n");
+    abort();
+  }
+  cpool_cache_init(&a);
+  cpool_cache_init(&b);
+  while ((chunks[n] = cpool_alloc(p, &a)) != NULL) {
+    memset(chunks[n], 0xff, 24);
+    n++;
+  }
+  if (n != p->nchunks || cpool_available(p) != 0 || cpool_alloc(p, &b) != NULL) {
+    printf("expected %lu chunks, got %lu\n", (unsigned long)p->nchunks, (unsigned long)n);
+    abort();
+  }
+  if (cpool_free(p, &b, (uint8_t*)chunks[1] + 1) != pool_ERR_ALIGN ||
+      cpool_free(p, &b, buff) != pool_ERR_BOUNDS) {
+    printf("expected bad pointers to be refused\n");
+    abort();
+  }
+
+  /* chunks freed by one cache are allocated by another once flushed */
+  for (i = 0; i < n; i++) {
+    if (cpool_free(p, &b, chunks[i]) != pool_OK) {
+      printf("could not free chunk %lu\n", (unsigned long)i);
+      abort();
+    }
+  }
+  if (cpool_available(p) == 0 || cpool_available(p) > (n - CPOOL_BATCH)*24) {
+    printf("full magazines should be in the stack\n");
+    abort();
+  }
+  cpool_flush(p, &b);
+  if (cpool_available(p) != n*24 || a.allocs != n || b.frees != n) {
+    printf("flush did not give every chunk back\n");
+    abort();
+  }
+  for (i = 0; i < n; i++) {
+    if (cpool_alloc(p, &b) == NULL) {
+      printf("could not allocate again\n");
+      abort();
+    }
+  }
+  cpool_free_all(p);
+  cpool_cache_init(&b);
+  if (cpool_available(p) != n*24) {
+    printf("free_all did not give every chunk back\n");
+    abort();
+  }
+
+  /* the shared words are aligned whatever the buffer is */
+  p = cpool_create(buff + 4, sizeof(buff) - 4, 24, &res);
+  if (p == NULL || (uintptr_t)&p->top%CACHE_LINE != 0 || (uintptr_t)p->below%sizeof(uint64_t) != 0 ||
+      p->begin + p->nchunks*24 > buff + sizeof(buff)) {
+    printf("the concurrent pool is not aligned\n");
+    abort();
+  }
+  printf("cpool_test: OK\n");
+}
+
+void freelist_test() {
+  uint8_t buff[4096];
+  void* objs[64];
+  enum fl_RES res;
+  freelist* fl = fl_create(buff, sizeof(buff), &res);
+  size_t i, hole;
+
+  for (i = 0; i < 64; i++) {
+    objs[i] = fl_alloc(fl, 1 + (i*7)%40);
+    if (objs[i] == NULL) {
+      printf("could not allocate object %d\n", (int)i);
+      abort();
+    }
+  }
+  for (i = 0; i < 64; i += 2) {
+    fl_free(fl, objs[i]);
+  }
+  /* small blocks are reused straight from their size class */
+  if (fl_alloc(fl, 1 + (62*7)%40) != objs[62]) {
+    printf("small block was not reused\n");
+    abort();
+  }
+  fl_free(fl, objs[62]);
+  for (i = 1; i < 64; i += 2) {
+    fl_free(fl, objs[i]);
+  }
+  if (fl_available(fl) != fl->size) {
+    printf("freelist leaked memory\n");
+    abort();
+  }
+  /* the segregated lists are flushed when the main list can't serve */
+  if (fl_alloc(fl, fl->size - 2*sizeof(fl_obj_header)) == NULL) {
+    printf("freelist did not coalesce the size classes\n");
+    abort();
+  }
+  /* with the classes off every free coalesces with both neighbours */
+  fl_free_all(fl);
+  fl->nclasses = 0;
+  for (i = 0; i < 3; i++) {
+    objs[i] = fl_alloc(fl, 100);
+  }
+  hole = fl_objsize(objs[1]);
+  fl_free(fl, objs[1]);
+  if (fl_largest(fl) != fl_available(fl) - hole) {
+    printf("fl_largest should skip the hole\n");
+    abort();
+  }
+  fl_free(fl, objs[0]);
+  fl_free(fl, objs[2]);
+  if (fl->head == NULL || FL_SIZE(fl->head) != fl->size || fl->head->next != NULL) {
+    printf("freelist did not coalesce neighbouring blocks\n");
+    abort();
+  }
+  printf("freelist_test: OK\n");
+}
+
+void hashmap_test() {
+  uint8_t buff[sizeof(hashmap) + 64*sizeof(hm_entry)];
+  char keys[56][4];
+  enum hm_RES res;
+  hashmap* hm = hm_create(buff, sizeof(buff), &res);
+  size_t i;
+
+  for (i = 0; i < 56; i++) {
+    sprintf(keys[i], "k%02d", (int)i);
+    if (hm_put(hm, keys[i], 3, keys[i]) != hm_OK) {
+      printf("could not insert %s\n", keys[i]);
+      abort();
+    }
+  }
+  if (hm_put(hm, "full", 4, NULL) != hm_ERR_FULL) {
+    printf("expected the hashmap to be full\n");
+    abort();
+  }
+  for (i = 0; i < 56; i++) {
+    if (hm_get(hm, keys[i], 3) != keys[i]) {
+      printf("wrong value for %s\n", keys[i]);
+      abort();
+    }
+  }
+  if (hm_get(hm, "k99", 3) != NULL) {
+    printf("found a key that was never inserted\n");
+    abort();
+  }
+  printf("hashmap_test: OK\n");
+}
+
+char parse_test_data[] = "(+ abc 0x10 1.5 \"a\\n\\\"b\") 'x () nil true # comment\n";
+
+void parse_test() {
+  environment* env = new_eval_env(64);
+  datum* program;
+  datum* expr;
+  datum* abc;
+  size_t depth;
+  char deep[2048];
+
+  if (parse(env, parse_test_data, strlen(parse_test_data), &program) == false) {
+    printf("parse error at %d:%d number %d\n", env->err.range.begin, env->err.range.end, env->err.code);
+    abort();
+  }
+
+  expr = nth(program, 0);
+  abc = nth(expr, 1);
+  check_symbol(nth(expr, 0), "+");
+  check_symbol(nth(expr, 1), "abc");
+  check_tag(nth(expr, 2), EXACT_NUM);
+  check_tag(nth(expr, 3), INEXACT_NUM);
+  check_tag(nth(expr, 4), STRING);
+  if (dt_exact(nth(expr, 2)) != 16 ||
+      dt_inexact(nth(expr, 3)) != 1.5 ||
+      dt_str(nth(expr, 4)).len != 4 ||
+      memcmp(dt_str(nth(expr, 4)).buff, "a\n\"b", 4) != 0) {
+    printf("wrong atom values\n");
+    abort();
+  }
+
+  expr = nth(program, 1);
+  check_symbol(nth(expr, 0), "quote");
+  check_symbol(nth(expr, 1), "x");
+  if (nth(program, 2) != NULL || nth(program, 3) != NULL) {
+    printf("expected nil\n");
+    abort();
+  }
+  check_tag(nth(program, 4), BOOL);
+
+  /* symbols are interned */
+  if (parse(env, "(abc +)", 7, &program) == false ||
+      nth(nth(program, 0), 0) != abc ||
+      nth(nth(program, 0), 1) != env_intern(env, "+", 1)) {
+    printf("symbols were not interned\n");
+    abort();
+  }
+
+  /* nesting is only limited by the size of the stack */
+  for (depth = 0; depth < sizeof(deep)/2; depth++) {
+    deep[depth] = '(';
+    deep[sizeof(deep)-1-depth] = ')';
+  }
+  env = new_eval_env(64);
+  if (parse(env, deep, sizeof(deep), &program) == true ||
+      env->err.code != error_stack_exhausted) {
+    printf("expected stack exhaustion\n");
+    abort();
+  }
+  if (parse(env, deep+sizeof(deep)/2-64, 128, &program) == false) {
+    printf("parse error at %d:%d number %d\n", env->err.range.begin, env->err.range.end, env->err.code);
+    abort();
+  }
+
+  if (parse(env, "(a b", 4, &program) == true ||
+      env->err.code != error_unexpected_lexeme) {
+    printf("expected unexpected lexeme\n");
+    abort();
+  }
+  printf("parse_test: OK\n");
+}
+
+datum* check_eval(environment* env, const char* text) {
+  datum* out;
+  if (eval_string(env, text, strlen(text), &out) == false) {
+    printf("error evaluating '%s': %d\n", text, env->err.code);
+    abort();
+  }
+  return out;
+}
+
+void check_exact(environment* env, const char* text, int64_t expected) {
+  datum* out = check_eval(env, text);
+  if (out == NULL || dt_tag(out) != EXACT_NUM || dt_exact(out) != expected) {
+    printf("'%s' did not evaluate to %ld\n", text, (long)expected);
+    abort();
+  }
+}
+
+void check_eval_err(environment* env, const char* text, enum error_code code) {
+  datum* out;
+  if (eval_string(env, text, strlen(text), &out) == true || env->err.code != code) {
+    printf("'%s' should have failed with %d\n", text, code);
+    abort();
+  }
+}
+
+void eval_test() {
+  environment* env = new_eval_env(64);
+  check_exact(env, "(+ 1 2 (* 3 4))", 15);
+  check_exact(env, "(define x 10) (set! x (- x 3)) x", 7);
+  check_exact(env, "(define (add a b) (+ a b)) (add 2 3)", 5);
+  check_exact(env, "((lambda args (car (cdr args))) 1 2 3)", 2);
+  check_exact(env, "(define (adder n) (lambda (x) (+ x n))) ((adder 5) 1)", 6);
+  check_exact(env, "(if (< 1 2) 1 2)", 1);
+  check_exact(env, "(begin 1 2 (car '(3 4)))", 3);
+  check_eval_err(env, "(undefined 1)", error_unbound_symbol);
+  check_eval_err(env, "(1 2)", error_not_applicable);
+  check_eval_err(env, "(add 1)", error_arity);
+  check_eval_err(env, "(if)", error_bad_form);
+  check_eval_err(env, "(car 1)", error_contract_violation);
+
+  /* numbers too big for a fixnum in the compact layout */
+  check_exact(env, "(+ 4611686018427387903 1)", (int64_t)1 << 62);
+  check_exact(env, "(- 0 4611686018427387904 4611686018427387904)", INT64_MIN);
+  check_exact(env, "(if (eq? (+ 4611686018427387903 1) 4611686018427387904) 1 0)", 1);
+
+  /* tail calls run in a constant amount of continuations */
+  env = new_eval_env(8);
+  check_exact(env, "(define (loop n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1)))) (loop 100000 0)", 100000);
+  check_eval_err(env, "(define (deep n) (if (= n 0) 0 (+ 1 (deep (- n 1))))) (deep 500)", error_stack_exhausted);
+  printf("eval_test: OK\n");
+}
+
+datum* check_vm(environment* env, const char* text) {
+  datum* code;
+  datum* out;
+  if (compile_string(env, text, strlen(text), &code) == false) {
+    printf("could not compile '%s': error %d\n", text, env->err.code);
+    abort();
+  }
+  if (vm_run(env, code, &out) == false) {
+    printf("could not run '%s': error %d\n", text, env->err.code);
+    abort();
+  }
+  return out;
+}
+
+void check_vm_exact(environment* env, const char* text, int64_t expected) {
+  datum* out = check_vm(env, text);
+  if (out == NULL || dt_tag(out) != EXACT_NUM || dt_exact(out) != expected) {
+    printf("'%s' did not run to %ld\n", text, (long)expected);
+    abort();
+  }
+}
+
+char vm_text[26 + 200*18 + 10];
+
+void vm_test() {
+  environment* env = new_eval_env(64);
+  const char* text;
+  datum* code;
+  datum* out;
+  size_t used, i;
+
+  check_vm_exact(env, "(+ 1 2 (* 3 4))", 15);
+  check_vm_exact(env, "(define x 10) (set! x (- x 3)) x", 7);
+  check_vm_exact(env, "(define (add a b) (+ a b)) (add 2 3)", 5);
+  check_vm_exact(env, "((lambda args (car (cdr args))) 1 2 3)", 2);
+  check_vm_exact(env, "(define (adder n) (lambda (x) (+ x n))) ((adder 5) 1)", 6);
+  check_vm_exact(env, "(if (< 1 2) 1 2)", 1);
+  check_vm_exact(env, "(if (> 1 2) 1 2)", 2);
+  if (check_vm(env, "(if (> 1 2) 1)") != NULL) {
+    printf("if without else did not return nil\n");
+    abort();
+  }
+  check_vm_exact(env, "(begin 1 2 (car '(3 4)))", 3);
+  check_vm_exact(env, "(define (f n) (define (g m) (* m k)) (define k 3) (g n)) (f 5)", 15);
+  check_vm_exact(env, "(define (counter) (define n 0) (lambda () (set! n (+ n 1)) n))"
+                      "(define c (counter)) (c) (c) (c)", 3);
+
+  /* compiled and interpreted code call each other */
+  check_exact(env, "(add 20 22)", 42);
+  check_exact(env, "(c)", 4);
+  check_exact(env, "(define (twice x) (* 2 x)) (twice 4)", 8);
+  check_vm_exact(env, "(twice (add 1 2))", 6);
+
+  /* compiled once, run many times */
+  text = "(set! x (+ x 1)) x";
+  if (compile_string(env, text, strlen(text), &code) == false) {
+    printf("could not compile '%s'\n", text);
+    abort();
+  }
+  check_vm(env, "(define x 0)");
+  if (vm_run(env, code, &out) == false || vm_run(env, code, &out) == false ||
+      dt_exact(out) != 2) {
+    printf("compiled code did not run twice\n");
+    abort();
+  }
+
+  /* errors are reported when compiling or when running */
+  if (compile_string(env, "(if)", 4, &code) || env->err.code != error_bad_form) {
+    printf("expected a bad form\n");
+    abort();
+  }
+  if (compile_string(env, "(undefined 1)", 13, &code) == false ||
+      vm_run(env, code, &out) || env->err.code != error_unbound_symbol) {
+    printf("expected an unbound symbol\n");
+    abort();
+  }
+  if (compile_string(env, "(add 1)", 7, &code) == false ||
+      vm_run(env, code, &out) || env->err.code != error_arity) {
+    printf("expected an arity error\n");
+    abort();
+  }
+
+  /* a failed compilation gives back its code */
+  used = sf_used(env->vm.code);
+  if (compile_string(env, "(lambda (x) (if))", 17, &code) || sf_used(env->vm.code) != used) {
+    printf("failed compilation kept its code\n");
+    abort();
+  }
+
+  /* a global takes one constant however often it is used */
+  env = new_eval_env(64);
+  used = sf_used(env->vm.consts);
+  memcpy(vm_text, "(define n 0)(define one 1)", 26);
+  for (i = 0; i < 200; i++) {
+    memcpy(vm_text + 26 + i*18, "(set! n (+ n one))", 18);
+  }
+  memcpy(vm_text + 26 + 200*18, " (quote n)", 10);
+  if (compile_string(env, vm_text, sizeof(vm_text), &code) == false ||
+      sf_used(env->vm.consts) - used > 16*sizeof(datum*) ||
+      vm_run(env, code, &out) == false || dt_is_symbol(out) == false) {
+    printf("globals should share their constants\n");
+    abort();
+  }
+  check_vm_exact(env, "n", 200);
+
+  /* tail calls run in a constant number of calls */
+  env = new_eval_env(8);
+  check_vm_exact(env, "(define (loop n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1)))) (loop 100000 0)", 100000);
+  text = "(define (deep n) (if (= n 0) 0 (+ 1 (deep (- n 1))))) (deep 500)";
+  if (compile_string(env, text, strlen(text), &code) == false ||
+      vm_run(env, code, &out) || env->err.code != error_stack_exhausted) {
+    printf("expected the calls to be exhausted\n");
+    abort();
+  }
+  printf("vm_test: OK\n");
+}
+
+#ifdef PAMI_COMPACT
+void compact_test() {
+  env_config cfg = test_config(64);
+  environment* env = new_env(&cfg);
+  enum env_RES res;
+  size_t used = pool_used(env->pool);
+
+  if (env_new_exact(env, -5) != dt_fixnum(-5) || dt_exact(dt_fixnum(-5)) != -5 ||
+      env_new_bool(env, false) != DT_FALSE || pool_used(env->pool) != used) {
+    printf("immediates were allocated in the pool\n");
+    abort();
+  }
+  if (sizeof(datum) < 2*sizeof(datum*) || (uintptr_t)env->pool->begin%8 != 0 ||
+      env->pool->chunksize%8 != 0 || DT_BITS(env_new_pair(env, NULL, NULL)) != DT_PAIR_BITS) {
+    printf("cells of %d bytes are not aligned\n", (int)sizeof(datum));
+    abort();
+  }
+  if (env_create(env_buff + 4, sizeof(env_buff) - 4, &cfg, &res) != NULL ||
+      res != env_ERR_SMALLBUFF) {
+    printf("a misaligned buffer was accepted\n");
+    abort();
+  }
+  printf("compact_test: OK\n");
+}
+#endif
+
+void gc_test(bool incremental) {
+  env_config cfg = test_config(64);
+  environment* env;
+  datum* code;
+  datum* out;
+  size_t strings;
+  size_t i;
+
+  cfg.gc_incremental = incremental;
+  cfg.gc_reserve = incremental ? 1024 : 64;
+  cfg.gc_string_reserve = incremental ? 1024 : 256;
+  cfg.gc_step_allocs = 4;
+  cfg.gc_step_work = 64;
+  env = new_env(&cfg);
+
+  /* the cars of this list overflow the gray stack */
+  check_eval(env,
+    "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons (cons n n) acc))))"
+    "(define (sum l acc) (if (null? l) acc (sum (cdr l) (+ acc (car (car l))))))"
+    "(define big (build 1000 nil))");
+  for (i = 0; i < 20; i++) {
+    check_exact(env, "(sum big 0)", 500500);
+  }
+  gc_collect(env);
+  check_exact(env, "(sum big 0)", 500500);
+
+  /* mutations while a cycle is running go through the write barrier */
+  check_eval(env,
+    "(define (fill l n) (if (null? l) n (begin (set-car! l (cons n n)) (fill (cdr l) (+ n 1)))))");
+  for (i = 0; i < 20; i++) {
+    check_exact(env, "(fill big 1)", 1001);
+    check_exact(env, "(sum big 0)", 500500);
+  }
+
+  /* the same under the vm, its frames and constants are roots too */
+  check_vm(env,
+    "(set! big nil)"
+    "(define (vbuild n acc) (if (= n 0) acc (vbuild (- n 1) (cons (cons n n) acc))))"
+    "(define (vsum l acc) (if (null? l) acc (vsum (cdr l) (+ acc (car (car l))))))");
+  if (compile_string(env, "(vsum (vbuild 1000 nil) 0)", 26, &code) == false) {
+    printf("could not compile the vm loop\n");
+    abort();
+  }
+  for (i = 0; i < 20; i++) {
+    if (vm_run(env, code, &out) == false || dt_exact(out) != 500500) {
+      printf("vm loop failed under the collector\n");
+      abort();
+    }
+  }
+
+  /* dead string literals give their bytes back to the freelist,
+   * only the names of interned symbols remain
+   */
+  gc_collect(env);
+  strings = env->gc.strings;
+  for (i = 0; i < 1000; i++) {
+    check_eval(env, "\"a string literal that would exhaust the freelist quickly\"");
+  }
+  check_eval(env, "nil");
+  gc_collect(env);
+  if (env->gc.strings != strings) {
+    printf("strings were not collected\n");
+    abort();
+  }
+  printf("gc_test(%s): OK\n", incremental ? "incremental" : "stop the world");
+}
+
+void quota_test() {
+  env_config cfg = test_config(256);
+  environment* env;
+  env_quota q = {0, 0, 0, 0};
+  const char* text;
+  datum* code;
+  datum* out;
+  size_t used;
+
+  cfg.values = 1024;
+  env = new_env(&cfg);
+  check_eval(env,
+    "(define (spin) (spin))"
+    "(define (deep n) (if (= n 0) 0 (+ 1 (deep (- n 1)))))"
+    "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))"
+    "(define (churn n) (if (= n 0) 0 (begin (build 10 nil) (churn (- n 1)))))");
+
+  /* a runaway loop runs out of fuel, and the next evaluation gets more */
+  q.fuel = 10000;
+  env_set_quota(env, &q);
+  check_eval_err(env, "(spin)", error_quota_exceeded);
+  check_exact(env, "(deep 10)", 10);
+  text = "(spin)";
+  if (compile_string(env, text, strlen(text), &code) == false ||
+      vm_run(env, code, &out) || env->err.code != error_quota_exceeded) {
+    printf("expected the vm to run out of fuel\n");
+    abort();
+  }
+
+  /* depth is counted in continuations and in calls of the vm */
+  q.fuel = 0;
+  q.depth = 50;
+  env_set_quota(env, &q);
+  check_exact(env, "(deep 10)", 10);
+  check_eval_err(env, "(deep 100)", error_quota_exceeded);
+  text = "(define (vdeep n) (if (= n 0) 0 (+ 1 (vdeep (- n 1))))) (vdeep 100)";
+  if (compile_string(env, text, strlen(text), &code) == false ||
+      vm_run(env, code, &out) || env->err.code != error_quota_exceeded) {
+    printf("expected the vm to go too deep\n");
+    abort();
+  }
+  env_set_quota(env, NULL);
+  check_exact(env, "(deep 100)", 100);
+
+  /* cells in use are capped, garbage is collected before the cap */
+  gc_collect(env);
+  used = pool_used(env->pool)/sizeof(datum);
+  q.depth = 0;
+  q.cells = used + 300;
+  env_set_quota(env, &q);
+  check_exact(env, "(churn 1000)", 0);
+  check_eval_err(env, "(define l (build 1000 nil))", error_quota_exceeded);
+  if (pool_used(env->pool)/sizeof(datum) > used + 300) {
+    printf("went over the cell quota\n");
+    abort();
+  }
+
+  /* and bytes of strings */
+  q.cells = 0;
+  q.bytes = env->gc.strings + 32;
+  env_set_quota(env, &q);
+  check_eval(env, "\"short\"");
+  check_eval_err(env, "\"a string literal that is longer than the quota\"", error_quota_exceeded);
+
+  env_set_quota(env, NULL);
+  check_exact(env, "(define l (build 1000 nil)) (car (cdr l))", 2);
+  printf("quota_test: OK\n");
+}
+
+uint8_t step_buffs[2][1 << 18];
+
+/* runs 'p' to the end in slices of 'budget', returns the slices */
+size_t step_all(pami_instance* p, size_t budget) {
+  enum pami_RES res;
+  size_t slices = 0;
+  do {
+    res = pami_step(p, budget);
+    slices++;
+  } while (res == pami_SUSPENDED);
+  if (res != pami_OK) {
+    printf("slices failed: %d\n", pami_error(p).code);
+    abort();
+  }
+  return slices;
+}
+
+void step_test() {
+  env_config cfg = test_config(64);
+  const char* text;
+  pami_instance* a;
+  pami_instance* b;
+  enum env_RES res;
+  enum pami_RES ra, rb;
+  size_t slices;
+
+  a = pami_create(step_buffs[0], sizeof(step_buffs[0]), &cfg, &res);
+  b = pami_create(step_buffs[1], sizeof(step_buffs[1]), &cfg, &res);
+  text =
+    "(define (count n acc) (if (= n 0) acc (count (- n 1) (+ acc 1))))"
+    "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))"
+    "(define (sum l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l)))))";
+  if (a == NULL || b == NULL || pami_eval(a, text, strlen(text)) == false ||
+      pami_eval(b, text, strlen(text)) == false) {
+    printf("could not create the instances\n");
+    abort();
+  }
+
+  /* a long evaluation in small slices, it can't be interrupted by
+   * another one, but can be dropped
+   */
+  text = "(count 10000 0)";
+  if (pami_start(a, text, strlen(text)) == false || pami_step(a, 0) != pami_SUSPENDED ||
+      pami_start(a, text, strlen(text)) || pami_error(a).code != error_contract_violation ||
+      pami_eval(a, "1", 1) || pami_step(a, 100) != pami_SUSPENDED) {
+    printf("expected the evaluation to be suspended\n");
+    abort();
+  }
+  slices = step_all(a, 100);
+  if (slices < 100 || dt_exact(pami_result(a)) != 10000) {
+    printf("expected 10000 in slices, got %lu slices\n", (unsigned long)slices);
+    abort();
+  }
+  if (pami_step(a, 100) != pami_ERR || pami_start(a, text, strlen(text)) == false) {
+    printf("expected nothing to step\n");
+    abort();
+  }
+  pami_step(a, 100);
+  pami_cancel(a);
+  if (pami_eval(a, "(+ 1 2)", 7) == false || dt_exact(pami_result(a)) != 3) {
+    printf("cancelled evaluation left something behind\n");
+    abort();
+  }
+
+  /* two instances take turns, the collector runs in between */
+  text = "(sum (build 500 nil) 0)";
+  if (pami_start(a, text, strlen(text)) == false || pami_start(b, "(count 3000 7)", 14) == false) {
+    printf("could not start both\n");
+    abort();
+  }
+  do {
+    ra = pami_step(a, 7);
+    rb = pami_step(b, 7);
+  } while (ra == pami_SUSPENDED && rb == pami_SUSPENDED);
+  if ((ra == pami_SUSPENDED && step_all(a, 7) == 0) ||
+      (rb == pami_SUSPENDED && step_all(b, 7) == 0) ||
+      dt_exact(pami_result(a)) != 125250 || dt_exact(pami_result(b)) != 3007) {
+    printf("interleaved evaluations went wrong\n");
+    abort();
+  }
+
+  /* errors end the evaluation */
+  if (pami_start(a, "(car 1)", 7) == false || pami_step(a, 100) != pami_ERR ||
+      pami_error(a).code != error_contract_violation || pami_eval(a, "(+ 1 2)", 7) == false) {
+    printf("expected the evaluation to fail\n");
+    abort();
+  }
+  printf("step_test: OK\n");
+}
+
+/* collects the task whose id is the value of 'name' */
+void check_task(environment* env, const char* name, int64_t expected) {
+  int64_t id = dt_exact(check_eval(env, name));
+  datum* result;
+  error err;
+  if (sched_collect(env, id, &result, &err) != sched_DONE || result == NULL ||
+      dt_tag(result) != EXACT_NUM || dt_exact(result) != expected) {
+    printf("task %s did not end with %ld\n", name, (long)expected);
+    abort();
+  }
+  if (sched_collect(env, id, &result, &err) != sched_UNKNOWN) {
+    printf("task %s was collected twice\n", name);
+    abort();
+  }
+}
+
+uint8_t task_image[1 << 19];
+uint8_t task_buff[1 << 19];
+
+void task_test() {
+  env_config cfg = test_config(64);
+  environment* env;
+  environment* copy;
+  enum env_RES res;
+  datum* out;
+  error err;
+  size_t size;
+
+  /* tasks need room to run */
+  cfg.tasks = 8;
+  if (env_create(env_buff, sizeof(env_buff), &cfg, &res) != NULL || res != env_ERR_CONFIG) {
+    printf("expected tasks without stacks to be refused\n");
+    abort();
+  }
+  cfg.task_depth = 32;
+  cfg.task_values = 32;
+  cfg.gc_incremental = true;
+  cfg.gc_step_allocs = 4;
+  cfg.gc_step_work = 8;
+  env = new_env(&cfg);
+  check_eval(env,
+    "(define log nil)"
+    "(define (spin) (spin))"
+    "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))"
+    "(define (sum l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l)))))"
+    "(define (poll tag n) (if (= n 0) tag (begin (set! log (cons tag log)) (yield) (poll tag (- n 1)))))");
+
+  /* tasks that yield take turns */
+  check_exact(env, "(define a (spawn (lambda () (poll 1 3)))) (define b (spawn (lambda () (poll 2 3)))) b", 1);
+  if (sched_run(env, 1000, 100) != 0) {
+    printf("expected every task to be done\n");
+    abort();
+  }
+  check_task(env, "a", 1);
+  check_task(env, "b", 2);
+  check_exact(env, "(sum log 0)", 9);
+  check_exact(env, "(+ (* 10 (car log)) (car (cdr log)))", 21);
+
+  /* and the ones that don't are preempted */
+  check_exact(env,
+    "(define (count n acc) (if (= n 0) acc (count (- n 1) (+ acc (sum (build 20 nil) 0)))))"
+    "(define a (spawn spin)) (define b (spawn (lambda () (count 200 0))))"
+    "(if (= a 0) 1 0)", 0);
+  if (sched_run(env, 100, 10000) != 1 ||
+      sched_collect(env, dt_exact(check_eval(env, "a")), &out, &err) != sched_RUNNING) {
+    printf("expected the spinning task to be preempted\n");
+    abort();
+  }
+  check_task(env, "b", 200*210);
+
+  /* ids of collected tasks name no other task */
+  check_eval_err(env, "(send b 1)", error_contract_violation);
+  check_exact(env, "(define c (spawn (lambda () (receive)))) (if (= (- c b) (* 4294967296 1)) 1 0)", 1);
+  check_eval(env, "(send c 7)");
+  sched_run(env, 100, 10);
+  check_task(env, "c", 7);
+
+  /* messages are shared, not copied. a task without messages waits */
+  env = new_env(&cfg);
+  check_eval(env,
+    "(define (reply msg) (send (car msg) (+ (cdr msg) 1)))"
+    "(define (pong) (reply (receive)) (pong))"
+    "(define p (spawn pong))"
+    "(define (ask k) (send p (cons (self) k)) (receive))"
+    "(define (ping n acc) (if (= n 0) acc (ping (- n 1) (+ acc (ask n)))))"
+    "(define q (spawn (lambda () (ping 100 0))))");
+  if (sched_run(env, 50, 100000) != 0 || env->sched.tasks[0].state != ts_waiting) {
+    printf("expected pong to wait for messages\n");
+    abort();
+  }
+  check_task(env, "q", 5150);
+
+  /* failures stay in the task, until it is collected */
+  check_eval(env, "(define f (spawn (lambda () (car 1))))");
+  sched_run(env, 50, 10);
+  if (sched_collect(env, dt_exact(check_eval(env, "f")), &out, &err) != sched_FAILED ||
+      err.code != error_contract_violation) {
+    printf("expected the task to fail\n");
+    abort();
+  }
+  check_eval(env, "(define f (spawn (lambda () 3)))");
+  sched_run(env, 50, 10);
+  check_task(env, "f", 3);
+  check_eval_err(env, "(receive)", error_contract_violation);
+  check_eval_err(env, "(send 5 1)", error_contract_violation);
+
+  /* waiting tasks are saved with the rest */
+  size = env_snapshot(env, task_image, sizeof(task_image));
+  copy = env_restore(task_buff, sizeof(task_buff), task_image, size, NULL, 0, &res);
+  if (size == 0 || copy == NULL) {
+    printf("could not save the tasks\n");
+    abort();
+  }
+  memset(env_buff, 0, sizeof(env_buff));
+  check_eval(copy, "(define q (spawn (lambda () (ping 10 0))))");
+  if (sched_run(copy, 50, 100000) != 0) {
+    printf("expected the restored tasks to finish\n");
+    abort();
+  }
+  check_task(copy, "q", 65);
+  printf("task_test: OK\n");
+}
+
+uint8_t snapshot_image[1 << 18];
+uint8_t snapshot_buff[(1 << 18) + 8];
+
+void snapshot_test() {
+  env_config cfg = test_config(64);
+  environment* env;
+  environment* copy;
+  enum env_RES res;
+  size_t size;
+  datum* out;
+
+  cfg.gc_incremental = true;
+  cfg.gc_step_allocs = 4;
+  cfg.gc_step_work = 8;
+  env = new_env(&cfg);
+  check_eval(env,
+    "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))"
+    "(define (sum l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l)))))"
+    "(define l (build 100 nil))"
+    "(define name \"a string in the freelist\")"
+    "(define half 0.5)"
+    "(define (adder n) (lambda (x) (+ x n)))"
+    "(define add5 (adder 5))");
+  check_vm(env, "(define (sq n) (* n n)) (define (vsum l acc) (if (null? l) acc (vsum (cdr l) (+ acc (car l)))))");
+
+  size = env_snapshot_size(env);
+  if (size == 0 || size > sizeof(snapshot_image) ||
+      env_snapshot(env, snapshot_image, size - 1) != 0 ||
+      env_snapshot(env, snapshot_image, sizeof(snapshot_image)) != size) {
+    printf("could not take a snapshot\n");
+    abort();
+  }
+
+  /* restored somewhere else, the original is gone */
+  copy = env_restore(snapshot_buff + 8, sizeof(snapshot_buff) - 8, snapshot_image, size, NULL, 0, &res);
+  if (copy == NULL) {
+    printf("could not restore: %s\n", env_str_res(res));
+    abort();
+  }
+  memset(env_buff, 0xaa, sizeof(env_buff));
+  check_exact(copy, "(sum l 0)", 5050);
+  check_exact(copy, "(add5 1)", 6);
+  check_exact(copy, "(sq 12)", 144);
+  check_vm_exact(copy, "(vsum (build 10 nil) 0)", 55);
+  out = check_eval(copy, "name");
+  if (dt_tag(out) != STRING || dt_str(out).len != 24 ||
+      memcmp(dt_str(out).buff, "a string in the freelist", 24) != 0) {
+    printf("string was not restored\n");
+    abort();
+  }
+  out = check_eval(copy, "(+ half 1)");
+  if (dt_tag(out) != INEXACT_NUM || dt_inexact(out) != 1.5) {
+    printf("float was not restored\n");
+    abort();
+  }
+  check_symbol(check_eval(copy, "'define"), "define");
+
+  /* the restored environment can be saved again, and keeps collecting */
+  size = env_snapshot(copy, snapshot_image, sizeof(snapshot_image));
+  env = env_restore(env_buff, sizeof(env_buff), snapshot_image, size, NULL, 0, &res);
+  if (env == NULL) {
+    printf("could not restore twice: %s\n", env_str_res(res));
+    abort();
+  }
+  check_exact(env, "(define (loop n) (if (= n 0) 0 (begin (build 50 nil) (loop (- n 1))))) (loop 200)", 0);
+  check_exact(env, "(sum l 0)", 5050);
+
+  /* bad images are refused */
+  if (env_restore(snapshot_buff, sizeof(snapshot_buff), snapshot_image, size - 1, NULL, 0, &res) != NULL ||
+      res != env_ERR_IMAGE ||
+      env_restore(snapshot_buff, 64, snapshot_image, size, NULL, 0, &res) != NULL ||
+      res != env_ERR_SMALLBUFF) {
+    printf("expected bad images to be refused\n");
+    abort();
+  }
+  snapshot_image[0] ^= 1;
+  if (env_restore(snapshot_buff, sizeof(snapshot_buff), snapshot_image, size, NULL, 0, &res) != NULL ||
+      res != env_ERR_IMAGE) {
+    printf("expected a bad magic to be refused\n");
+    abort();
+  }
+  printf("snapshot_test: OK\n");
+}
+
+uint8_t rom_area[1 << 18];
+uint8_t rom_env_buff[1 << 18];
+
+const char rom_text[] =
+  "(define (square x) (* x x))"
+  "(define (sum l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l)))))"
+  "(define primes '(2 3 5 7 11 13))"
+  "(define greeting \"hello from rom\")"
+  "(define half 0.5)"
+  "(define (make-counter) (define n 0) (lambda () (set! n (+ n 1)) n))"
+  "(define count (make-counter))"
+  "(sum primes 0)";
+
+void rom_test() {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  uint8_t* rom = (uint8_t*)(((uintptr_t)rom_area + page - 1) & ~(uintptr_t)(page - 1));
+  env_config cfg = test_config(64);
+  environment* env;
+  enum env_RES res;
+  datum* code;
+  datum* out;
+  size_t size, ram, used;
+
+  /* the same program parsed into the pool, for comparison */
+  env = new_env(&cfg);
+  check_exact(env, rom_text, 41);
+  gc_collect(env);
+  ram = pool_used(env->pool);
+
+  size = rom_build(env, rom_text, strlen(rom_text), rom, sizeof(rom_area) - page, (uintptr_t)rom);
+  if (size == 0) {
+    printf("could not build the rom: %d\n", env->err.code);
+    abort();
+  }
+  /* nothing may write to it from now on */
+  if (mprotect(rom, (size + page - 1) & ~(page - 1), PROT_READ) != 0) {
+    printf("could not protect the rom\n");
+    abort();
+  }
+
+  cfg.rom = rom;
+  cfg.rom_size = size;
+  env = env_create(rom_env_buff, sizeof(rom_env_buff), &cfg, &res);
+  if (env == NULL) {
+    printf("could not create with a rom: %s\n", env_str_res(res));
+    abort();
+  }
+  if (eval_program(env, rom_program(env), &out) == false || dt_exact(out) != 41) {
+    printf("rom program did not evaluate to 41\n");
+    abort();
+  }
+  gc_collect(env);
+  used = pool_used(env->pool);
+  if (used >= ram) {
+    printf("rom program uses %lu bytes of the pool, %lu when parsed\n",
+           (unsigned long)used, (unsigned long)ram);
+    abort();
+  }
+
+  check_exact(env, "(square 12)", 144);
+  check_exact(env, "(count) (count)", 2);
+  check_exact(env, "(if (eq? (car primes) 2) 1 0)", 1);
+  check_exact(env, "(if (eq? 'square (car '(square))) 1 0)", 1);
+  out = check_eval(env, "greeting");
+  if (env_in_rom(env, out) == false || dt_str(out).len != 14 ||
+      memcmp(dt_str(out).buff, "hello from rom", 14) != 0) {
+    printf("expected the string in the rom\n");
+    abort();
+  }
+  out = check_eval(env, "(+ half 1)");
+  if (dt_inexact(out) != 1.5) {
+    printf("expected 1.5\n");
+    abort();
+  }
+
+  /* its cells are immutable, copies of them are not */
+  check_eval_err(env, "(set-car! primes 1)", error_contract_violation);
+  check_eval_err(env, "(set-cdr! (cdr primes) nil)", error_contract_violation);
+  check_exact(env, "(define l (cons 1 (cdr primes))) (set-car! l 0) (sum l 0)", 39);
+  check_exact(env, "(set! primes nil) (sum primes 0)", 0);
+
+  /* and can be compiled as well */
+  if (compile(env, rom_program(env), &code) == false || vm_run(env, code, &out) == false ||
+      dt_exact(out) != 41) {
+    printf("rom program did not run under the vm\n");
+    abort();
+  }
+  check_exact(env, "(define (loop n) (if (= n 0) 0 (begin (cons n n) (loop (- n 1))))) (loop 20000)", 0);
+  check_vm_exact(env, "(square (sum primes 0))", 1681);
+
+  /* a snapshot refers to the rom, it is restored only with it */
+  used = env_snapshot(env, snapshot_image, sizeof(snapshot_image));
+  if (used == 0 ||
+      env_restore(snapshot_buff, sizeof(snapshot_buff), snapshot_image, used, NULL, 0, &res) != NULL ||
+      res != env_ERR_IMAGE ||
+      env_restore(snapshot_buff, sizeof(snapshot_buff), snapshot_image, used, rom, size - 1, &res) != NULL ||
+      res != env_ERR_IMAGE) {
+    printf("expected the image to require its rom\n");
+    abort();
+  }
+  env = env_restore(snapshot_buff, sizeof(snapshot_buff), snapshot_image, used, rom, size, &res);
+  if (env == NULL) {
+    printf("could not restore with the rom: %s\n", env_str_res(res));
+    abort();
+  }
+  check_exact(env, "(square 12)", 144);
+  check_exact(env, "(if (eq? (car (cdr l)) 3) 1 0)", 1);
+
+  cfg.rom_size = size - 1;
+  if (env_create(rom_env_buff, sizeof(rom_env_buff), &cfg, &res) != NULL || res != env_ERR_IMAGE) {
+    printf("expected a bad rom to be refused\n");
+    abort();
+  }
+  mprotect(rom, (size + page - 1) & ~(page - 1), PROT_READ | PROT_WRITE);
+  printf("rom_test: OK\n");
+}
+
+#define BATCH_WORKERS 4
+#define BATCH_JOBS 1000
+
+const char batch_rom_text[] =
+  "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))";
+
+const char batch_leak[] = "(define leak 1) (fib 12)";
+const char batch_peek[] = "leak";
+const char batch_loop[] = "(define (loop) (loop)) (loop)";
+
+uint8_t batch_buff[1 << 21];
+pami_job batch_jobs[BATCH_JOBS];
+int64_t batch_results[BATCH_JOBS];
+
+void batch_done(pami_instance* p, pami_job* job, void* ctx) {
+  (void)ctx;
+  if (job->ok) {
+    batch_results[job - batch_jobs] = dt_exact(pami_result(p));
+  }
+}
+
+void batch_test() {
+  env_config cfg = test_config(64);
+  env_quota quota = {200000, 0, 0, 0};
+  pami_batch_config bc;
+  environment* env;
+  pami_instance* p;
+  enum env_RES res;
+  size_t size, used, i;
+
+  env = new_env(&cfg);
+  size = rom_build(env, batch_rom_text, strlen(batch_rom_text), rom_area, sizeof(rom_area),
+                   (uintptr_t)rom_area);
+  if (size == 0) {
+    printf("could not build the rom\n");
+    abort();
+  }
+  cfg.rom = rom_area;
+  cfg.rom_size = size;
+
+  /* a reset instance is the same as a new one */
+  p = pami_create(batch_buff, sizeof(batch_buff), &cfg, &res);
+  if (p == NULL) {
+    printf("could not create the instance: %s\n", env_str_res(res));
+    abort();
+  }
+  used = pool_used(p->env->pool);
+  if (pami_eval(p, batch_leak, strlen(batch_leak)) == false || pami_reset(p) != env_OK ||
+      pool_used(p->env->pool) != used) {
+    printf("reset did not free the pool\n");
+    abort();
+  }
+  if (pami_eval(p, batch_peek, strlen(batch_peek)) || pami_error(p).code != error_unbound_symbol ||
+      pami_eval(p, "(fib 10)", 8) == false || dt_exact(pami_result(p)) != 55) {
+    printf("reset did not forget the definitions\n");
+    abort();
+  }
+
+  /* no job sees what the one before it defined */
+  for (i = 0; i < BATCH_JOBS; i++) {
+    batch_jobs[i].text = i%2 == 0 ? batch_leak : batch_peek;
+    batch_jobs[i].size = strlen(batch_jobs[i].text);
+    batch_jobs[i].worker = BATCH_WORKERS;
+    batch_results[i] = -1;
+  }
+  batch_jobs[BATCH_JOBS/2].text = batch_loop;
+  batch_jobs[BATCH_JOBS/2].size = strlen(batch_loop);
+  bc.workers = BATCH_WORKERS;
+  bc.quota = &quota;
+  bc.done = batch_done;
+  bc.ctx = NULL;
+
+  if (pami_batch(batch_buff, pami_batch_size(&cfg, BATCH_WORKERS) - 1, &cfg, &bc,
+                 batch_jobs, BATCH_JOBS) != env_ERR_SMALLBUFF) {
+    printf("expected the region to be too small\n");
+    abort();
+  }
+  res = pami_batch(batch_buff, sizeof(batch_buff), &cfg, &bc, batch_jobs, BATCH_JOBS);
+  if (res != env_OK) {
+    printf("batch failed: %s\n", env_str_res(res));
+    abort();
+  }
+  for (i = 0; i < BATCH_JOBS; i++) {
+    if (batch_jobs[i].worker >= BATCH_WORKERS) {
+      printf("job %lu was not run\n", (unsigned long)i);
+      abort();
+    }
+#ifndef PAMI_THREADS
+    /* the first worker steals every job before the others start */
+    if (batch_jobs[i].worker != 0) {
+      printf("job %lu was not stolen\n", (unsigned long)i);
+      abort();
+    }
+#endif
+    if (i == BATCH_JOBS/2) {
+      if (batch_jobs[i].ok || batch_jobs[i].err.code != error_quota_exceeded) {
+        printf("the loop was not stopped\n");
+        abort();
+      }
+    } else if (i%2 == 0) {
+      if (batch_jobs[i].ok == false || batch_results[i] != 144) {
+        printf("job %lu did not evaluate to 144\n", (unsigned long)i);
+        abort();
+      }
+    } else if (batch_jobs[i].ok || batch_jobs[i].err.code != error_unbound_symbol) {
+      printf("job %lu saw a definition of another job\n", (unsigned long)i);
+      abort();
+    }
+  }
+  printf("batch_test: OK\n");
+}
+
+#ifdef PAMI_THREADS
+#define THREADS 8
+#define INSTANCES 32
+
+const char instance_rom_text[] =
+  "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+  "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))"
+  "(define (sum l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l)))))";
+
+const char instance_round[] = "(set! seed (+ seed 1)) (+ seed (fib 12) (sum (build 100 nil) 0))";
+
+uint8_t instance_buffs[INSTANCES][1 << 18];
+
+typedef struct {
+  env_config cfg;
+  size_t first;  /* instances first, first + THREADS, ... */
+  size_t failures;
+} instance_thread;
+
+void* instance_run(void* arg) {
+  instance_thread* t = (instance_thread*)arg;
+  pami_instance* p[INSTANCES/THREADS];
+  enum env_RES res;
+  char text[64];
+  datum* out;
+  size_t i, n, round;
+
+  for (i = 0, n = t->first; n < INSTANCES; i++, n += THREADS) {
+    p[i] = pami_create(instance_buffs[n], sizeof(instance_buffs[n]), &t->cfg, &res);
+    snprintf(text, sizeof(text), "(define seed %lu)", (unsigned long)n);
+    if (p[i] == NULL || pami_eval(p[i], text, strlen(text)) == false) {
+      t->failures++;
+      return NULL;
+    }
+  }
+
+  /* every instance of the thread takes turns, with its own state */
+  for (round = 0; round < 50; round++) {
+    for (i = 0, n = t->first; n < INSTANCES; i++, n += THREADS) {
+      if (pami_eval(p[i], instance_round, strlen(instance_round)) == false) {
+        t->failures++;
+        continue;
+      }
+      out = pami_result(p[i]);
+      if (dt_exact(out) != (int64_t)(n + round + 1 + 144 + 5050)) {
+        t->failures++;
+      }
+    }
+  }
+  return NULL;
+}
+
+#define CPOOL_THREADS 8
+#define CPOOL_HOLD 64
+#define CPOOL_OPS 200000
+
+/* fewer chunks than the threads could hold, so some allocations fail */
+uint8_t cpool_buff[(CPOOL_THREADS*CPOOL_HOLD/2)*48];
+cpool* cpool_shared;
+
+typedef struct {
+  uint64_t id;
+  cpool_cache cache;
+  size_t failures;
+} cpool_thread;
+
+/* every chunk held is filled with the owner and a sequence number,
+ * a chunk given to two threads at once would be overwritten
+ */
+void* cpool_run(void* arg) {
+  cpool_thread* t = (cpool_thread*)arg;
+  uint64_t* held[CPOOL_HOLD];
+  uint64_t rng = t->id*2654435761u + 1;
+  uint64_t seq = 0;
+  size_t n = 0, i, j;
+
+  cpool_cache_init(&t->cache);
+  for (i = 0; i < CPOOL_OPS; i++) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    if (n == 0 || (n < CPOOL_HOLD && rng%2 == 0)) {
+      held[n] = cpool_alloc(cpool_shared, &t->cache);
+      if (held[n] != NULL) {
+        for (j = 0; j < 4; j++) {
+          held[n][j] = t->id << 32 | seq;
+        }
+        seq++;
+        n++;
+      }
+      continue;
+    }
+    j = (size_t)(rng >> 8)%n;
+    if (held[j][0] != held[j][3] || held[j][0] >> 32 != t->id ||
+        cpool_free(cpool_shared, &t->cache, held[j]) != pool_OK) {
+      t->failures++;
+    }
+    held[j] = held[--n];
+  }
+  while (n > 0) {
+    cpool_free(cpool_shared, &t->cache, held[--n]);
+  }
+  cpool_flush(cpool_shared, &t->cache);
+  return NULL;
+}
+
+void cpool_stress_test() {
+  cpool_thread threads[CPOOL_THREADS];
+  pthread_t ids[CPOOL_THREADS];
+  enum pool_RES res;
+  size_t allocs = 0, frees = 0, i;
+
+  cpool_shared = cpool_create(cpool_buff, sizeof(cpool_buff), 32, &res);
+  if (cpool_shared == NULL) {
+    printf("could not create the concurrent pool: %s\n", pool_str_res(res));
+    abort();
+  }
+  for (i = 0; i < CPOOL_THREADS; i++) {
+    threads[i].id = i + 1;
+    threads[i].failures = 0;
+    if (pthread_create(&ids[i], NULL, cpool_run, &threads[i]) != 0) {
+      printf("could not start thread %lu\n", (unsigned long)i);
+      abort();
+    }
+  }
+  for (i = 0; i < CPOOL_THREADS; i++) {
+    pthread_join(ids[i], NULL);
+    if (threads[i].failures != 0) {
+      printf("thread %lu found %lu chunks overwritten\n", (unsigned long)i,
+             (unsigned long)threads[i].failures);
+      abort();
+    }
+    allocs += threads[i].cache.allocs;
+    frees += threads[i].cache.frees;
+  }
+  if (allocs != frees || allocs < CPOOL_THREADS*CPOOL_OPS/4 ||
+      cpool_available(cpool_shared) != cpool_shared->nchunks*32) {
+    printf("chunks were lost: %lu allocs, %lu frees\n", (unsigned long)allocs, (unsigned long)frees);
+    abort();
+  }
+  printf("cpool_stress_test: OK\n");
+}
+
+void instance_test() {
+  instance_thread threads[THREADS];
+  pthread_t ids[THREADS];
+  env_config cfg = test_config(64);
+  environment* env;
+  pami_instance* p;
+  enum env_RES res;
+  size_t size, i;
+
+  /* they all evaluate the same library in place */
+  env = new_env(&cfg);
+  size = rom_build(env, instance_rom_text, strlen(instance_rom_text), rom_area, sizeof(rom_area),
+                   (uintptr_t)rom_area);
+  if (size == 0) {
+    printf("could not build the rom\n");
+    abort();
+  }
+  cfg.rom = rom_area;
+  cfg.rom_size = size;
+
+  p = pami_create(instance_buffs[0], pami_size(&cfg) - 1, &cfg, &res);
+  if (p != NULL || res != env_ERR_SMALLBUFF) {
+    printf("expected the region to be too small\n");
+    abort();
+  }
+  p = pami_create(instance_buffs[0], sizeof(instance_buffs[0]), &cfg, &res);
+  if (p == NULL || pami_eval(p, "(fib 1", 6) || pami_error(p).code != error_unexpected_lexeme ||
+      pami_eval(p, "(fib 10)", 8) == false || dt_exact(pami_result(p)) != 55) {
+    printf("single instance failed\n");
+    abort();
+  }
+
+  for (i = 0; i < THREADS; i++) {
+    threads[i].cfg = cfg;
+    threads[i].first = i;
+    threads[i].failures = 0;
+    if (pthread_create(&ids[i], NULL, instance_run, &threads[i]) != 0) {
+      printf("could not start thread %lu\n", (unsigned long)i);
+      abort();
+    }
+  }
+  for (i = 0; i < THREADS; i++) {
+    pthread_join(ids[i], NULL);
+    if (threads[i].failures != 0) {
+      printf("thread %lu failed %lu times\n", (unsigned long)i, (unsigned long)threads[i].failures);
+      abort();
+    }
+  }
+  printf("instance_test: OK\n");
+}
+#endif
+
 int main() {
   utf8_test();
+  scan_test();
+  stream_test();
+  number_test();
+  pool_test();
+  cpool_test();
+  freelist_test();
+  hashmap_test();
+  parse_test();
+  eval_test();
+  vm_test();
+#ifdef PAMI_COMPACT
+  compact_test();
+#endif
+  gc_test(false);
+  gc_test(true);
+  quota_test();
+  step_test();
+  task_test();
+  snapshot_test();
+  rom_test();
+  batch_test();
+#ifdef PAMI_THREADS
+  cpool_stress_test();
+  instance_test();
+#endif
 
   printf("%s", lex_test_data);
   lexer l = lex_new_lexer(lex_test_data, strlen(lex_test_data));